@@ -0,0 +1,128 @@
+/*
+ * Microbenchmark for the register sum kernels used by the
+ * cardinality estimator. For each precision this reports the
+ * time to sum a full set of registers with the original
+ * pow() loop and with every kernel the CPU supports, as well
+ * as the end to end time of hll_size(). It also reports the
+ * throughput of each value hash for a few value lengths.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "hll.h"
+#include "hash.h"
+
+static int ITERATIONS = 50;
+static const char *KERNELS[] = {"scalar", "sse4.1", "avx2"};
+#define NUM_KERNELS 3
+
+static uint64_t now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static uint64_t rand64() {
+    return ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ rand();
+}
+
+// The estimator loop before the kernels were added
+static double sum_with_pow(const unsigned char *regs, int num_reg, int *num_zero) {
+    double inv_sum = 0;
+    for (int i=0; i < num_reg; i++) {
+        inv_sum += pow(2.0, -1 * regs[i]);
+        if (!regs[i]) *num_zero += 1;
+    }
+    return inv_sum;
+}
+
+// Hashes values of a few lengths with every algorithm
+static void bench_hashes(void) {
+    static const int LENGTHS[] = {8, 16, 32, 64, 256};
+    static const hash_algorithm ALGORITHMS[] = {HASH_MURMUR3, HASH_XXH64};
+    const int num_values = 1 << 20;
+
+    char buf[256 + 64];
+    for (size_t i=0; i < sizeof(buf); i++) buf[i] = 'a' + rand() % 26;
+
+    printf("\n%8s", "len");
+    for (int a=0; a < 2; a++) printf(" %10s(MB/s)", hash_algorithm_name(ALGORITHMS[a]));
+    printf("\n");
+
+    volatile uint64_t sink = 0;
+    for (int l=0; l < (int)(sizeof(LENGTHS) / sizeof(LENGTHS[0])); l++) {
+        printf("%8d", LENGTHS[l]);
+        for (int a=0; a < 2; a++) {
+            uint64_t start = now_usec();
+            for (int i=0; i < num_values; i++) {
+                sink += hash_value_with(ALGORITHMS[a], buf + (i & 63), LENGTHS[l]);
+            }
+            double secs = (double)(now_usec() - start) / 1e6;
+            printf(" %16.1f", (double)num_values * LENGTHS[l] / secs / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) ITERATIONS = atoi(argv[1]);
+    srand(42);
+
+    printf("Default kernel: %s, %d iterations\n", hll_sum_kernel_name(), ITERATIONS);
+    printf("%4s %12s", "prec", "pow(us)");
+    for (int k=0; k < NUM_KERNELS; k++) printf(" %10s(us)", KERNELS[k]);
+    printf(" %14s\n", "hll_size(us)");
+
+    volatile double sink = 0;
+    for (int prec=HLL_MIN_PRECISION; prec <= HLL_MAX_PRECISION; prec++) {
+        int num_reg = NUM_REG(prec);
+
+        // Fill a set to roughly 4 values per register
+        hll_t h;
+        hll_init(prec, 3600, 1, &h);
+        for (int i=0; i < 4 * num_reg; i++) {
+            hll_add_hash_at_time(&h, rand64(), 1000 + (i % 3600));
+        }
+        unsigned char *regs = (unsigned char*)malloc(num_reg);
+        for (int i=0; i < num_reg; i++) {
+            regs[i] = hll_get_register(&h, i, 4600, 3600);
+        }
+
+        uint64_t start = now_usec();
+        for (int it=0; it < ITERATIONS; it++) {
+            int num_zero = 0;
+            sink += sum_with_pow(regs, num_reg, &num_zero);
+        }
+        printf("%4d %12.2f", prec, (double)(now_usec() - start) / ITERATIONS);
+
+        for (int k=0; k < NUM_KERNELS; k++) {
+            if (hll_use_sum_kernel(KERNELS[k])) {
+                printf(" %14s", "n/a");
+                continue;
+            }
+            start = now_usec();
+            for (int it=0; it < ITERATIONS; it++) {
+                double inv_sum;
+                int num_zero;
+                hll_sum_registers(regs, num_reg, &inv_sum, &num_zero);
+                sink += inv_sum;
+            }
+            printf(" %14.2f", (double)(now_usec() - start) / ITERATIONS);
+        }
+
+        hll_use_sum_kernel(NULL);
+        start = now_usec();
+        for (int it=0; it < ITERATIONS; it++) {
+            sink += hll_size(&h, 4600, 3600);
+        }
+        printf(" %14.2f\n", (double)(now_usec() - start) / ITERATIONS);
+
+        free(regs);
+        hll_destroy(&h);
+    }
+
+    bench_hashes();
+    return 0;
+}
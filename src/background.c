@@ -145,6 +145,11 @@ static void* flush_thread_main(void *in) {
                 node = node->next;
             }
 
+            // Write back the cached sparse sets
+            if (setmgr_flush_sparse_sets(mgr)) {
+                syslog(LOG_WARNING, "Failed to flush sparse sets!");
+            }
+
             // Compute the elapsed time
             gettimeofday(&end, NULL);
             syslog(
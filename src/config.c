@@ -10,6 +10,7 @@
 #include "hll.h"
 #include "config.h"
 #include "convert.h"
+#include "hash.h"
 #include "ini.h"
 
 /**
@@ -34,6 +35,12 @@ static const struct hlld_config DEFAULT_CONFIG = {
     2592000,            // Default to 30 days of storage
     60,                 // Default to minute level granularity
     134217728,          // Default to 128mb for sparse memtable
+    (char*)"murmur3",   // Hash values with MurmurHash3
+    HASH_MURMUR3,
+    67108864,           // Default to 64mb for cached sparse sets
+    (char*)"async",     // Write ahead log without syncing
+    DURABILITY_ASYNC,
+    0,                  // Keep sparse timestamps to the second
 };
 
 
@@ -76,6 +83,10 @@ static int config_callback(void* user, const char* section, const char* name, co
         return value_to_int(value, &config->in_memory);
     } else if (NAME_MATCH("use_mmap")) {
         return value_to_int(value, &config->use_mmap);
+    } else if (NAME_MATCH("sparse_cache_memory")) {
+        return value_to_int(value, &config->sparse_cache_memory);
+    } else if (NAME_MATCH("sparse_quantize")) {
+        return value_to_int(value, &config->sparse_quantize);
     } else if (NAME_MATCH("workers")) {
         return value_to_int(value, &config->worker_threads);
     } else if (NAME_MATCH("default_precision")) {
@@ -103,6 +114,10 @@ static int config_callback(void* user, const char* section, const char* name, co
         config->log_level = strdup(value);
     } else if (NAME_MATCH("bind_address")) {
         config->bind_address = strdup(value);
+    } else if (NAME_MATCH("hash")) {
+        config->hash = strdup(value);
+    } else if (NAME_MATCH("durability")) {
+        config->durability = strdup(value);
 
         // Unknown parameter?
     } else {
@@ -320,6 +335,44 @@ int sane_worker_threads(int threads) {
     return 0;
 }
 
+int sane_hash(char *hash, int *algorithm) {
+    int res = hash_algorithm_from_name(hash);
+    if (res < 0) {
+        syslog(LOG_ERR, "Unknown hash algorithm! Must be murmur3 or xxh64.");
+        return 1;
+    }
+    *algorithm = res;
+    return 0;
+}
+
+int sane_durability(char *durability, int *level) {
+    if (strcasecmp(durability, "none") == 0) {
+        syslog(LOG_WARNING,
+                "Write ahead log disabled, a crash can lose recent sparse writes.");
+        *level = DURABILITY_NONE;
+    } else if (strcasecmp(durability, "async") == 0) {
+        *level = DURABILITY_ASYNC;
+    } else if (strcasecmp(durability, "sync") == 0) {
+        *level = DURABILITY_SYNC;
+    } else {
+        syslog(LOG_ERR, "Unknown durability! Must be none, async or sync.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_sparse_cache_memory(int memory) {
+    if (memory < 0) {
+        syslog(LOG_ERR,
+                "Sparse cache memory cannot be negative!");
+        return 1;
+    } else if (memory == 0) {
+        syslog(LOG_WARNING,
+                "Sparse cache disabled, every sparse write goes to rocksdb.");
+    }
+    return 0;
+}
+
 
 /**
  * Validates the configuration
@@ -338,6 +391,9 @@ int validate_config(struct hlld_config *config) {
     res |= sane_in_memory(config->in_memory);
     res |= sane_use_mmap(config->use_mmap);
     res |= sane_worker_threads(config->worker_threads);
+    res |= sane_hash(config->hash, &config->hash_algorithm);
+    res |= sane_sparse_cache_memory(config->sparse_cache_memory);
+    res |= sane_durability(config->durability, &config->durability_level);
 
     return res;
 }
@@ -3,6 +3,15 @@
 #include <stdint.h>
 #include <syslog.h>
 
+/**
+ * How sparse writes are persisted
+ */
+typedef enum {
+    DURABILITY_NONE = 0,    // No write ahead log, lost on a crash
+    DURABILITY_ASYNC,       // Write ahead log, not synced
+    DURABILITY_SYNC         // Write ahead log, synced on each write
+} durability_level;
+
 /**
  * Stores our configuration
  */
@@ -23,6 +32,12 @@ struct hlld_config {
     int sliding_period;
     int sliding_precision;
     int memtable_memory;
+    char *hash;
+    int hash_algorithm;
+    int sparse_cache_memory;
+    char *durability;
+    int durability_level;
+    int sparse_quantize;
 };
 
 /**
@@ -84,6 +99,9 @@ int sane_cold_interval(int intv);
 int sane_in_memory(int in_mem);
 int sane_use_mmap(int use_mmap);
 int sane_worker_threads(int threads);
+int sane_hash(char *hash, int *algorithm);
+int sane_sparse_cache_memory(int memory);
+int sane_durability(char *durability, int *level);
 
 /**
  * Joins two strings as part of a path,
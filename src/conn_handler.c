@@ -40,16 +40,22 @@ static void handle_detail_cmd(hlld_conn_handler *handle, char **args, int *args_
 static void handle_get_hashes_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
 static void handle_flush_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
 static void handle_size_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
+static void handle_size_multi_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
+static void handle_size_keys_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
+static void handle_set_hashes_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
 
 static void handle_info_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
 static void handle_stats_cmd(hlld_conn_handler *handle, char **args, int *args_len, int arg_count);
 
-static inline void handle_set_cmd_resp(hlld_conn_handler *handle, int res);
+static inline void handle_set_cmd_resp(hlld_conn_handler *handle, char *set_name, int set_name_len, int res);
+static void fail_set_acks(void *data, const char *full_key, int full_key_len);
 static inline void handle_client_resp(hlld_conn_info *conn, char* resp_mesg, int resp_len);
 static inline void handle_string_resp(hlld_conn_info *conn, char* resp_mesg, int resp_len);
 static void handle_client_err(hlld_conn_info *conn, char* err_msg, int msg_len);
 
 static conn_cmd_type determine_client_command(char *cmd);
+static int parse_time_window(char *time_window_str, uint64_t *time_window);
+static int parse_hash(const char *arg, int arg_len, uint64_t *hash);
 
 // Simple struct to hold data for a callback
 typedef struct {
@@ -82,13 +88,20 @@ int handle_client_connect(hlld_conn_handler *handle) {
     char *args[MAX_ARGS];
     int args_len[MAX_ARGS];
 
+    // Group the writes of every command buffered on the connection.
+    // Replies are held until the commit, which may still fail acks.
+    setmgr_begin_batch(handle->mgr);
+    hold_client_responses(handle->conn);
+
     int status;
     while (1) {
         status = extract_command(handle->conn, args, args_len, MAX_ARGS, &arg_count, &free_arg);
         if (status == EXTRACT_NO_DATA) {
-          return 0;
+          status = 0;
+          break;
         } else if (status < 0) {
-          return -1;
+          status = -1;
+          break;
         }
 
         // Determine the command type
@@ -140,6 +153,15 @@ int handle_client_connect(hlld_conn_handler *handle) {
             case SIZE:
                 handle_size_cmd(handle, args + 1, args_len + 1, arg_count - 1);
                 break;
+            case SIZE_MULTI:
+                handle_size_multi_cmd(handle, args + 1, args_len + 1, arg_count - 1);
+                break;
+            case SIZE_KEYS:
+                handle_size_keys_cmd(handle, args + 1, args_len + 1, arg_count - 1);
+                break;
+            case SET_HASHES:
+                handle_set_hashes_cmd(handle, args + 1, args_len + 1, arg_count - 1);
+                break;
             default:
                 handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
                 break;
@@ -150,6 +172,20 @@ int handle_client_connect(hlld_conn_handler *handle) {
           free(args[free_arg]);
         }
     }
+
+    // Acks of writes to sets that failed to be written back become errors
+    setmgr_commit_batch(handle->mgr, fail_set_acks, handle);
+    release_client_responses(handle->conn);
+    return status;
+}
+
+/**
+ * Fails the held acks of the writes to a set
+ * that a batch commit did not write back.
+ */
+static void fail_set_acks(void *data, const char *full_key, int full_key_len) {
+    hlld_conn_handler *handle = (hlld_conn_handler*)data;
+    fail_client_acks(handle->conn, full_key, full_key_len, (char*)INTERNAL_ERR, INTERNAL_ERR_LEN);
 }
 
 /**
@@ -246,24 +282,7 @@ static void handle_size_cmd(hlld_conn_handler *handle, char **args, int *args_le
 
     // Fetch the time window
     uint64_t time_window;
-    if (isdigit(time_window_str[0])) {
-      err = value_to_int64(time_window_str, &time_window);
-      if (err || time_window <= 0) BAD_ARG_ERR();
-    } else if (strcasecmp(time_window_str, "minute") == 0) {
-      time_window = 60;
-    } else if (strcasecmp(time_window_str, "hour") == 0) {
-      time_window = 3600;
-    } else if (strcasecmp(time_window_str, "day") == 0) {
-      time_window = 3600 * 24;
-    } else if (strcasecmp(time_window_str, "week") == 0) {
-      time_window = 3600 * 24 * 7;
-    } else if (strcasecmp(time_window_str, "month") == 0) {
-      time_window = 3600 * 24 * 30;
-    } else if (strcasecmp(time_window_str, "year") == 0) {
-      time_window = 3600 * 24 * 365;
-    } else {
-      BAD_ARG_ERR();
-    }
+    if (parse_time_window(time_window_str, &time_window)) BAD_ARG_ERR();
 
     // Build up the estimate and return it
     uint64_t estimate;
@@ -283,6 +302,95 @@ static void handle_size_cmd(hlld_conn_handler *handle, char **args, int *args_le
     handle_client_resp(handle->conn, estimate_string, estimate_length);
 }
 
+/**
+ * Internal method to handle a command that returns the estimated size
+ * of a set for several time windows ending at the same timestamp.
+ * The response is an array with one estimate per window.
+ */
+static void handle_size_multi_cmd(hlld_conn_handler *handle, char **args, int *args_len, int args_count) {
+    int err;
+
+    // Need a set, a timestamp and at least one window
+    if (args_count < 3) BAD_ARG_ERR();
+    if (args_len[0] < 1) BAD_ARG_ERR();
+
+    // Interpret the timestamp
+    uint64_t timestamp_64;
+    err = value_to_int64(args[1], &timestamp_64);
+    if (err || timestamp_64 <= 0) BAD_ARG_ERR();
+    time_t timestamp = (time_t) timestamp_64;
+
+    // Fetch the time windows
+    int num_windows = args_count - 2;
+    uint64_t time_windows[MAX_ARGS];
+    for (int i = 0; i < num_windows; i++) {
+        if (args_len[i + 2] < 1) BAD_ARG_ERR();
+        if (parse_time_window(args[i + 2], &time_windows[i])) BAD_ARG_ERR();
+    }
+
+    // Build up the estimates and return them
+    uint64_t estimates[MAX_ARGS];
+    err = setmgr_set_size_multi(handle->mgr, args[0], args_len[0], timestamp, time_windows, num_windows, estimates);
+    if (err) {
+      INTERNAL_ERROR();
+      return;
+    }
+
+    // Each entry is at most ":" + 20 digits + "\r\n"
+    char buffer[32 + MAX_ARGS * 24];
+    int len = snprintf(buffer, sizeof(buffer), "*%d\r\n", num_windows);
+    for (int i = 0; i < num_windows; i++) {
+        len += snprintf(buffer + len, sizeof(buffer) - len, ":%lld\r\n", (long long)estimates[i]);
+    }
+
+    handle_client_resp(handle->conn, buffer, len);
+}
+
+/**
+ * Internal method to handle a command that returns the estimated
+ * size of several sets over the same time window. The response is
+ * an array with one estimate per set.
+ */
+static void handle_size_keys_cmd(hlld_conn_handler *handle, char **args, int *args_len, int args_count) {
+    int err;
+
+    // Need a timestamp, a window and at least one set
+    if (args_count < 3) BAD_ARG_ERR();
+
+    // Interpret the timestamp
+    uint64_t timestamp_64;
+    err = value_to_int64(args[0], &timestamp_64);
+    if (err || timestamp_64 <= 0) BAD_ARG_ERR();
+    time_t timestamp = (time_t) timestamp_64;
+
+    // Fetch the time window
+    uint64_t time_window;
+    if (args_len[1] < 1) BAD_ARG_ERR();
+    if (parse_time_window(args[1], &time_window)) BAD_ARG_ERR();
+
+    int num_sets = args_count - 2;
+    for (int i = 0; i < num_sets; i++) {
+        if (args_len[i + 2] < 1) BAD_ARG_ERR();
+    }
+
+    // Build up the estimates and return them
+    uint64_t estimates[MAX_ARGS];
+    err = setmgr_set_size_keys(handle->mgr, args + 2, args_len + 2, num_sets, timestamp, time_window, estimates);
+    if (err) {
+      INTERNAL_ERROR();
+      return;
+    }
+
+    // Each entry is at most ":" + 20 digits + "\r\n"
+    char buffer[32 + MAX_ARGS * 24];
+    int len = snprintf(buffer, sizeof(buffer), "*%d\r\n", num_sets);
+    for (int i = 0; i < num_sets; i++) {
+        len += snprintf(buffer + len, sizeof(buffer) - len, ":%lld\r\n", (long long)estimates[i]);
+    }
+
+    handle_client_resp(handle->conn, buffer, len);
+}
+
 
 /**
  * Internal method to handle a command that relies
@@ -317,17 +425,19 @@ static void handle_set_multi_cmd(hlld_conn_handler *handle, char **args, int *ar
     int res = 0;
     int index = 0;
     char *key_buf[MULTI_OP_SIZE];
+    int key_len_buf[MULTI_OP_SIZE];
 
     for (int arg = 2; arg < args_count; arg++) {
         if (err || args_len[arg] < 1) CHECK_ARG_ERR();
 
         // Set the key
+        key_len_buf[index] = args_len[arg];
         key_buf[index++] = args[arg];
 
         // If we have filled the buffer, check now
         if (index == MULTI_OP_SIZE) {
             // Handle the keys now
-            res = setmgr_set_keys(handle->mgr, args[0], args_len[0], (char**)&key_buf, index, timestamp);
+            res = setmgr_set_keys(handle->mgr, args[0], args_len[0], (char**)&key_buf, key_len_buf, index, timestamp);
             if (res) goto SEND_RESULT;
 
             // Reset the index
@@ -337,12 +447,56 @@ static void handle_set_multi_cmd(hlld_conn_handler *handle, char **args, int *ar
 
     // Handle any remaining keys
     if (index) {
-        res = setmgr_set_keys(handle->mgr, args[0], args_len[0], key_buf, index, timestamp);
+        res = setmgr_set_keys(handle->mgr, args[0], args_len[0], key_buf, key_len_buf, index, timestamp);
     }
 
 SEND_RESULT:
     // Generate the response
-    handle_set_cmd_resp(handle, res);
+    handle_set_cmd_resp(handle, args[0], args_len[0], res);
+}
+
+
+/**
+ * Internal method to handle a command that adds hashes
+ * computed by the client to a set. Hashes skip the server
+ * side hash and go straight to the sparse or dense set.
+ */
+static void handle_set_hashes_cmd(hlld_conn_handler *handle, char **args, int *args_len, int args_count) {
+    int err;
+
+    // Extract the set name
+    if (args_count < 3) CHECK_ARG_ERR();
+    if (args_len[0] < 1) CHECK_ARG_ERR();
+    if (args_len[1] < 1) CHECK_ARG_ERR();
+
+    // Interpret the timestamp
+    uint64_t timestamp_64;
+    err = value_to_int64(args[1], &timestamp_64);
+    if (err || timestamp_64 <= 0) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    time_t timestamp = (time_t) timestamp_64;
+
+    // Validate every hash before adding any of them
+    uint64_t hashes[MAX_ARGS];
+    int num_hashes = args_count - 2;
+    for (int i = 0; i < num_hashes; i++) {
+        if (parse_hash(args[i + 2], args_len[i + 2], &hashes[i])) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    // Add the hashes in batches
+    int res = 0;
+    for (int i = 0; i < num_hashes && !res; i += MULTI_OP_SIZE) {
+        int batch = num_hashes - i < MULTI_OP_SIZE ? num_hashes - i : MULTI_OP_SIZE;
+        res = setmgr_set_hashes(handle->mgr, args[0], args_len[0], hashes + i, batch, timestamp);
+    }
+
+    // Generate the response
+    handle_set_cmd_resp(handle, args[0], args_len[0], res);
 }
 
 
@@ -522,6 +676,7 @@ static int detail_dense_set_cb(void *data, char *full_key, struct hlld_set *set)
 in_memory:%d\n\
 page_ins:%llu\n\
 page_outs:%llu\n\
+expired:%llu\n\
 epsilon:%f\n\
 precision:%u\n\
 sets:%llu\n\
@@ -529,6 +684,7 @@ size:%llu\n\
 storage:%llu\n",
     ((hset_is_proxied(set)) ? 0 : 1),
     (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
+    (unsigned long long)counters->expired,
     set->set_config.default_eps,
     set->set_config.default_precision,
     (unsigned long long)sets,
@@ -686,12 +842,13 @@ static void handle_flush_cmd(hlld_conn_handler *handle, char **args, int *args_l
 
 /**
  * Sends a client response message back for a simple set command
- * Simple convenience wrapper around handle_client_resp.
+ * Simple convenience wrapper around handle_client_resp. The ack
+ * is held until the batch is committed, which may still fail it.
  */
-static inline void handle_set_cmd_resp(hlld_conn_handler *handle, int res) {
+static inline void handle_set_cmd_resp(hlld_conn_handler *handle, char *set_name, int set_name_len, int res) {
     switch (res) {
         case 0:
-            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            send_client_ack(handle->conn, set_name, set_name_len, (char*)DONE_RESP, DONE_RESP_LEN);
             break;
         case -2:
             handle_client_resp(handle->conn, (char*)SET_NOT_PROXIED, SET_NOT_PROXIED_LEN);
@@ -744,6 +901,67 @@ static void handle_client_err(hlld_conn_info *conn, char* err_msg, int msg_len)
 }
 
 
+/**
+ * Parses a hash sent by a client, either as 8 bytes
+ * in network byte order or as 16 hex digits.
+ * @arg arg The argument
+ * @arg arg_len The length of the argument
+ * @arg hash Output, the hash
+ * @return 0 on success, -1 if the hash is invalid.
+ */
+static int parse_hash(const char *arg, int arg_len, uint64_t *hash) {
+    uint64_t h = 0;
+    if (arg_len == 8) {
+        for (int i = 0; i < 8; i++) {
+            h = (h << 8) | (unsigned char)arg[i];
+        }
+    } else if (arg_len == 16) {
+        for (int i = 0; i < 16; i++) {
+            char c = arg[i];
+            int digit;
+            if (c >= '0' && c <= '9') digit = c - '0';
+            else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+            else return -1;
+            h = (h << 4) | digit;
+        }
+    } else {
+        return -1;
+    }
+    *hash = h;
+    return 0;
+}
+
+/**
+ * Parses a time window, either a number of seconds
+ * or one of minute, hour, day, week, month and year.
+ * @arg time_window_str The NULL terminated window
+ * @arg time_window Output, the window in seconds
+ * @return 0 on success, -1 if the window is invalid.
+ */
+static int parse_time_window(char *time_window_str, uint64_t *time_window) {
+    if (isdigit(time_window_str[0])) {
+      int err = value_to_int64(time_window_str, time_window);
+      if (err || *time_window <= 0) return -1;
+    } else if (strcasecmp(time_window_str, "minute") == 0) {
+      *time_window = 60;
+    } else if (strcasecmp(time_window_str, "hour") == 0) {
+      *time_window = 3600;
+    } else if (strcasecmp(time_window_str, "day") == 0) {
+      *time_window = 3600 * 24;
+    } else if (strcasecmp(time_window_str, "week") == 0) {
+      *time_window = 3600 * 24 * 7;
+    } else if (strcasecmp(time_window_str, "month") == 0) {
+      *time_window = 3600 * 24 * 30;
+    } else if (strcasecmp(time_window_str, "year") == 0) {
+      *time_window = 3600 * 24 * 365;
+    } else {
+      return -1;
+    }
+    return 0;
+}
+
+
 /**
  * Determines the client command.
  * @arg cmd_buf A command buffer
@@ -778,8 +996,14 @@ static conn_cmd_type determine_client_command(char *cmd) {
         case 's': case 'S':
             if (CMD_MATCH("shadd"))
                 type = SET_MULTI;
+            else if (CMD_MATCH("shaddhash"))
+                type = SET_HASHES;
             else if (CMD_MATCH("shcard"))
                 type = SIZE;
+            else if (CMD_MATCH("shcardw"))
+                type = SIZE_MULTI;
+            else if (CMD_MATCH("shmcard"))
+                type = SIZE_KEYS;
             else if (CMD_MATCH("stats"))
                 type = STATS;
             break;
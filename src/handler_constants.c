@@ -66,6 +66,9 @@ typedef enum {
     ECHO,
     DETAIL,         // Details about a set
     GET_HASHES,     // Fetches all the hashes for the set
+    SIZE_MULTI,     // Size of set over several windows
+    SET_HASHES,     // Add client computed hashes
+    SIZE_KEYS,      // Size of several sets over one window
 
     // DEPRECATED:
     SIZE,           // Size of set
@@ -0,0 +1,139 @@
+#include <string.h>
+#include <strings.h>
+#include "hash.h"
+
+// Link the external murmur hash in
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+static const char *HASH_NAMES[] = {
+    "murmur3",
+    "xxh64",
+};
+#define NUM_HASHES (int)(sizeof(HASH_NAMES) / sizeof(HASH_NAMES[0]))
+
+// Algorithm used by hash_value
+static hash_algorithm current_algorithm = HASH_MURMUR3;
+
+int hash_algorithm_from_name(const char *name) {
+    for (int i=0; i < NUM_HASHES; i++) {
+        if (strcasecmp(HASH_NAMES[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+const char *hash_algorithm_name(hash_algorithm algorithm) {
+    return HASH_NAMES[algorithm];
+}
+
+void hash_use_algorithm(hash_algorithm algorithm) {
+    current_algorithm = algorithm;
+}
+
+hash_algorithm hash_current_algorithm(void) {
+    return current_algorithm;
+}
+
+/*
+ * XXH64, from the xxHash specification. Reads are little
+ * endian, which matches every platform we run on.
+ */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t xxh64(const void *key, size_t len, uint64_t seed) {
+    const unsigned char *p = (const unsigned char*)key;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_value_with(hash_algorithm algorithm, const void *key, size_t len) {
+    switch (algorithm) {
+        case HASH_XXH64:
+            return xxh64(key, len, 0);
+        case HASH_MURMUR3:
+        default: {
+            uint64_t out[2];
+            MurmurHash3_x64_128(key, (int)len, 0, &out);
+            return out[1];
+        }
+    }
+}
+
+uint64_t hash_value(const void *key, size_t len) {
+    return hash_value_with(current_algorithm, key, len);
+}
@@ -0,0 +1,52 @@
+#ifndef HASH_H
+#define HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The hash algorithms that set values can be hashed with.
+ * The algorithm of a database must never change once values
+ * have been added, since registers depend on the hash.
+ */
+typedef enum {
+    HASH_MURMUR3 = 0,   // Upper half of MurmurHash3_x64_128
+    HASH_XXH64,         // XXH64 with a zero seed
+} hash_algorithm;
+
+/**
+ * Looks up a hash algorithm by name
+ * @arg name The name of the algorithm
+ * @return The algorithm, or -1 if it is unknown
+ */
+int hash_algorithm_from_name(const char *name);
+
+/**
+ * Returns the name of a hash algorithm
+ */
+const char *hash_algorithm_name(hash_algorithm algorithm);
+
+/**
+ * Selects the algorithm used by hash_value. This is
+ * meant to be called once at startup.
+ */
+void hash_use_algorithm(hash_algorithm algorithm);
+
+/**
+ * Returns the algorithm used by hash_value
+ */
+hash_algorithm hash_current_algorithm(void);
+
+/**
+ * Hashes a value with the selected algorithm
+ * @arg key The value to hash
+ * @arg len The length of the value
+ * @return The 64 bit hash
+ */
+uint64_t hash_value(const void *key, size_t len);
+
+/**
+ * Hashes a value with a given algorithm
+ */
+uint64_t hash_value_with(hash_algorithm algorithm, const void *key, size_t len);
+
+#endif
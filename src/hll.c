@@ -18,17 +18,26 @@ State of The Art Cardinality Estimation Algorithm"
 #include <stdio.h>
 #include "hll.h"
 #include "hll_constants.h"
+#include "hash.h"
 
 #define REG_WIDTH 6     // Bits per register
 #define INT_WIDTH 32    // Bits in an int
 #define REG_PER_WORD 5  // floor(INT_WIDTH / REG_WIDTH)
-#define GROWTH_FACTOR 1.5
 
 #define INT_CEIL(num, denom) (((num) + (denom) - 1) / (denom))
+#define NUM_BLOCKS(precision) INT_CEIL(NUM_REG(precision), HLL_BLOCK_REGISTERS)
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+static void hll_arena_init(hll_arena *a);
 
+/**
+ * Checks if a block allocated its own headers, rather
+ * than sharing those laid out when the hll was loaded
+ */
+static inline int hll_block_owns_registers(hll_t *h, hll_register_block *b) {
+    return !(h->loaded_registers &&
+             b->registers >= h->loaded_registers &&
+             b->registers < h->loaded_registers + h->num_loaded_registers);
+}
 
 /**
  * Initializes a new SHLL
@@ -47,8 +56,12 @@ int hll_init(unsigned char precision, int window_period, int window_precision, h
     h->precision = precision;
     h->window_period = window_period;
     h->window_precision = window_precision;
+    h->epoch = time(NULL);
 
-    h->dense_registers = (hll_register*)calloc(NUM_REG(h->precision),sizeof(hll_register));
+    h->register_blocks = (hll_register_block*)calloc(NUM_BLOCKS(h->precision), sizeof(hll_register_block));
+    h->loaded_registers = NULL;
+    h->num_loaded_registers = 0;
+    hll_arena_init(&h->arena);
 
     return 0;
 }
@@ -59,13 +72,20 @@ int hll_init(unsigned char precision, int window_period, int window_precision, h
  * @return 0 on success
  */
 int hll_destroy(hll_t *h) {
-    for(int i=0; i<NUM_REG(h->precision); i++) {
-        if(h->dense_registers[i].points != NULL) {
-            free(h->dense_registers[i].points);
+    if (h->register_blocks) {
+        for (int i=0; i < NUM_BLOCKS(h->precision); i++) {
+            if (hll_block_owns_registers(h, &h->register_blocks[i])) {
+                free(h->register_blocks[i].registers);
+            }
         }
     }
-    free(h->dense_registers);
-    h->dense_registers = NULL;
+    free(h->register_blocks);
+    h->register_blocks = NULL;
+    free(h->loaded_registers);
+    h->loaded_registers = NULL;
+    h->num_loaded_registers = 0;
+    free(h->arena.points);
+    hll_arena_init(&h->arena);
     return 0;
 }
 
@@ -75,109 +95,865 @@ int hll_destroy(hll_t *h) {
  * @arg key The key to add
  */
 void hll_add_at_time(hll_t *h, char *key, time_t time) {
-    // Compute the hash value of the key
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
+    // Hash the key and add the hashed value
+    hll_add_hash_at_time(h, hash_value(key, strlen(key)), time);
+}
+
+/**
+ * Returns the position of a register in the headers of its block
+ */
+static int hll_register_rank(hll_register_block *b, int bit) {
+    return __builtin_popcountll(b->present & ((1ULL << bit) - 1));
+}
 
-    // Add the hashed value
-    hll_add_hash_at_time(h, out[1], time);
+/**
+ * Returns the header of a register, or NULL if the register
+ * has never been written. Header pointers are only valid
+ * until another register is created or the hll is compacted.
+ * @arg h The hll
+ * @arg idx The register index
+ */
+hll_register *hll_find_register(hll_t *h, int idx) {
+    hll_register_block *b = &h->register_blocks[idx / HLL_BLOCK_REGISTERS];
+    int bit = idx % HLL_BLOCK_REGISTERS;
+    if (!((b->present >> bit) & 1)) return NULL;
+    return b->registers + hll_register_rank(b, bit);
 }
 
 /**
- * Remove a point from a register
- * @arg r register to remove
- * @arg idx index of the point to remove
+ * Returns the header of a register, creating an empty one
+ * if the register has never been written.
+ * @arg h The hll
+ * @arg idx The register index
+ * @return The header, or NULL on allocation failure
  */
-void hll_register_remove_point(hll_register *r, size_t idx) {
-    r->size--;
-    assert(r->size >= 0);
-    r->points[idx] = r->points[r->size];
+hll_register *hll_create_register(hll_t *h, int idx) {
+    hll_register_block *b = &h->register_blocks[idx / HLL_BLOCK_REGISTERS];
+    int bit = idx % HLL_BLOCK_REGISTERS;
+    int rank = hll_register_rank(b, bit);
+    if ((b->present >> bit) & 1) return b->registers + rank;
+
+    int count = __builtin_popcountll(b->present);
+    hll_register *registers;
+    if (hll_block_owns_registers(h, b)) {
+        registers = (hll_register*)realloc(b->registers, (count + 1) * sizeof(hll_register));
+        if (!registers) return NULL;
+        memmove(registers + rank + 1, registers + rank, (count - rank) * sizeof(hll_register));
+    } else {
+        // Copy shared headers out before growing them
+        registers = (hll_register*)malloc((count + 1) * sizeof(hll_register));
+        if (!registers) return NULL;
+        memcpy(registers, b->registers, rank * sizeof(hll_register));
+        memcpy(registers + rank + 1, b->registers + rank, (count - rank) * sizeof(hll_register));
+    }
+    registers[rank].offset = 0;
+    registers[rank].size = 0;
+    registers[rank].capacity = 0;
+    b->registers = registers;
+    b->present |= 1ULL << bit;
+    return registers + rank;
+}
+
+/*
+ * Arena management. All the points of an hll live in one slab.
+ * A register owns a block of a power of two points, addressed by
+ * its offset into the slab. Freed blocks are kept on a free list
+ * per size, linked through the first slot of the block.
+ */
+
+static void hll_arena_init(hll_arena *a) {
+    a->points = NULL;
+    a->used = 0;
+    a->capacity = 0;
+    for (int i=0; i < HLL_ARENA_CLASSES; i++) {
+        a->free_lists[i] = HLL_ARENA_NONE;
+    }
 }
 
 /**
- * Adds a time/leading point to a register
+ * Makes room for at least the given number of slots
+ * at the end of the slab.
+ * @return 0 on success, -1 on allocation failure
+ */
+static int hll_arena_grow(hll_arena *a, uint64_t slots) {
+    uint64_t needed = (uint64_t)a->used + slots;
+    if (needed <= a->capacity) return 0;
+    if (needed >= HLL_ARENA_NONE) return -1;
+
+    uint64_t capacity = a->capacity ? a->capacity : 64;
+    while (capacity < needed) capacity *= 2;
+    if (capacity >= HLL_ARENA_NONE) capacity = HLL_ARENA_NONE - 1;
+
+    hll_dense_point *points = (hll_dense_point*)realloc(a->points, capacity * sizeof(hll_dense_point));
+    if (!points) return -1;
+    a->points = points;
+    a->capacity = (uint32_t)capacity;
+    return 0;
+}
+
+/**
+ * Allocates a block of 1 << size_class points
+ * @return The offset of the block, or HLL_ARENA_NONE on failure
+ */
+static uint32_t hll_arena_alloc(hll_arena *a, int size_class) {
+    uint32_t offset = a->free_lists[size_class];
+    if (offset != HLL_ARENA_NONE) {
+        memcpy(&a->free_lists[size_class], &a->points[offset], sizeof(uint32_t));
+        return offset;
+    }
+
+    uint32_t slots = 1U << size_class;
+    if (hll_arena_grow(a, slots)) return HLL_ARENA_NONE;
+    offset = a->used;
+    a->used += slots;
+    return offset;
+}
+
+/**
+ * Returns a block to the free list of its size
+ */
+static void hll_arena_free(hll_arena *a, uint32_t offset, int size_class) {
+    memcpy(&a->points[offset], &a->free_lists[size_class], sizeof(uint32_t));
+    a->free_lists[size_class] = offset;
+}
+
+/**
+ * Returns the size class of the smallest block holding n points
+ */
+static int hll_arena_class(uint32_t n) {
+    return n <= 1 ? 0 : 32 - __builtin_clz(n - 1);
+}
+
+/**
+ * Returns the size class of the largest block within n points.
+ * Registers loaded at their exact size free into this class.
+ */
+static int hll_arena_floor_class(uint32_t n) {
+    return 31 - __builtin_clz(n);
+}
+
+/**
+ * Moves a register into a block of a new capacity
+ * @arg capacity The new capacity, zero or a power of two
+ * @return 0 on success, -1 on allocation failure
+ */
+static int hll_register_resize(hll_t *h, hll_register *r, uint32_t capacity) {
+    assert(capacity >= r->size);
+    uint32_t offset = 0;
+    if (capacity) {
+        offset = hll_arena_alloc(&h->arena, hll_arena_class(capacity));
+        if (offset == HLL_ARENA_NONE) return -1;
+        memcpy(h->arena.points + offset, h->arena.points + r->offset, r->size * sizeof(hll_dense_point));
+    }
+    if (r->capacity) {
+        hll_arena_free(&h->arena, r->offset, hll_arena_floor_class(r->capacity));
+    }
+    r->offset = offset;
+    r->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Ensures a register can hold a number of points
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_register_reserve(hll_t *h, hll_register *r, uint32_t size) {
+    if (size <= r->capacity) return 0;
+    if (size > (1U << (HLL_ARENA_CLASSES - 1))) return -1;
+    return hll_register_resize(h, r, 1U << hll_arena_class(size));
+}
+
+/**
+ * Returns unused capacity once a register has shrunk
+ * well below its allocation.
+ * @arg r The register to shrink
+ */
+static void hll_register_shrink(hll_t *h, hll_register *r) {
+    if (r->size == 0 && r->capacity) {
+        hll_register_resize(h, r, 0);
+    } else if (r->capacity > 2 * r->size) {
+        hll_register_resize(h, r, 1U << hll_arena_class(r->size));
+    }
+}
+
+/**
+ * Rewrites the arena so that the registers are laid out back to
+ * back in register order, each in the smallest block that fits.
+ * This drops all free blocks.
+ * @arg h The hll to compact
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_compact(hll_t *h) {
+    int num_blocks = NUM_BLOCKS(h->precision);
+    uint64_t total = 0;
+    for (int i=0; i < num_blocks; i++) {
+        hll_register_block *b = &h->register_blocks[i];
+        int count = __builtin_popcountll(b->present);
+        for (int j=0; j < count; j++) {
+            uint32_t size = b->registers[j].size;
+            total += size ? 1U << hll_arena_class(size) : 0;
+        }
+    }
+
+    hll_dense_point *points = NULL;
+    if (total) {
+        points = (hll_dense_point*)malloc(total * sizeof(hll_dense_point));
+        if (!points) return -1;
+    }
+
+    uint32_t used = 0;
+    for (int i=0; i < num_blocks; i++) {
+        hll_register_block *b = &h->register_blocks[i];
+        uint64_t bits = b->present;
+        int kept = 0;
+        for (int j=0; bits; j++, bits &= bits - 1) {
+            hll_register r = b->registers[j];
+            if (!r.size) {
+                // Empty registers give up their header
+                b->present &= ~(1ULL << __builtin_ctzll(bits));
+                continue;
+            }
+            memcpy(points + used, h->arena.points + r.offset, r.size * sizeof(hll_dense_point));
+            r.offset = used;
+            r.capacity = 1U << hll_arena_class(r.size);
+            used += r.capacity;
+            b->registers[kept++] = r;
+        }
+        if (!kept) {
+            if (hll_block_owns_registers(h, b)) free(b->registers);
+            b->registers = NULL;
+        }
+    }
+
+    free(h->arena.points);
+    hll_arena_init(&h->arena);
+    h->arena.points = points;
+    h->arena.used = used;
+    h->arena.capacity = used;
+    return 0;
+}
+
+/**
+ * Prepares an empty hll to be loaded with a known set of
+ * registers. Their headers are created in one allocation, and
+ * the arena in another, sized for exactly the given points.
+ * Registers are then placed with hll_register_load.
+ * @arg h The hll, which must not have any registers
+ * @arg bitmap A bit for each register that has points,
+ * in little-endian bit order
+ * @arg points The total number of points
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_load_begin(hll_t *h, const unsigned char *bitmap, uint64_t points) {
+    assert(!h->loaded_registers && !h->arena.capacity);
+    int num_blocks = NUM_BLOCKS(h->precision);
+    int bitmap_len = NUM_REG(h->precision) / 8;
+
+    uint64_t count = 0;
+    for (int i=0; i < num_blocks; i++) {
+        hll_register_block *b = &h->register_blocks[i];
+        assert(!b->present);
+        for (int j=0; j < 8 && i * 8 + j < bitmap_len; j++) {
+            b->present |= (uint64_t)bitmap[i * 8 + j] << (8 * j);
+        }
+        count += __builtin_popcountll(b->present);
+    }
+
+    hll_register *registers = NULL;
+    if (count) {
+        registers = (hll_register*)calloc(count, sizeof(hll_register));
+        if (!registers) {
+            for (int i=0; i < num_blocks; i++) h->register_blocks[i].present = 0;
+            return -1;
+        }
+    }
+
+    uint64_t used = 0;
+    for (int i=0; i < num_blocks; i++) {
+        hll_register_block *b = &h->register_blocks[i];
+        b->registers = b->present ? registers + used : NULL;
+        used += __builtin_popcountll(b->present);
+    }
+    h->loaded_registers = registers;
+    h->num_loaded_registers = (uint32_t)count;
+
+    if (!points) return 0;
+    if (points >= HLL_ARENA_NONE) return -1;
+    h->arena.points = (hll_dense_point*)malloc(points * sizeof(hll_dense_point));
+    if (!h->arena.points) return -1;
+    h->arena.capacity = (uint32_t)points;
+    return 0;
+}
+
+/**
+ * Places an empty register being loaded in a block of exactly
+ * the given size, at the end of the arena. The block is only
+ * rounded up to a power of two once the register grows.
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_register_load(hll_t *h, hll_register *r, uint32_t size) {
+    assert(!r->capacity);
+    if (!size) return 0;
+    if (size > (1U << (HLL_ARENA_CLASSES - 1))) return -1;
+    if (hll_arena_grow(&h->arena, size)) return -1;
+    r->offset = h->arena.used;
+    r->capacity = (uint16_t)size;
+    h->arena.used += size;
+    return 0;
+}
+
+/**
+ * Finishes loading an hll, returning the arena space
+ * that the points did not use.
+ */
+void hll_load_end(hll_t *h) {
+    hll_arena *a = &h->arena;
+    if (a->used == a->capacity) return;
+    if (!a->used) {
+        free(a->points);
+        a->points = NULL;
+    } else {
+        // Shrinking usually happens in place, without a copy
+        hll_dense_point *points = (hll_dense_point*)realloc(a->points, a->used * sizeof(hll_dense_point));
+        if (!points) return;
+        a->points = points;
+    }
+    a->capacity = a->used;
+}
+
+/**
+ * Reserves room in the arena ahead of adding
+ * a known number of points, such as when loading.
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_reserve_points(hll_t *h, uint64_t points) {
+    return hll_arena_grow(&h->arena, points);
+}
+
+/**
+ * Finds the first point of a register with a timestamp
+ * at or after an offset. Points are sorted by time.
+ * @return The index of the point, or the size of the
+ * register if there is none.
+ */
+static uint32_t hll_register_lower_bound(hll_dense_point *points, uint32_t size, int32_t offset) {
+    uint32_t low = 0, high = size;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (points[mid].timestamp < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Drops every point at or before a cutoff. Since points
+ * are sorted by time these are always a prefix.
+ * @arg r The register to expire
+ * @arg cutoff The newest offset to drop
+ * @return The number of points dropped
+ */
+static int hll_register_expire(hll_t *h, hll_register *r, int32_t cutoff) {
+    hll_dense_point *points = hll_register_points(h, r);
+    if (r->size == 0 || points[0].timestamp > cutoff) return 0;
+    uint32_t expired = (cutoff == INT32_MAX) ? r->size : hll_register_lower_bound(points, r->size, cutoff + 1);
+    memmove(points, points + expired, (r->size - expired) * sizeof(hll_dense_point));
+    r->size -= expired;
+    return (int)expired;
+}
+
+/**
+ * Returns the offset at or before which points fall out
+ * of the window_period ending at a given offset.
+ */
+static int32_t hll_expire_cutoff(hll_t *h, int32_t offset) {
+    int64_t cutoff = (int64_t)offset - h->window_period;
+    if (cutoff < INT32_MIN) return INT32_MIN;
+    return (int32_t)cutoff;
+}
+
+/**
+ * Adds a time/leading point to a register. The points of a
+ * register form a monotone stack: timestamps strictly increase
+ * and register values strictly decrease, so a register never
+ * holds more points than there are register values.
+ *
+ * Points that are no newer and no larger than the new point
+ * are dropped, as are points that are older than the window
+ * period of the hll. The new point is skipped if an existing
+ * point already dominates it. Adding a point that is the
+ * newest only pops from the tail, which is amortized O(1).
+ * @arg h The hll that owns the register
  * @arg r The register to add the point to
  * @arg p The time/leading point to add to the register
+ * @return The number of points that expired
  */
-void hll_register_add_point(hll_register *r, hll_dense_point p) {
-    // remove all points with smaller register value.
-    // do this in reverse order because we remove points from the right end
-    for (int i=r->size-1; i>=0; i--) {
-        if (r->points[i].register_ <= p.register_) {
-            hll_register_remove_point(r, i);
-        }
+int hll_register_add_point(hll_t *h, hll_register *r, hll_dense_point p) {
+    int expired = hll_register_expire(h, r, hll_expire_cutoff(h, p.timestamp));
+    hll_dense_point *points = hll_register_points(h, r);
+
+    // Find where the point goes, newest points go on the end
+    uint32_t idx;
+    if (r->size == 0 || points[r->size-1].timestamp < p.timestamp) {
+        idx = r->size;
+    } else {
+        idx = hll_register_lower_bound(points, r->size, p.timestamp);
+    }
+
+    // The first point at or after p has the largest value of
+    // those points, skip p if it is not smaller. This is the
+    // common case for repeated points in the same time bucket.
+    if (idx < r->size && points[idx].register_ >= p.register_) {
+        return expired;
     }
 
-    r->size++;
-    assert(r->size > 0);
+    // Older points that are not larger than p are a suffix of
+    // the points before idx, pop them. A smaller point at the
+    // same time as p is replaced as well.
+    uint32_t start = idx;
+    while (start > 0 && points[start-1].register_ <= p.register_) {
+        start--;
+    }
+    uint32_t end = idx;
+    if (end < r->size && points[end].timestamp == p.timestamp) {
+        end++;
+    }
+    uint32_t new_size = r->size - (end - start) + 1;
 
-    // if we have exceeded capacity we resize
-    if(r->size > r->capacity) {
-        r->capacity = (size_t)(GROWTH_FACTOR * r->capacity + 1);
-        r->points = (hll_dense_point*)realloc(r->points, r->capacity*sizeof(hll_dense_point));
+    // if we have exceeded capacity move to a larger block
+    if (new_size > r->capacity) {
+        if (hll_register_reserve(h, r, new_size)) {
+            syslog(LOG_ERR, "Failed to allocate memory for register points");
+            return expired;
+        }
+        points = hll_register_points(h, r);
     }
 
-    assert((long long)r->size-1 >= 0);
-    assert(r->points != NULL);
-    // add point to register
-    r->points[r->size-1] = p;
+    // shift the newer points into place and add the point
+    memmove(points + start + 1, points + end, (r->size - end) * sizeof(hll_dense_point));
+    points[start] = p;
+    r->size = new_size;
+
+    // give back memory if many points were removed
+    hll_register_shrink(h, r);
+    return expired;
 }
 
-int hll_get_register(hll_t *h, int register_index, time_t timestamp, time_t time_window) {
-    hll_register *r = &h->dense_registers[register_index];
+/**
+ * Restores the ordering of a register whose points were
+ * written in any order, such as one loaded from an older
+ * file. Dominated points are removed.
+ * @arg h The hll that owns the register
+ * @arg r The register to normalize
+ */
+void hll_register_normalize(hll_t *h, hll_register *r) {
+    hll_dense_point *points = hll_register_points(h, r);
+
+    // Insertion sort by time, largest value last on ties
+    for (uint32_t i=1; i<r->size; i++) {
+        hll_dense_point p = points[i];
+        uint32_t j = i;
+        while (j > 0 && (points[j-1].timestamp > p.timestamp ||
+                (points[j-1].timestamp == p.timestamp && points[j-1].register_ > p.register_))) {
+            points[j] = points[j-1];
+            j--;
+        }
+        points[j] = p;
+    }
 
-    time_t min_time = timestamp - time_window;
-    int register_value = 0;
+    // Walking from newest to oldest, keep the points larger than all newer ones
+    uint32_t kept = r->size;
+    int max_register = -1;
+    for (uint32_t i=r->size; i-- > 0;) {
+        if (points[i].register_ > max_register) {
+            max_register = points[i].register_;
+            points[--kept] = points[i];
+        }
+    }
+    memmove(points, points + kept, (r->size - kept) * sizeof(hll_dense_point));
+    r->size -= kept;
+    hll_register_shrink(h, r);
+}
 
-    for(int i=0; i<r->size; i++) {
-        if (r->points[i].timestamp >= min_time && r->points[i].register_ > register_value) {
-            register_value = r->points[i].register_;
+/**
+ * Drops all the points that are older than the window
+ * period, and returns the memory they used.
+ * @arg h The hll to expire
+ * @arg now The current time
+ * @return The number of points that expired
+ */
+uint64_t hll_expire(hll_t *h, time_t now) {
+    int32_t cutoff = hll_expire_cutoff(h, hll_time_offset(h->epoch, now));
+    uint64_t expired = 0;
+    for (int i=0; i < NUM_BLOCKS(h->precision); i++) {
+        hll_register_block *b = &h->register_blocks[i];
+        int count = __builtin_popcountll(b->present);
+        for (int j=0; j < count; j++) {
+            hll_register *r = &b->registers[j];
+            if (r->size == 0) continue;
+            int dropped = hll_register_expire(h, r, cutoff);
+            if (dropped) {
+                expired += dropped;
+                hll_register_shrink(h, r);
+            }
         }
     }
+    return expired;
+}
+
+/**
+ * Rounds a timestamp down to the start of its
+ * window_precision bucket.
+ * @arg h The hll
+ * @arg timestamp The absolute timestamp
+ * @return The start of the bucket
+ */
+time_t hll_time_bucket(hll_t *h, time_t timestamp) {
+    time_t rem = timestamp % h->window_precision;
+    if (rem < 0) rem += h->window_precision;
+    return timestamp - rem;
+}
+
+/**
+ * Returns the value of a register over a time window. Register
+ * values decrease with time, so this is the value of the oldest
+ * point inside the window.
+ */
+int hll_get_register(hll_t *h, int register_index, time_t timestamp, time_t time_window) {
+    hll_register *r = hll_find_register(h, register_index);
+    if (!r) return 0;
+    hll_dense_point *points = hll_register_points(h, r);
+
+    // Include the whole bucket that the window starts in
+    int32_t min_offset = hll_time_offset(h->epoch, hll_time_bucket(h, timestamp - time_window));
+    uint32_t idx = hll_register_lower_bound(points, r->size, min_offset);
+    return idx < r->size ? points[idx].register_ : 0;
+}
 
-    return register_value;
+/**
+ * Converts an absolute timestamp to an offset from the epoch,
+ * clamped to the range that a point can represent.
+ * @arg epoch The epoch of the hll
+ * @arg timestamp The absolute timestamp
+ * @return The offset to store in a hll_dense_point
+ */
+int32_t hll_time_offset(time_t epoch, time_t timestamp) {
+    time_t offset = timestamp - epoch;
+    if (offset < INT32_MIN) return INT32_MIN;
+    if (offset > INT32_MAX) return INT32_MAX;
+    return (int32_t)offset;
+}
+
+/**
+ * Returns the register value for a hash, the position of the
+ * first set bit after the index bits.
+ */
+static unsigned char hll_hash_leading(hll_t *h, uint64_t hash) {
+    // Shift out the index bits
+    hash = hash << h->precision | (1 << (h->precision -1));
+
+    // Determine the count of leading zeros
+    return __builtin_clzll(hash) + 1;
 }
 
 /**
  * Adds a new hash to the SHLL
  * @arg h The hll to add to
  * @arg hash The hash to add
+ * @return The number of points that expired
  */
-void hll_add_hash_at_time(hll_t *h, uint64_t hash, time_t timestamp) {
+int hll_add_hash_at_time(hll_t *h, uint64_t hash, time_t timestamp) {
     // Determine the index using the first p bits
     int idx = hash >> (64 - h->precision);
 
-    // Shift out the index bits
-    hash = hash << h->precision | (1 << (h->precision -1));
+    // Points are kept at window_precision granularity
+    hll_dense_point p = {hll_time_offset(h->epoch, hll_time_bucket(h, timestamp)), hll_hash_leading(h, hash)};
+    hll_register *r = hll_create_register(h, idx);
+    if (!r) {
+        syslog(LOG_ERR, "Failed to allocate memory for register header");
+        return 0;
+    }
 
-    // Determine the count of leading zeros
-    long leading = __builtin_clzll(hash) + 1;
+    return hll_register_add_point(h, r, p);
+}
+
+static int hll_hash_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Adds a batch of hashes seen at the same time. The hashes
+ * are sorted so that each register is visited once, with
+ * the largest value any of its hashes produced.
+ * @arg h The hll to add to
+ * @arg hashes The hashes to add
+ * @arg num_hashes The number of hashes
+ * @arg timestamp The time the hashes were seen
+ * @return The number of points that expired
+ */
+int hll_add_hashes_at_time(hll_t *h, const uint64_t *hashes, int num_hashes, time_t timestamp) {
+    // Sorting by hash sorts by register index, the top bits
+    uint64_t buf[64];
+    uint64_t *sorted = buf;
+    if (num_hashes > 64) {
+        sorted = (uint64_t*)malloc(num_hashes * sizeof(uint64_t));
+        if (!sorted) {
+            syslog(LOG_ERR, "Failed to allocate memory for hash batch");
+            return 0;
+        }
+    }
+    memcpy(sorted, hashes, num_hashes * sizeof(uint64_t));
+    qsort(sorted, num_hashes, sizeof(uint64_t), hll_hash_cmp);
 
-    hll_dense_point p = {timestamp, leading};
-    hll_register *r = &h->dense_registers[idx];
+    int32_t offset = hll_time_offset(h->epoch, hll_time_bucket(h, timestamp));
+    int expired = 0;
+    for (int i=0; i < num_hashes;) {
+        int idx = sorted[i] >> (64 - h->precision);
+        unsigned char leading = 0;
+        for (; i < num_hashes && (int)(sorted[i] >> (64 - h->precision)) == idx; i++) {
+            unsigned char l = hll_hash_leading(h, sorted[i]);
+            if (l > leading) leading = l;
+        }
+
+        hll_register *r = hll_create_register(h, idx);
+        if (!r) {
+            syslog(LOG_ERR, "Failed to allocate memory for register header");
+            break;
+        }
+        hll_dense_point p = {offset, leading};
+        expired += hll_register_add_point(h, r, p);
+    }
 
-    hll_register_add_point(r, p);
+    if (sorted != buf) free(sorted);
+    return expired;
 }
 
 /*
- * Computes the raw cardinality estimate
+ * Register sum kernels. Each kernel computes the sum of 2^-reg
+ * over an array of resolved register values, and counts the
+ * registers that are zero. The SIMD variants build 2^-reg
+ * directly from the IEEE-754 exponent bits, the scalar variant
+ * uses a lookup table. A kernel is picked at runtime based on
+ * what the CPU supports.
+ */
+typedef void (*hll_sum_kernel)(const unsigned char *regs, int num_reg, double *inv_sum, int *num_zero);
+
+// 2^-k for every value a 6 bit register can hold
+#define INV_POW2(k) (1.0 / (double)(1ULL << (k)))
+#define INV_POW2_8(k) INV_POW2(k), INV_POW2(k+1), INV_POW2(k+2), INV_POW2(k+3), \
+    INV_POW2(k+4), INV_POW2(k+5), INV_POW2(k+6), INV_POW2(k+7)
+static const double POW_2_NEG[64] = {
+    INV_POW2_8(0), INV_POW2_8(8), INV_POW2_8(16), INV_POW2_8(24),
+    INV_POW2_8(32), INV_POW2_8(40), INV_POW2_8(48), INV_POW2_8(56)
+};
+
+static void hll_sum_scalar(const unsigned char *regs, int num_reg, double *inv_sum, int *num_zero) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i=0; i < num_reg; i++) {
+        sum += POW_2_NEG[regs[i] & 63];
+        zeros += (regs[i] == 0);
+    }
+    *inv_sum = sum;
+    *num_zero = zeros;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HLL_HAVE_SIMD_KERNELS
+
+__attribute__((target("sse4.1")))
+static void hll_sum_sse41(const unsigned char *regs, int num_reg, double *inv_sum, int *num_zero) {
+    const __m128i bias = _mm_set1_epi64x(1023);
+    const __m128i zero = _mm_setzero_si128();
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+    __m128i zeros = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 4 <= num_reg; i += 4) {
+        uint32_t word;
+        memcpy(&word, regs + i, sizeof(word));
+        __m128i bytes = _mm_cvtsi32_si128(word);
+        __m128i k0 = _mm_cvtepu8_epi64(bytes);
+        __m128i k1 = _mm_cvtepu8_epi64(_mm_srli_epi32(bytes, 16));
+
+        // 2^-k has an exponent field of 1023-k and an empty mantissa
+        sum0 = _mm_add_pd(sum0, _mm_castsi128_pd(_mm_slli_epi64(_mm_sub_epi64(bias, k0), 52)));
+        sum1 = _mm_add_pd(sum1, _mm_castsi128_pd(_mm_slli_epi64(_mm_sub_epi64(bias, k1), 52)));
+
+        // Equal lanes are all ones, so subtracting counts them
+        zeros = _mm_sub_epi64(zeros, _mm_cmpeq_epi64(k0, zero));
+        zeros = _mm_sub_epi64(zeros, _mm_cmpeq_epi64(k1, zero));
+    }
+
+    double sums[2];
+    int64_t counts[2];
+    _mm_storeu_pd(sums, _mm_add_pd(sum0, sum1));
+    _mm_storeu_si128((__m128i*)counts, zeros);
+
+    double tail_sum = 0;
+    int tail_zeros = 0;
+    hll_sum_scalar(regs + i, num_reg - i, &tail_sum, &tail_zeros);
+    *inv_sum = sums[0] + sums[1] + tail_sum;
+    *num_zero = (int)(counts[0] + counts[1]) + tail_zeros;
+}
+
+__attribute__((target("avx2")))
+static void hll_sum_avx2(const unsigned char *regs, int num_reg, double *inv_sum, int *num_zero) {
+    const __m256i bias = _mm256_set1_epi64x(1023);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    __m256d sum2 = _mm256_setzero_pd(), sum3 = _mm256_setzero_pd();
+    __m256i zeros = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 16 <= num_reg; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(regs + i));
+        __m256i k0 = _mm256_cvtepu8_epi64(bytes);
+        __m256i k1 = _mm256_cvtepu8_epi64(_mm_srli_si128(bytes, 4));
+        __m256i k2 = _mm256_cvtepu8_epi64(_mm_srli_si128(bytes, 8));
+        __m256i k3 = _mm256_cvtepu8_epi64(_mm_srli_si128(bytes, 12));
+
+        // 2^-k has an exponent field of 1023-k and an empty mantissa
+        sum0 = _mm256_add_pd(sum0, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_sub_epi64(bias, k0), 52)));
+        sum1 = _mm256_add_pd(sum1, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_sub_epi64(bias, k1), 52)));
+        sum2 = _mm256_add_pd(sum2, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_sub_epi64(bias, k2), 52)));
+        sum3 = _mm256_add_pd(sum3, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_sub_epi64(bias, k3), 52)));
+
+        // Equal lanes are all ones, so subtracting counts them
+        zeros = _mm256_sub_epi64(zeros, _mm256_cmpeq_epi64(k0, zero));
+        zeros = _mm256_sub_epi64(zeros, _mm256_cmpeq_epi64(k1, zero));
+        zeros = _mm256_sub_epi64(zeros, _mm256_cmpeq_epi64(k2, zero));
+        zeros = _mm256_sub_epi64(zeros, _mm256_cmpeq_epi64(k3, zero));
+    }
+
+    double sums[4];
+    int64_t counts[4];
+    _mm256_storeu_pd(sums, _mm256_add_pd(_mm256_add_pd(sum0, sum1), _mm256_add_pd(sum2, sum3)));
+    _mm256_storeu_si256((__m256i*)counts, zeros);
+
+    double tail_sum = 0;
+    int tail_zeros = 0;
+    hll_sum_scalar(regs + i, num_reg - i, &tail_sum, &tail_zeros);
+    *inv_sum = sums[0] + sums[1] + sums[2] + sums[3] + tail_sum;
+    *num_zero = (int)(counts[0] + counts[1] + counts[2] + counts[3]) + tail_zeros;
+}
+#endif
+
+static const struct {
+    const char *name;
+    hll_sum_kernel kernel;
+} SUM_KERNELS[] = {
+#ifdef HLL_HAVE_SIMD_KERNELS
+    {"avx2", hll_sum_avx2},
+    {"sse4.1", hll_sum_sse41},
+#endif
+    {"scalar", hll_sum_scalar},
+};
+#define NUM_SUM_KERNELS (int)(sizeof(SUM_KERNELS) / sizeof(SUM_KERNELS[0]))
+
+// Index into SUM_KERNELS, -1 until first use
+static int sum_kernel = -1;
+
+/**
+ * Checks if the CPU can run a given sum kernel
+ */
+static int hll_sum_kernel_supported(int idx) {
+#ifdef HLL_HAVE_SIMD_KERNELS
+    if (SUM_KERNELS[idx].kernel == hll_sum_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (SUM_KERNELS[idx].kernel == hll_sum_sse41)
+        return __builtin_cpu_supports("sse4.1");
+#endif
+    return idx >= 0 && idx < NUM_SUM_KERNELS;
+}
+
+/**
+ * Selects the fastest kernel supported by the CPU
+ */
+static void hll_sum_kernel_init(void) {
+    for (int i=0; i < NUM_SUM_KERNELS; i++) {
+        if (hll_sum_kernel_supported(i)) {
+            sum_kernel = i;
+            break;
+        }
+    }
+}
+
+/**
+ * Selects the kernel used to sum registers
+ * @arg name The kernel name, or NULL for the fastest supported
+ * @return 0 on success, -1 if the kernel is unknown or
+ * not supported by this CPU.
+ */
+int hll_use_sum_kernel(const char *name) {
+    for (int i=0; i < NUM_SUM_KERNELS; i++) {
+        if (!hll_sum_kernel_supported(i)) continue;
+        if (name == NULL || strcmp(name, SUM_KERNELS[i].name) == 0) {
+            sum_kernel = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the name of the kernel used to sum registers
+ */
+const char *hll_sum_kernel_name(void) {
+    if (sum_kernel < 0) hll_sum_kernel_init();
+    return SUM_KERNELS[sum_kernel].name;
+}
+
+/**
+ * Computes the sum of 2^-reg over a set of register
+ * values, along with the number of zero registers.
+ * @arg regs The register values
+ * @arg num_reg The number of registers
+ * @arg inv_sum Output, the sum of 2^-reg
+ * @arg num_zero Output, the number of zero registers
+ */
+void hll_sum_registers(const unsigned char *regs, int num_reg, double *inv_sum, int *num_zero) {
+    if (sum_kernel < 0) hll_sum_kernel_init();
+    SUM_KERNELS[sum_kernel].kernel(regs, num_reg, inv_sum, num_zero);
+}
+
+/*
+ * Computes the raw cardinality estimate. The windowed value
+ * of every register is resolved first, then the whole batch
+ * is summed by the selected kernel.
+ * @return The raw estimate, or -1 on allocation failure
  */
 static double hll_raw_estimate_union(hll_t **h, int num_hls, int *num_zero, time_t timestamp, time_t time_window) {
     unsigned char precision = h[0]->precision;
     int num_reg = NUM_REG(precision);
     double multi = hll_alpha(precision) * num_reg * num_reg;
 
-    double inv_sum = 0;
-    for (int i=0; i < num_reg; i++) {
-        int reg_val = 0;
-        for(int j=0; j<num_hls; j++) {
-            int reg = hll_get_register(h[j], i, timestamp,  time_window);
-            if (reg > reg_val)
-                reg_val = reg;
+    // Only registers with a header can be non-zero
+    unsigned char *regs = (unsigned char*)calloc(num_reg, 1);
+    if (!regs) return -1;
+    for(int j=0; j<num_hls; j++) {
+        for (int i=0; i < NUM_BLOCKS(precision); i++) {
+            uint64_t bits = h[j]->register_blocks[i].present;
+            for (; bits; bits &= bits - 1) {
+                int idx = i * HLL_BLOCK_REGISTERS + __builtin_ctzll(bits);
+                int reg = hll_get_register(h[j], idx, timestamp, time_window);
+                if (reg > regs[idx])
+                    regs[idx] = reg;
+            }
         }
-        inv_sum += pow(2.0, -1 * reg_val);
-        if (!reg_val) *num_zero += 1;
     }
+
+    double inv_sum = 0;
+    int zeros = 0;
+    hll_sum_registers(regs, num_reg, &inv_sum, &zeros);
+    free(regs);
+
+    *num_zero += zeros;
     return multi * (1.0 / inv_sum);
 }
 
@@ -328,15 +1104,14 @@ uint64_t hll_bytes_for_precision(int prec) {
 }
 
 /**
- * Estimates the cardinality of the HLL
- * @arg h The hll to query
- * @return An estimate of the cardinality
+ * Applies bias correction and linear counting to
+ * a raw estimate.
+ * @arg h An hll with the precision that was estimated
+ * @arg raw_est The raw estimate
+ * @arg num_zero The number of zero registers
+ * @return The corrected estimate
  */
-double hll_size(hll_t *h, time_t timestamp, time_t time_window) {
-    int num_zero = 0;
-    hll_t *hs[] = {h};
-    double raw_est = hll_raw_estimate_union(hs, 1, &num_zero, timestamp,  time_window);
-
+static double hll_correct_estimate(hll_t *h, double raw_est, int num_zero) {
     // Check if we need to apply bias correction
     int num_reg = NUM_REG(h->precision);
     if (raw_est <= 5 * num_reg) {
@@ -359,6 +1134,74 @@ double hll_size(hll_t *h, time_t timestamp, time_t time_window) {
     }
 }
 
+/**
+ * Estimates the cardinality of the HLL
+ * @arg h The hll to query
+ * @return An estimate of the cardinality, or -1 on allocation failure
+ */
+double hll_size(hll_t *h, time_t timestamp, time_t time_window) {
+    int num_zero = 0;
+    hll_t *hs[] = {h};
+    double raw_est = hll_raw_estimate_union(hs, 1, &num_zero, timestamp,  time_window);
+    if (raw_est < 0) return -1;
+    return hll_correct_estimate(h, raw_est, num_zero);
+}
+
+/**
+ * Estimates the cardinality of the HLL over several
+ * time windows, resolving every register only once.
+ * @arg h The hll to query
+ * @arg timestamp The end of the windows
+ * @arg time_windows The window lengths
+ * @arg num_windows The number of windows
+ * @arg estimates Output, one estimate per window
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_size_multi(hll_t *h, time_t timestamp, const time_t *time_windows, int num_windows, double *estimates) {
+    int num_reg = NUM_REG(h->precision);
+    double multi = hll_alpha(h->precision) * num_reg * num_reg;
+
+    // One row of register values per window
+    unsigned char *regs = (unsigned char*)calloc((size_t)num_reg * num_windows, 1);
+    int32_t *min_offsets = (int32_t*)malloc(num_windows * sizeof(int32_t));
+    if (!regs || !min_offsets) {
+        free(regs);
+        free(min_offsets);
+        return -1;
+    }
+    for (int w=0; w < num_windows; w++) {
+        min_offsets[w] = hll_time_offset(h->epoch, hll_time_bucket(h, timestamp - time_windows[w]));
+    }
+
+    for (int i=0; i < NUM_BLOCKS(h->precision); i++) {
+        hll_register_block *b = &h->register_blocks[i];
+        uint64_t bits = b->present;
+        for (int j=0; bits; j++, bits &= bits - 1) {
+            hll_register *r = &b->registers[j];
+            if (r->size == 0) continue;
+            int reg = i * HLL_BLOCK_REGISTERS + __builtin_ctzll(bits);
+            hll_dense_point *points = hll_register_points(h, r);
+            for (int w=0; w < num_windows; w++) {
+                uint32_t idx = hll_register_lower_bound(points, r->size, min_offsets[w]);
+                if (idx < r->size) {
+                    regs[(size_t)w * num_reg + reg] = points[idx].register_;
+                }
+            }
+        }
+    }
+
+    for (int w=0; w < num_windows; w++) {
+        double inv_sum = 0;
+        int num_zero = 0;
+        hll_sum_registers(regs + (size_t)w * num_reg, num_reg, &inv_sum, &num_zero);
+        estimates[w] = hll_correct_estimate(h, multi * (1.0 / inv_sum), num_zero);
+    }
+
+    free(regs);
+    free(min_offsets);
+    return 0;
+}
+
 double hll_size_total(hll_t *h) {
     time_t ctime = time(NULL);
     return hll_size(h, ctime, ctime);
@@ -368,7 +1211,8 @@ double hll_size_total(hll_t *h) {
 /**
  * Takes the union of a few sets and returns the cardinality
  *
- * returns -1 when the precision of all the hll's do not match
+ * returns -2 when the precision of all the hll's do not match,
+ * and -1 on allocation failure
  */
 double hll_union_size(hll_t **hs, int num_hs, time_t timestamp, time_t time_window) {
     // the precision of each hll needs to be the same
@@ -380,25 +1224,6 @@ double hll_union_size(hll_t **hs, int num_hs, time_t timestamp, time_t time_wind
     }
     int num_zero = 0;
     double raw_est = hll_raw_estimate_union(hs, num_hs, &num_zero, timestamp, time_window);
-
-    // Check if we need to apply bias correction
-    int num_reg = NUM_REG(hs[0]->precision);
-    if (raw_est <= 5 * num_reg) {
-        raw_est -= hll_bias_estimate(hs[0], raw_est);
-    }
-
-    // Check if linear counting should be used
-    double alt_est;
-    if (num_zero) {
-        alt_est = hll_linear_count(hs[0], num_zero);
-    } else {
-        alt_est = raw_est;
-    }
-
-    // Determine which estimate to use
-    if (alt_est <= switchThreshold[hs[0]->precision-4]) {
-        return alt_est;
-    } else {
-        return raw_est;
-    }
+    if (raw_est < 0) return -1;
+    return hll_correct_estimate(hs[0], raw_est, num_zero);
 }
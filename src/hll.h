@@ -12,26 +12,98 @@
 #define HLL_MIN_PRECISION 4      // 16 registers
 #define HLL_MAX_PRECISION 18     // 262,144 registers
 
+/**
+ * A single time/register sample. The timestamp is stored as
+ * a signed offset in seconds from the epoch of the owning hll_t,
+ * which keeps a point at 8 bytes.
+ */
 typedef struct {
-    time_t timestamp;
-    long register_;
+    int32_t timestamp;          // Seconds relative to hll_t.epoch
+    unsigned char register_;    // Leading zero count, fits in 6 bits
 } hll_dense_point;
 
+/**
+ * The points of a register, kept in the arena of the hll
+ */
 typedef struct {
-    long size;
-    long capacity;
-    hll_dense_point *points;
+    uint32_t offset;    // Index of the first point in the arena
+    uint16_t size;      // Points in use
+    uint16_t capacity;  // Points allocated, zero or a power of two,
+                        // or exactly the size when loaded
 } hll_register;
 
+// Registers that share a presence bitmap
+#define HLL_BLOCK_REGISTERS 64
+
+/**
+ * Headers for a run of registers. Only registers that have
+ * been written to have a header, so a dense set costs memory
+ * in proportion to its points rather than its precision.
+ */
+typedef struct {
+    uint64_t present;           // Bit per register that has a header
+    hll_register *registers;    // Headers of present registers, in order
+} hll_register_block;
+
+// Blocks of 1 to 256 points, a register holds at most one
+// point per distinct register value
+#define HLL_ARENA_CLASSES 9
+#define HLL_ARENA_NONE UINT32_MAX
+
+/**
+ * A single slab holding the points of every register of an
+ * hll. Blocks are addressed by offset so the slab can be grown
+ * or compacted without fixing up pointers.
+ */
+typedef struct {
+    hll_dense_point *points;
+    uint32_t used;          // Slots handed out from the slab
+    uint32_t capacity;      // Slots allocated in the slab
+    uint32_t free_lists[HLL_ARENA_CLASSES]; // First free block of each size
+} hll_arena;
+
 typedef struct {
     unsigned char precision;
     // amount of seconds worth of samples we store (in seconds)
     int window_period;
     // precision to which we keep samples (in seconds)
     int window_precision;
-    hll_register *dense_registers;
+    // base time that point timestamps are relative to
+    time_t epoch;
+    hll_register_block *register_blocks;
+    // Headers laid out together when the hll was loaded. Blocks
+    // share them until a register is added to the block.
+    hll_register *loaded_registers;
+    uint32_t num_loaded_registers;
+    hll_arena arena;
 } hll_t;
 
+/**
+ * Returns the points of a register. The pointer is only
+ * valid until the next change to the hll.
+ */
+static inline hll_dense_point *hll_register_points(hll_t *h, hll_register *r) {
+    return h->arena.points + r->offset;
+}
+
+/**
+ * Returns the header of a register, or NULL if the register
+ * has never been written. Header pointers are only valid
+ * until another register is created or the hll is compacted.
+ * @arg h The hll
+ * @arg idx The register index
+ */
+hll_register *hll_find_register(hll_t *h, int idx);
+
+/**
+ * Returns the header of a register, creating an empty one
+ * if the register has never been written.
+ * @arg h The hll
+ * @arg idx The register index
+ * @return The header, or NULL on allocation failure
+ */
+hll_register *hll_create_register(hll_t *h, int idx);
+
 /**
  * Initializes a new SHLL
  * @arg precision The digits of precision to use
@@ -58,22 +130,80 @@ void hll_add_at_time(hll_t *h, char *key, time_t time);
  * Adds a new hash to the HLL
  * @arg h The hll to add to
  * @arg hash The hash to add
+ * @return The number of points that expired
+ */
+int hll_add_hash_at_time(hll_t *h, uint64_t hash, time_t time);
+
+/**
+ * Adds a batch of hashes seen at the same time. The hashes
+ * are sorted so that each register is visited once.
+ * @arg h The hll to add to
+ * @arg hashes The hashes to add
+ * @arg num_hashes The number of hashes
+ * @arg timestamp The time the hashes were seen
+ * @return The number of points that expired
  */
-void hll_add_hash_at_time(hll_t *h, uint64_t hash, time_t time);
+int hll_add_hashes_at_time(hll_t *h, const uint64_t *hashes, int num_hashes, time_t timestamp);
+
+/**
+ * Drops all the points that are older than the window
+ * period, and returns the memory they used.
+ * @arg h The hll to expire
+ * @arg now The current time
+ * @return The number of points that expired
+ */
+uint64_t hll_expire(hll_t *h, time_t now);
 
 /**
  * Estimates the cardinality of the HLL
  * @arg h The hll to query
- * @return An estimate of the cardinality
+ * @return An estimate of the cardinality, or -1 on allocation failure
  */
 double hll_size(hll_t *h, time_t timestamp, time_t time_window);
 double hll_size_total(hll_t *h);
 
+/**
+ * Estimates the cardinality of the HLL over several
+ * time windows, resolving every register only once.
+ * @arg h The hll to query
+ * @arg timestamp The end of the windows
+ * @arg time_windows The window lengths
+ * @arg num_windows The number of windows
+ * @arg estimates Output, one estimate per window
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_size_multi(hll_t *h, time_t timestamp, const time_t *time_windows, int num_windows, double *estimates);
+
 /**
  * Takes the union of a few sets and returns the cardinality
  */
 double hll_union_size(hll_t **hs, int num_hs, time_t timestamp, time_t time_window);
 
+/**
+ * Computes the sum of 2^-reg over a set of register
+ * values, along with the number of zero registers.
+ * @arg regs The register values
+ * @arg num_reg The number of registers
+ * @arg inv_sum Output, the sum of 2^-reg
+ * @arg num_zero Output, the number of zero registers
+ */
+void hll_sum_registers(const unsigned char *regs, int num_reg, double *inv_sum, int *num_zero);
+
+/**
+ * Selects the kernel used to sum registers. The fastest
+ * kernel the CPU supports is used by default.
+ * @arg name One of "avx2", "sse4.1", "scalar" or NULL
+ * for the fastest supported.
+ * @return 0 on success, -1 if the kernel is unknown or
+ * not supported by this CPU.
+ */
+int hll_use_sum_kernel(const char *name);
+
+/**
+ * Returns the name of the kernel used to sum registers
+ */
+const char *hll_sum_kernel_name(void);
+
 /**
  * Computes the minimum digits of precision
  * needed to hit a target error.
@@ -126,14 +256,99 @@ int binary_search(double val, int num, const double *array);
 double hll_bias_estimate(hll_t *hu, double raw_est);
 
 /**
- * Adds a time/leading point to a register
+ * Adds a time/leading point to a register. The points of a
+ * register are kept sorted by time with strictly decreasing
+ * register values. Points that are no newer and no larger than
+ * the new point are dropped, as are points that are older than
+ * the window period of the hll. The new point is skipped if an
+ * existing point already dominates it.
+ * @arg h The hll that owns the register
  * @arg r The register to add the point to
  * @arg p The time/leading point to add to the register
+ * @return The number of points that expired
  */
-void hll_register_add_point(hll_register *r, hll_dense_point p);
+int hll_register_add_point(hll_t *h, hll_register *r, hll_dense_point p);
 
+/**
+ * Restores the ordering of a register whose points were
+ * written in any order, such as one loaded from an older
+ * file. Dominated points are removed.
+ * @arg h The hll that owns the register
+ * @arg r The register to normalize
+ */
+void hll_register_normalize(hll_t *h, hll_register *r);
+
+/**
+ * Ensures a register can hold a number of points
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_register_reserve(hll_t *h, hll_register *r, uint32_t size);
+
+/**
+ * Reserves room in the arena ahead of adding
+ * a known number of points, such as when loading.
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_reserve_points(hll_t *h, uint64_t points);
+
+/**
+ * Prepares an empty hll to be loaded with a known set of
+ * registers. Their headers are created in one allocation, and
+ * the arena in another, sized for exactly the given points.
+ * Registers are then placed with hll_register_load.
+ * @arg h The hll, which must not have any registers
+ * @arg bitmap A bit for each register that has points,
+ * in little-endian bit order
+ * @arg points The total number of points
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_load_begin(hll_t *h, const unsigned char *bitmap, uint64_t points);
+
+/**
+ * Places an empty register being loaded in a block of exactly
+ * the given size, at the end of the arena.
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_register_load(hll_t *h, hll_register *r, uint32_t size);
+
+/**
+ * Finishes loading an hll, returning the arena space
+ * that the points did not use.
+ */
+void hll_load_end(hll_t *h);
+
+/**
+ * Rewrites the arena so that the registers are laid out back to
+ * back in register order, each in the smallest block that fits.
+ * This drops all free blocks, and the headers of empty registers.
+ * @arg h The hll to compact
+ * @return 0 on success, -1 on allocation failure
+ */
+int hll_compact(hll_t *h);
+
+/**
+ * Returns the value of a register over a time window
+ */
 int hll_get_register(hll_t *h, int register_index, time_t timestamp, time_t time_window);
 
+/**
+ * Rounds a timestamp down to the start of its
+ * window_precision bucket.
+ * @arg h The hll
+ * @arg timestamp The absolute timestamp
+ * @return The start of the bucket
+ */
+time_t hll_time_bucket(hll_t *h, time_t timestamp);
+
+/**
+ * Converts an absolute timestamp to an offset from the epoch,
+ * clamped to the range that a point can represent.
+ * @arg epoch The epoch of the hll
+ * @arg timestamp The absolute timestamp
+ * @return The offset to store in a hll_dense_point
+ */
+int32_t hll_time_offset(time_t epoch, time_t timestamp);
+
 void hll_convert_dense(hll_t *h);
 
 #endif
@@ -95,6 +95,19 @@ typedef struct {
     char *buffer;
 } circular_buffer;
 
+/**
+ * Locates a write acknowledgement among the
+ * held responses, so it can be turned into an error.
+ */
+typedef struct {
+    int offset;
+    int len;
+    char *key;      // Set the write was made to
+    int key_len;
+    char *err;      // Sent instead of the ack, if failed
+    int err_len;
+} held_ack;
+
 /**
  * Stores the connection specific data.
  * We initialize one of these per connection
@@ -113,6 +126,11 @@ typedef struct {
  * allows us to minimize copies and latency for most
  * clients, while still supporting the massive bulk
  * loads.
+ *
+ * While hold_responses is set, every response goes to
+ * the held buffer instead, and is only sent once it is
+ * released. The acks it holds are tracked, so that they
+ * can be failed if their writes do not make it to disk.
  */
 struct conn_info {
     worker_ev_userdata *thread_ev;
@@ -125,6 +143,12 @@ struct conn_info {
     ev_io write_client;
     circular_buffer output;
 
+    int hold_responses;
+    circular_buffer held;
+    held_ack *held_acks;
+    int num_held_acks;
+    int held_acks_size;
+
     struct conn_info *next;
 };
 
@@ -165,6 +189,7 @@ static void deactivate_client_connection(conn_info *conn);
 // Helpers for send_client_response
 static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
 static int send_client_response_direct(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
+static int send_client_response_held(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
 
 
 // Utility methods
@@ -737,6 +762,11 @@ static void close_client_connection(conn_info *conn) {
     // Clear everything out
     circbuf_free(&conn->input);
     circbuf_free(&conn->output);
+    circbuf_free(&conn->held);
+    for (int i=0; i < conn->num_held_acks; i++) {
+        free(conn->held_acks[i].key);
+    }
+    if (conn->held_acks) free(conn->held_acks);
 
     // Close the fd
     syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
@@ -772,8 +802,10 @@ int send_client_response(conn_info *conn, char **response_buffers, int *buf_size
         // Determine how many buffers to send
         send_bufs = ((num_bufs - offset) <= IOV_MAX) ? (num_bufs - offset) : IOV_MAX;
 
-        // Check if we are doing buffered writes
-        if (conn->use_write_buf) {
+        // Check if we are holding or doing buffered writes
+        if (conn->hold_responses) {
+            res = send_client_response_held(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
+        } else if (conn->use_write_buf) {
             res = send_client_response_buffered(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
         } else {
             res = send_client_response_direct(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
@@ -786,6 +818,124 @@ int send_client_response(conn_info *conn, char **response_buffers, int *buf_size
 }
 
 
+/**
+ * Sends the acknowledgement of a write to a client.
+ * While responses are held, the ack can still be
+ * failed before it is released.
+ * @arg conn The client connection
+ * @arg key The set the write was made to
+ * @arg key_len The length of the set name
+ * @arg ack The acknowledgement
+ * @arg ack_len The length of the acknowledgement
+ * @return 0 on success.
+ */
+int send_client_ack(conn_info *conn, const char *key, int key_len, char *ack, int ack_len) {
+    if (!conn->active || !conn->hold_responses) {
+        return send_client_response(conn, &ack, &ack_len, 1);
+    }
+
+    // Remember where the ack is held, and for which set
+    if (conn->num_held_acks == conn->held_acks_size) {
+        int new_size = (conn->held_acks_size) ? conn->held_acks_size * 2 : 16;
+        held_ack *new_acks = (held_ack*)realloc(conn->held_acks, new_size * sizeof(held_ack));
+        if (!new_acks) {
+            deactivate_client_connection(conn);
+            return 1;
+        }
+        conn->held_acks = new_acks;
+        conn->held_acks_size = new_size;
+    }
+    char *key_copy = (char*)malloc(key_len);
+    if (!key_copy) {
+        deactivate_client_connection(conn);
+        return 1;
+    }
+    memcpy(key_copy, key, key_len);
+
+    held_ack *held = conn->held_acks + conn->num_held_acks++;
+    held->offset = conn->held.write_cursor;
+    held->len = ack_len;
+    held->key = key_copy;
+    held->key_len = key_len;
+    held->err = NULL;
+    held->err_len = 0;
+    return send_client_response(conn, &ack, &ack_len, 1);
+}
+
+
+/**
+ * Holds back responses to a client until they are released.
+ * @arg conn The client connection
+ */
+void hold_client_responses(conn_info *conn) {
+    if (!conn->held.buffer) circbuf_init(&conn->held);
+    conn->hold_responses = 1;
+}
+
+
+/**
+ * Fails the acks held for a client for writes to a set.
+ * They are replaced with the error once released.
+ * @arg conn The client connection
+ * @arg key The set whose writes failed
+ * @arg key_len The length of the set name
+ * @arg err The error to send instead
+ * @arg err_len The length of the error
+ */
+void fail_client_acks(conn_info *conn, const char *key, int key_len, char *err, int err_len) {
+    for (int i=0; i < conn->num_held_acks; i++) {
+        held_ack *held = conn->held_acks + i;
+        if (held->key_len == key_len && !memcmp(held->key, key, key_len)) {
+            held->err = err;
+            held->err_len = err_len;
+        }
+    }
+}
+
+
+/**
+ * Sends the responses held for a client, with any failed
+ * acks swapped for their errors. Whatever cannot be
+ * written now is left to the write watcher.
+ * @arg conn The client connection
+ */
+void release_client_responses(conn_info *conn) {
+    if (!conn->hold_responses) return;
+    conn->hold_responses = 0;
+
+    // Copy the held responses around the failed acks
+    int failed = 0;
+    for (int i=0; i < conn->num_held_acks; i++) {
+        if (conn->held_acks[i].err) failed = 1;
+    }
+    if (failed) {
+        circular_buffer swapped;
+        circbuf_init(&swapped);
+        int start = 0;
+        for (int i=0; i < conn->num_held_acks; i++) {
+            held_ack *held = conn->held_acks + i;
+            if (!held->err) continue;
+            circbuf_write(&swapped, conn->held.buffer + start, held->offset - start);
+            circbuf_write(&swapped, held->err, held->err_len);
+            start = held->offset + held->len;
+        }
+        circbuf_write(&swapped, conn->held.buffer + start, conn->held.write_cursor - start);
+        circbuf_free(&conn->held);
+        conn->held = swapped;
+    }
+    for (int i=0; i < conn->num_held_acks; i++) {
+        free(conn->held_acks[i].key);
+    }
+    conn->num_held_acks = 0;
+
+    // The held buffer is never read from, so it stays contiguous
+    char *held = conn->held.buffer;
+    int held_len = conn->held.write_cursor;
+    conn->held.write_cursor = 0;
+    if (held_len) send_client_response(conn, &held, &held_len, 1);
+}
+
+
 static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
     // Copy the buffers to the output buffer
     int res = 0;
@@ -797,6 +947,17 @@ static int send_client_response_buffered(conn_info *conn, char **response_buffer
 }
 
 
+static int send_client_response_held(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
+    // Copy the buffers to the held buffer
+    int res = 0;
+    for (int i=0; i< num_bufs; i++) {
+        res = circbuf_write(&conn->held, response_buffers[i], buf_sizes[i]);
+        if (res) break;
+    }
+    return res;
+}
+
+
 static int send_client_response_direct(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
     // Stack allocate the iovectors
     struct iovec *vectors = (struct iovec*)alloca(num_bufs * sizeof(struct iovec));
@@ -1100,10 +1261,15 @@ static conn_info* get_conn() {
     // Setup variables
     conn->active = 1;
     conn->use_write_buf = 0;
+    conn->hold_responses = 0;
+    conn->held_acks = NULL;
+    conn->num_held_acks = 0;
+    conn->held_acks_size = 0;
 
-    // Prepare the buffers
+    // Prepare the buffers, the held one is only needed once used
     circbuf_init(&conn->input);
     circbuf_init(&conn->output);
+    conn->held.buffer = NULL;
 
     // Store a reference to the conn object
     conn->client.data = conn;
@@ -57,6 +57,44 @@ int shutdown_networking(hlld_networking *netconf, pthread_t *threads);
  */
 int send_client_response(hlld_conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
 
+/**
+ * Sends the acknowledgement of a write to a client. While
+ * responses are held, the ack can still be failed.
+ * @arg conn The client connection
+ * @arg key The set the write was made to
+ * @arg key_len The length of the set name
+ * @arg ack The acknowledgement
+ * @arg ack_len The length of the acknowledgement
+ * @return 0 on success.
+ */
+int send_client_ack(hlld_conn_info *conn, const char *key, int key_len, char *ack, int ack_len);
+
+/**
+ * Holds back the responses to a client, so that they are only
+ * sent once released. This lets replies wait for the writes
+ * they acknowledge to be committed.
+ * @arg conn The client connection
+ */
+void hold_client_responses(hlld_conn_info *conn);
+
+/**
+ * Replaces the acks held for a client's writes to a set
+ * with an error, for when those writes have failed.
+ * @arg conn The client connection
+ * @arg key The set whose writes failed
+ * @arg key_len The length of the set name
+ * @arg err The error to send instead
+ * @arg err_len The length of the error
+ */
+void fail_client_acks(hlld_conn_info *conn, const char *key, int key_len, char *err, int err_len);
+
+/**
+ * Sends the responses held for a client, with
+ * failed acks replaced by their errors.
+ * @arg conn The client connection
+ */
+void release_client_responses(hlld_conn_info *conn);
+
 /**
  * This method is used to conveniently extract commands from the
  * command buffer. It scans up to a terminator, and then sets the
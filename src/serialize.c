@@ -13,13 +13,55 @@
 #include "hll.h"
 #include "serialize.h"
 #include "sparse.h"
+#include "varint.h"
 
-#define SERIAL_VERSION 2
+#define SERIAL_VERSION 4
+#define SERIAL_VERSION_V3 3
+#define SERIAL_VERSION_V2 2
 #define ERR(err) if (err == -1) { return -1; }
 
-// After the start of serialization the hll might fgrow a little more, tack on
-// some extra space in the buffer to handle this.
-#define SERIALIZE_BUFFER_EXTRA 256
+/*
+ * Version 4 compresses version 3. After the same header
+ * comes a bitmap of the registers that have points, then the
+ * register values of every point packed 6 bits each, four to
+ * three bytes. Last is a varint stream holding, for each
+ * register in the bitmap, its size, the zigzag offset of its
+ * first point from the epoch, and the time from each point
+ * to the next. Points in a register are sorted by time, so
+ * the deltas are small and never negative.
+ *
+ *   int32 version, precision, window_period, window_precision
+ *   int64 epoch
+ *   uint32 points
+ *   uint8 bitmap[NUM_REG / 8]
+ *   uint8 registers[3 * ceil(points / 4)]
+ *   varint size, zigzag first, delta[size - 1] per register
+ */
+#define SERIAL_V4_BITMAP_SIZE(precision) (NUM_REG(precision) / 8)
+#define SERIAL_V4_PACKED_SIZE(points) (3 * (((points) + 3) / 4))
+#define SERIAL_V4_MAX_REGISTER 63
+
+// Worst case varint lengths of a register size, which
+// is at most 256, and of a 32 bit time offset
+#define SERIAL_V4_SIZE_MAX_LEN 2
+#define SERIAL_V4_OFFSET_MAX_LEN 5
+
+/*
+ * Version 3 is little-endian throughout. A fixed header is
+ * followed by columns: the size of every register, then the
+ * timestamp of every point as an offset from the epoch, then
+ * the register value of every point. Points are grouped by
+ * register, in register order.
+ *
+ *   int32 version, precision, window_period, window_precision
+ *   int64 epoch
+ *   uint32 points
+ *   uint16 sizes[NUM_REG]
+ *   int32 timestamps[points]
+ *   uint8 registers[points]
+ */
+#define SERIAL_V3_HEADER_SIZE (4 * sizeof(int32_t) + sizeof(int64_t) + sizeof(uint32_t))
+#define SERIAL_V3_POINT_SIZE (sizeof(int32_t) + sizeof(unsigned char))
 
 int serialize_int(serialize_t *s, int i) {
     if (s->offset + sizeof(int) >= s->size)
@@ -135,62 +177,382 @@ int unserialize_string(serialize_t *s, char **out_str, int *out_len) {
 }
 
 
-int serialize_hll_register(serialize_t *s, hll_register *h) {
-    ERR(serialize_long(s, h->size));
-    for (long i=0; i<h->size; i++) {
-        ERR(serialize_time(s, h->points[i].timestamp));
-        ERR(serialize_long(s, h->points[i].register_));
+/*
+ * Little-endian accessors. These compile to plain loads and
+ * stores on little-endian hosts, so the columns are copied in
+ * bulk, and only swap bytes elsewhere.
+ */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE16(x) __builtin_bswap16(x)
+#define LE32(x) __builtin_bswap32(x)
+#define LE64(x) __builtin_bswap64(x)
+#else
+#define LE16(x) (x)
+#define LE32(x) (x)
+#define LE64(x) (x)
+#endif
+
+static inline void put_le16(unsigned char *p, uint16_t v) {
+    v = LE16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v) {
+    v = LE32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_le64(unsigned char *p, uint64_t v) {
+    v = LE64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t get_le16(const unsigned char *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return LE16(v);
+}
+
+static inline uint32_t get_le32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return LE32(v);
+}
+
+static inline uint64_t get_le64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return LE64(v);
+}
+
+/**
+ * Counts the points held by every register of an hll
+ */
+static uint64_t hll_total_points(hll_t *h) {
+    uint64_t total = 0;
+    int num_regs = NUM_REG(h->precision);
+    for (int i=0; i<num_regs; i++) {
+        hll_register *r = hll_find_register(h, i);
+        if (r) total += r->size;
+    }
+    return total;
+}
+
+/**
+ * A register in the version 2 format. Registers are written with absolute timestamps so that the
+ * on-disk format does not depend on the epoch of the hll.
+ */
+int serialize_hll_register(serialize_t *s, hll_t *h, int idx) {
+    hll_register *r = hll_find_register(h, idx);
+    if (!r) return serialize_long(s, 0);
+    hll_dense_point *points = hll_register_points(h, r);
+    ERR(serialize_long(s, r->size));
+    for (uint32_t i=0; i<r->size; i++) {
+        ERR(serialize_time(s, h->epoch + points[i].timestamp));
+        ERR(serialize_long(s, points[i].register_));
     }
     return 0;
 }
 
-int unserialize_hll_register(serialize_t *s, hll_register *h) {
-    ERR(unserialize_long(s, &h->size));
-    h->capacity = h->size;
-    if (h->capacity == 0) {
-        h->points = NULL;
-    } else {
-        h->points = (hll_dense_point*)malloc(h->capacity*sizeof(hll_dense_point));
+/**
+ * Reads a register into the arena of an hll. Points are
+ * read straight into a block of the arena, and empty
+ * registers are not given a header.
+ */
+int unserialize_hll_register(serialize_t *s, hll_t *h, int idx) {
+    long size;
+    ERR(unserialize_long(s, &size));
+    if (size < 0) return -1;
+    if (size == 0) return 0;
+    hll_register *r = hll_create_register(h, idx);
+    if (!r) return -1;
+
+    time_t timestamp;
+    long register_;
+    hll_dense_point p;
+    if (hll_register_reserve(h, r, (uint32_t)size)) {
+        // Files written before registers were ordered may hold
+        // more points than fit in a block, add them one by one
+        for (long i=0; i<size; i++) {
+            ERR(unserialize_time(s, &timestamp));
+            ERR(unserialize_long(s, &register_));
+            p.timestamp = hll_time_offset(h->epoch, timestamp);
+            p.register_ = (unsigned char)register_;
+            hll_register_add_point(h, r, p);
+        }
+        return 0;
     }
-    for (long i=0; i<h->size; i++) {
-        ERR(unserialize_time(s, &h->points[i].timestamp));
-        ERR(unserialize_long(s, &h->points[i].register_));
+
+    hll_dense_point *points = hll_register_points(h, r);
+    for (long i=0; i<size; i++) {
+        ERR(unserialize_time(s, &timestamp));
+        ERR(unserialize_long(s, &register_));
+        points[i].timestamp = hll_time_offset(h->epoch, timestamp);
+        points[i].register_ = (unsigned char)register_;
+        r->size++;
     }
+
+    // Files written before registers were ordered may hold
+    // points in any order
+    hll_register_normalize(h, r);
     return 0;
 }
 
+/**
+ * Packs four register values into three bytes
+ */
+static inline void pack_registers(unsigned char *out, const unsigned char *v) {
+    out[0] = (unsigned char)(v[0] | (v[1] << 6));
+    out[1] = (unsigned char)((v[1] >> 2) | (v[2] << 4));
+    out[2] = (unsigned char)((v[2] >> 4) | (v[3] << 2));
+}
+
+/**
+ * Unpacks four register values from three bytes
+ */
+static inline void unpack_registers(unsigned char *v, const unsigned char *in) {
+    v[0] = in[0] & 0x3f;
+    v[1] = (unsigned char)((in[0] >> 6) | ((in[1] & 0x0f) << 2));
+    v[2] = (unsigned char)((in[1] >> 4) | ((in[2] & 0x03) << 4));
+    v[3] = in[2] >> 2;
+}
+
+/**
+ * Writes an hll in the version 4 format. The space is
+ * checked once for the largest the set could encode to.
+ */
 int serialize_hll(serialize_t *s, hll_t *h) {
-    ERR(serialize_int(s, SERIAL_VERSION));
-    ERR(serialize_int(s, (int)h->precision));
-    ERR(serialize_int(s, h->window_period));
-    ERR(serialize_int(s, h->window_precision));
     int num_regs = NUM_REG(h->precision);
-    for(int i=0; i<num_regs; i++) {
-        ERR(serialize_hll_register(s, &h->dense_registers[i]));
+    uint64_t total = hll_total_points(h);
+    if (total > UINT32_MAX || s->offset + serialized_hll_size(h) > s->size)
+        return -1;
+
+    unsigned char *out = s->memory + s->offset;
+    put_le32(out, SERIAL_VERSION);
+    put_le32(out + 4, h->precision);
+    put_le32(out + 8, h->window_period);
+    put_le32(out + 12, h->window_precision);
+    put_le64(out + 16, h->epoch);
+    put_le32(out + 24, (uint32_t)total);
+
+    unsigned char *bitmap = out + SERIAL_V3_HEADER_SIZE;
+    unsigned char *packed = bitmap + SERIAL_V4_BITMAP_SIZE(h->precision);
+    unsigned char *stream = packed + SERIAL_V4_PACKED_SIZE(total);
+    memset(bitmap, 0, SERIAL_V4_BITMAP_SIZE(h->precision));
+
+    // Register values are gathered four at a time to be packed
+    unsigned char group[4];
+    uint64_t n = 0;
+    size_t len = 0;
+    for (int i=0; i<num_regs; i++) {
+        hll_register *r = hll_find_register(h, i);
+        if (!r || !r->size) continue;
+        if (n + r->size > total) return -1;
+        bitmap[i / 8] |= (unsigned char)(1 << (i % 8));
+
+        hll_dense_point *points = hll_register_points(h, r);
+        len += varint_put(stream + len, r->size);
+        len += varint_put(stream + len, zigzag_encode(points[0].timestamp));
+        for (uint16_t j=0; j<r->size; j++) {
+            if (j) {
+                if (points[j].timestamp < points[j-1].timestamp) return -1;
+                len += varint_put(stream + len, (uint64_t)((int64_t)points[j].timestamp - points[j-1].timestamp));
+            }
+            if (points[j].register_ > SERIAL_V4_MAX_REGISTER) return -1;
+            group[n % 4] = points[j].register_;
+            if (++n % 4 == 0) pack_registers(packed + 3 * (n / 4 - 1), group);
+        }
+    }
+    if (n != total) return -1;
+    if (n % 4) {
+        for (uint64_t k = n % 4; k < 4; k++) group[k] = 0;
+        pack_registers(packed + 3 * (n / 4), group);
     }
+
+    s->offset += stream + len - out;
     return 0;
 }
 
-int unserialize_hll(serialize_t *s, hll_t *h) {
+/**
+ * Reads an hll in the version 4 format. The bitmap lets every
+ * register header be created at once, and registers are already
+ * in order, so points are decoded straight into an arena of the
+ * exact size. A load takes two allocations, one for the headers
+ * and one for the arena, however many registers are set.
+ */
+static int unserialize_hll_v4(serialize_t *s, hll_t *h) {
+    if (s->offset + SERIAL_V3_HEADER_SIZE > s->size)
+        return -1;
+    const unsigned char *in = s->memory + s->offset;
+    const unsigned char *end = s->memory + s->size;
+    int precision = (int32_t)get_le32(in + 4);
+    int window_period = (int32_t)get_le32(in + 8);
+    int window_precision = (int32_t)get_le32(in + 12);
+    time_t epoch = (time_t)(int64_t)get_le64(in + 16);
+    uint32_t total = get_le32(in + 24);
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        return -1;
+
+    const unsigned char *bitmap = in + SERIAL_V3_HEADER_SIZE;
+    const unsigned char *packed = bitmap + SERIAL_V4_BITMAP_SIZE(precision);
+    const unsigned char *stream = packed + SERIAL_V4_PACKED_SIZE((size_t)total);
+    if (stream > end || stream < packed)
+        return -1;
+
+    ERR(hll_init((unsigned char)precision, window_period, window_precision, h));
+    h->epoch = epoch;
+    if (hll_load_begin(h, bitmap, total)) {
+        hll_destroy(h);
+        return -1;
+    }
+
+    // Register values are unpacked four at a time
+    unsigned char group[4];
+    uint64_t n = 0;
+    int num_regs = NUM_REG(precision);
+    for (int i=0; i<num_regs; i++) {
+        if (!(bitmap[i / 8] & (1 << (i % 8)))) continue;
+
+        uint64_t size, zigzag, delta;
+        if (varint_get(&stream, end, &size) || !size || n + size > total ||
+                varint_get(&stream, end, &zigzag)) {
+            goto ERROR;
+        }
+        hll_register *r = hll_find_register(h, i);
+        if (hll_register_load(h, r, (uint32_t)size)) goto ERROR;
+
+        hll_dense_point *points = hll_register_points(h, r);
+        int64_t timestamp = zigzag_decode(zigzag);
+        for (uint64_t j=0; j<size; j++) {
+            if (j) {
+                if (varint_get(&stream, end, &delta)) goto ERROR;
+                timestamp += delta;
+            }
+            if (timestamp < INT32_MIN || timestamp > INT32_MAX) goto ERROR;
+            if (n % 4 == 0) unpack_registers(group, packed + 3 * (n / 4));
+            points[j].timestamp = (int32_t)timestamp;
+            points[j].register_ = group[n % 4];
+            n++;
+        }
+        r->size = (uint16_t)size;
+    }
+    if (n != total) goto ERROR;
+    hll_load_end(h);
+
+    s->offset = stream - s->memory;
+    return 0;
+
+ERROR:
+    hll_destroy(h);
+    return -1;
+}
+
+/**
+ * Reads an hll in the version 3 format. Points are kept
+ * relative to the stored epoch, so they are copied as is,
+ * and registers are already in order.
+ */
+static int unserialize_hll_v3(serialize_t *s, hll_t *h) {
+    if (s->offset + SERIAL_V3_HEADER_SIZE > s->size)
+        return -1;
+    const unsigned char *in = s->memory + s->offset;
+    int precision = (int32_t)get_le32(in + 4);
+    int window_period = (int32_t)get_le32(in + 8);
+    int window_precision = (int32_t)get_le32(in + 12);
+    time_t epoch = (time_t)(int64_t)get_le64(in + 16);
+    uint32_t total = get_le32(in + 24);
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        return -1;
+
+    int num_regs = NUM_REG(precision);
+    size_t size = SERIAL_V3_HEADER_SIZE + sizeof(uint16_t) * num_regs + SERIAL_V3_POINT_SIZE * (size_t)total;
+    if (s->offset + size > s->size)
+        return -1;
+
+    ERR(hll_init((unsigned char)precision, window_period, window_precision, h));
+    h->epoch = epoch;
+    if (hll_reserve_points(h, total)) {
+        hll_destroy(h);
+        return -1;
+    }
+
+    const unsigned char *sizes = in + SERIAL_V3_HEADER_SIZE;
+    const unsigned char *timestamps = sizes + sizeof(uint16_t) * num_regs;
+    const unsigned char *registers = timestamps + sizeof(int32_t) * total;
+    uint64_t n = 0;
+    for (int i=0; i<num_regs; i++) {
+        uint16_t reg_size = get_le16(sizes + sizeof(uint16_t) * i);
+        if (!reg_size) continue;
+
+        hll_register *r = NULL;
+        if (n + reg_size <= total) r = hll_create_register(h, i);
+        if (!r || hll_register_reserve(h, r, reg_size)) {
+            hll_destroy(h);
+            return -1;
+        }
+
+        hll_dense_point *points = hll_register_points(h, r);
+        for (uint16_t j=0; j<reg_size; j++) {
+            points[j].timestamp = (int32_t)get_le32(timestamps + sizeof(int32_t) * (n + j));
+            points[j].register_ = registers[n + j];
+        }
+        r->size = reg_size;
+        n += reg_size;
+    }
+    if (n != total) {
+        hll_destroy(h);
+        return -1;
+    }
+    s->offset += size;
+    return 0;
+}
+
+/**
+ * Reads an hll in the version 2 format, where every point is
+ * written as a native long and time_t pair.
+ */
+static int unserialize_hll_v2(serialize_t *s, hll_t *h) {
     int version;
     ERR(unserialize_int(s, &version));
-    if (version != SERIAL_VERSION) {
+    if (version != SERIAL_VERSION_V2) {
         return -1;
     }
 
-    int temp;
-    ERR(unserialize_int(s, &temp));
-    h->precision = (unsigned char)temp;
-    ERR(unserialize_int(s, &h->window_period));
-    ERR(unserialize_int(s, &h->window_precision));
+    int precision, window_period, window_precision;
+    ERR(unserialize_int(s, &precision));
+    ERR(unserialize_int(s, &window_period));
+    ERR(unserialize_int(s, &window_precision));
+    ERR(hll_init((unsigned char)precision, window_period, window_precision, h));
+
+    // Size the arena for the remaining points up front
+    // so loading does not grow it point by point
+    hll_reserve_points(h, (s->size - s->offset) / (sizeof(time_t) + sizeof(long)));
+
     int num_regs = NUM_REG(h->precision);
-    h->dense_registers = (hll_register*)malloc(num_regs*sizeof(hll_register));
     for(int i=0; i<num_regs; i++) {
-        ERR(unserialize_hll_register(s, &h->dense_registers[i]));
+        if (unserialize_hll_register(s, h, i)) {
+            hll_destroy(h);
+            return -1;
+        }
     }
     return 0;
 }
 
+/**
+ * Reads an hll in the current format, or one of the formats
+ * it replaced. Version 2 wrote the version in host order,
+ * which matches on the little-endian hosts it ran on.
+ */
+int unserialize_hll(serialize_t *s, hll_t *h) {
+    if (s->offset + sizeof(int32_t) > s->size)
+        return -1;
+    int version = (int32_t)get_le32(s->memory + s->offset);
+    if (version == SERIAL_VERSION) return unserialize_hll_v4(s, h);
+    if (version == SERIAL_VERSION_V3) return unserialize_hll_v3(s, h);
+    if (version == SERIAL_VERSION_V2) return unserialize_hll_v2(s, h);
+    return -1;
+}
+
 /***
  * @return 0 on success
  *        -1 on failure
@@ -199,60 +561,86 @@ int unserialize_hll(serialize_t *s, hll_t *h) {
 int unserialize_hll_from_sparsedb(
     struct slidingd_sparsedb *sparsedb, hll_t *h, char *full_key, int full_key_len
 ) {
-    size_t len;
-    unsigned char *buffer;
-    
-    int res = sparse_read_dense_data(sparsedb, full_key, full_key_len, &buffer, &len);
+    sparse_value value;
+    int res = sparse_read_dense_value(sparsedb, full_key, full_key_len, &value);
     if (res) {
         syslog(LOG_ERR, "failed to read data from sparsedb");
         return -1;
     }
 
-    if (len == 0) {
-        if (buffer) free(buffer);
+    if (value.len == 0) {
+        sparse_release_value(&value);
         return -2;
     }
 
-    serialize_t s = {buffer, 0, len};
+    // Only read from, so the pinned data can be used in place
+    serialize_t s = {(unsigned char *)value.data, 0, value.len};
     res = unserialize_hll(&s, h);
     if (res != 0) {
         perror("Failed to unserialize hll");
     }
+    sparse_release_value(&value);
 
     return res;
 }
 
+/**
+ * Returns the most space an hll can take serialized. Most sets
+ * take far less, as most time deltas fit in a byte.
+ */
 size_t serialized_hll_size(hll_t *h) {
-    // VERSION
-    size_t size = sizeof(int);
+    uint64_t present = 0, total = 0;
+    int num_regs = NUM_REG(h->precision);
+    for (int i=0; i<num_regs; i++) {
+        hll_register *r = hll_find_register(h, i);
+        if (r && r->size) {
+            present++;
+            total += r->size;
+        }
+    }
 
-    // precision, window_period, window_precision
-    size += sizeof(int) * 3;
+    // Header, bitmap and packed registers, then
+    // the varint size and timestamps of each register
+    return SERIAL_V3_HEADER_SIZE
+        + SERIAL_V4_BITMAP_SIZE(h->precision)
+        + SERIAL_V4_PACKED_SIZE(total)
+        + SERIAL_V4_SIZE_MAX_LEN * present
+        + SERIAL_V4_OFFSET_MAX_LEN * total;
+}
 
-    for(int i=0; i<NUM_REG(h->precision); i++) {
-        // size, size*(timestamp, register)
-        size += sizeof(long) + (sizeof(long)+sizeof(time_t))*h->dense_registers[i].size; 
+/**
+ * Serializes an hll into a new buffer. Callers that share the
+ * hll hold its lock for this, and write the buffer out after.
+ * @arg buf Output, the malloc'd buffer on success
+ * @arg len Output, the serialized length
+ * @return 0 on success, -1 on failure
+ */
+int serialize_hll_to_buffer(hll_t *h, unsigned char **buf, size_t *len) {
+    size_t max_size = serialized_hll_size(h);
+    unsigned char *addr = (unsigned char*)malloc(max_size);
+    if (!addr) return -1;
+
+    serialize_t s = {addr, 0, max_size};
+    if (serialize_hll(&s, h)) {
+        free(addr);
+        return -1;
     }
-    return size;
+    *buf = addr;
+    *len = s.offset;
+    return 0;
 }
 
 int serialize_hll_to_sparsedb(
     struct slidingd_sparsedb *sparsedb, hll_t *h, char *full_key, int full_key_len
   ) {
-    size_t serialized_size = serialized_hll_size(h);
-    size_t max_size = serialized_size + SERIALIZE_BUFFER_EXTRA;
-
-    unsigned char* addr = (unsigned char*)malloc(sizeof(char)*max_size);
-    serialize_t s = {addr, 0, max_size};
-    int res = serialize_hll(&s, h);
+    unsigned char *addr;
+    size_t serialized_size;
+    int res = serialize_hll_to_buffer(h, &addr, &serialized_size);
     if (res == -1) {
         syslog(LOG_ERR, "unable to serialize hl");
         return -1;
     }
 
-    // Grab the serialized size from the data we actually wrote
-    serialized_size = s.offset;
-
     res = sparse_write_dense_data(
         sparsedb, full_key, full_key_len,
         addr, serialized_size
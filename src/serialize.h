@@ -10,10 +10,10 @@ typedef struct {
     size_t size;
 } serialize_t;
 
-int serialize_hll(serialize_t *s, hll_t *h, char *name, int name_len);
-int unserialize_hll(serialize_t *s, hll_t *h, char **name, int *name_len);
-int serialize_hll_register(serialize_t *s, hll_register *h);
-int unserialize_hll_register(serialize_t *s, hll_register *h);
+int serialize_hll(serialize_t *s, hll_t *h);
+int unserialize_hll(serialize_t *s, hll_t *h);
+int serialize_hll_register(serialize_t *s, hll_t *h, int idx);
+int unserialize_hll_register(serialize_t *s, hll_t *h, int idx);
 
 int serialize_int(serialize_t *s, int i);
 int unserialize_int(serialize_t *s, int *i);
@@ -27,8 +27,9 @@ int serialize_ulong_long(serialize_t *s, uint64_t i);
 int unserialize_ulong_long(serialize_t *s, uint64_t *i);
 
 
-size_t serialized_hll_size(hll_t *h, int name_len);
+size_t serialized_hll_size(hll_t *h);
 
 int unserialize_hll_from_sparsedb(struct slidingd_sparsedb *sparsedb, hll_t *h, char *full_key, int full_key_len);
+int serialize_hll_to_buffer(hll_t *h, unsigned char **buf, size_t *len);
 int serialize_hll_to_sparsedb(struct slidingd_sparsedb *sparsedb, hll_t *h, char *full_key, int full_key_len);
 #endif
@@ -11,6 +11,7 @@
 #include "set.h"
 #include "serialize.h"
 #include "sparse.h"
+#include "hash.h"
 #include "type_compat.h"
 
 /*
@@ -19,9 +20,6 @@
 static int thread_safe_fault(struct hlld_set *f);
 static int timediff_msec(struct timeval *t1, struct timeval *t2);
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
-
 /**
  * Initializes a set wrapper.
  * @arg config The configuration to use
@@ -58,7 +56,7 @@ int init_set(
     s->set_config.sliding_precision = config->sliding_precision;
 
     // Initialize the locks
-    INIT_HLLD_SPIN(&s->hll_update);
+    pthread_mutex_init(&s->hll_update, NULL);
     pthread_mutex_init(&s->hll_lock, NULL);
 
     // Discover the existing set if we need to
@@ -125,20 +123,54 @@ int hset_flush(struct hlld_set *set) {
     struct timeval start, end;
     gettimeofday(&start, NULL);
 
+    // Expiry and compaction move points around, so both happen
+    // under the update lock, which size queries also take
+    pthread_mutex_lock(&set->hll_update);
+
+    // Drop expired points first so they are not written out
+    uint64_t expired = hll_expire(&set->hll, time(NULL));
+    set->counters.expired += expired;
+    if (expired > 0)
+        set->is_dirty = 1;
+
     // If we are not dirty, nothing to do
-    if (!set->is_dirty)
+    if (!set->is_dirty) {
+        pthread_mutex_unlock(&set->hll_update);
         return -2;
+    }
 
     // Turn dirty off
     set->is_dirty = 0;
 
+    // Pack the register points now that adds and
+    // expiry may have left free blocks behind
+    if (hll_compact(&set->hll)) {
+        syslog(LOG_ERR, "Failed to compact set '%s'", set->full_key);
+    }
+
+    // Serialize a snapshot while adds are excluded, and
+    // write it out once they can continue
+    unsigned char *buf;
+    size_t len;
+    int res = serialize_hll_to_buffer(&set->hll, &buf, &len);
+    pthread_mutex_unlock(&set->hll_update);
+    if (res) {
+      syslog(LOG_ERR, "Failed to serialize set '%s'", set->full_key);
+      set->is_dirty = 1;
+      return -1;
+    }
+
     // Flush the set
-    int res = serialize_hll_to_sparsedb(
-        sparse_get_global(), &set->hll,
-        set->full_key, set->full_key_len
+    res = sparse_write_dense_data(
+        sparse_get_global(),
+        set->full_key, set->full_key_len,
+        buf, len
     );
+    free(buf);
 
+    // Keep the set dirty so the next flush retries it
     if (res) {
+      set->is_dirty = 1;
       return -1;
     }
 
@@ -149,6 +181,26 @@ int hset_flush(struct hlld_set *set) {
     return 0;
 }
 
+/**
+ * Drops the points that are older than the
+ * sliding period of the set. Idempotent if the
+ * set is proxied.
+ * @note Thread safe.
+ * @arg set The set to expire
+ * @arg now The current time
+ * @return The number of points that expired.
+ */
+uint64_t hset_expire(struct hlld_set *set, time_t now) {
+    if (set->is_proxied)
+        return 0;
+
+    pthread_mutex_lock(&set->hll_update);
+    uint64_t expired = hll_expire(&set->hll, now);
+    set->counters.expired += expired;
+    pthread_mutex_unlock(&set->hll_update);
+    return expired;
+}
+
 /**
  * Gracefully closes a set.
  * @arg set The set to close
@@ -205,10 +257,34 @@ int hset_add_hash(struct hlld_set *set, uint64_t hash, time_t timestamp) {
 
     // Add the hashed value and update the
     // counters
-    LOCK_HLLD_SPIN(&set->hll_update);
-    hll_add_hash_at_time(&set->hll, hash, timestamp);
+    pthread_mutex_lock(&set->hll_update);
+    set->counters.expired += hll_add_hash_at_time(&set->hll, hash, timestamp);
     set->counters.sets += 1;
-    UNLOCK_HLLD_SPIN(&set->hll_update);
+    pthread_mutex_unlock(&set->hll_update);
+
+    // Mark as dirty
+    set->is_dirty = 1;
+    return 0;
+}
+
+/**
+ * Adds a batch of hashes seen at the same time. The
+ * update lock is taken once for the whole batch.
+ * @arg set The set to add to
+ * @arg hashes The hashes to add
+ * @arg num_hashes The number of hashes
+ * @arg timestamp The time the hashes were seen
+ * @return 0 on success.
+ */
+int hset_add_hashes(struct hlld_set *set, const uint64_t *hashes, int num_hashes, time_t timestamp) {
+    if (set->is_proxied) {
+        if (thread_safe_fault(set) != 0) return -1;
+    }
+
+    pthread_mutex_lock(&set->hll_update);
+    set->counters.expired += hll_add_hashes_at_time(&set->hll, hashes, num_hashes, timestamp);
+    set->counters.sets += num_hashes;
+    pthread_mutex_unlock(&set->hll_update);
 
     // Mark as dirty
     set->is_dirty = 1;
@@ -220,10 +296,7 @@ int hset_add(struct hlld_set *set, char *key, time_t timestamp) {
     // so that we can use the hll_add_hash instead of
     // hll_add. This way, the expensive CPU bit can
     // be done without holding a lock
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
-    return hset_add_hash(set, out[1], timestamp);
+    return hset_add_hash(set, hash_value(key, strlen(key)), timestamp);
 }
 
 /**
@@ -236,14 +309,61 @@ uint64_t hset_size_total(struct hlld_set *set) {
     if (set->is_proxied) {
         if (thread_safe_fault(set) != 0) return -1;
     }
-    return hll_size_total(&set->hll);
+
+    // Adds may move the points of every register when the
+    // arena grows, so reads take the update lock too. It is
+    // a mutex, so adds sleep through a query rather than spin.
+    pthread_mutex_lock(&set->hll_update);
+    double size = hll_size_total(&set->hll);
+    pthread_mutex_unlock(&set->hll_update);
+    if (size < 0) return -1;
+    return size;
 }
 
 uint64_t hset_size(struct hlld_set *set, time_t timestamp, uint64_t time_window) {
     if (set->is_proxied) {
         if (thread_safe_fault(set) != 0) return -1;
     }
-    return hll_size(&set->hll, timestamp, (int)time_window);
+
+    pthread_mutex_lock(&set->hll_update);
+    double size = hll_size(&set->hll, timestamp, (int)time_window);
+    pthread_mutex_unlock(&set->hll_update);
+    if (size < 0) return -1;
+    return size;
+}
+
+/**
+ * Gets the size of the set over several time windows
+ * @note Thread safe.
+ * @arg set The set to check
+ * @arg timestamp the current time
+ * @arg time_windows the amounts of time we're counting
+ * @arg num_windows the number of windows
+ * @arg estimates Output, the estimated size for each window
+ * @return 0 on success
+ */
+int hset_size_multi(struct hlld_set *set, time_t timestamp, const uint64_t *time_windows, int num_windows, uint64_t *estimates) {
+    if (set->is_proxied) {
+        if (thread_safe_fault(set) != 0) return -1;
+    }
+
+    time_t *windows = (time_t*)malloc(num_windows * sizeof(time_t));
+    double *sizes = (double*)malloc(num_windows * sizeof(double));
+    int res = -1;
+    if (windows && sizes) {
+        for (int i=0; i < num_windows; i++) {
+            windows[i] = (int)time_windows[i];
+        }
+        pthread_mutex_lock(&set->hll_update);
+        res = hll_size_multi(&set->hll, timestamp, windows, num_windows, sizes);
+        pthread_mutex_unlock(&set->hll_update);
+        for (int i=0; !res && i < num_windows; i++) {
+            estimates[i] = sizes[i];
+        }
+    }
+    free(windows);
+    free(sizes);
+    return res;
 }
 
 /**
@@ -2,7 +2,6 @@
 #define SET_H
 #include <pthread.h>
 #include "config.h"
-#include "spinlock.h"
 #include "hll.h"
 
 /*
@@ -16,6 +15,7 @@ typedef struct {
     uint64_t sets;
     uint64_t page_ins;
     uint64_t page_outs;
+    uint64_t expired;       // Points dropped for being older than the window period
 } set_counters;
 
 /**
@@ -34,7 +34,7 @@ struct hlld_set {
     char is_config_dirty;
     char is_dirty;                  // Has a write happened
     hll_t hll;                      // Underlying HLL
-    hlld_spinlock hll_update;       // Protect the updates
+    pthread_mutex_t hll_update;     // Protects the HLL, held by reads too
 
     set_counters counters;         // Counters
 };
@@ -84,6 +84,17 @@ int hset_is_proxied(struct hlld_set *set);
  */
 int hset_flush(struct hlld_set *set);
 
+/**
+ * Drops the points that are older than the
+ * sliding period of the set. Idempotent if the
+ * set is proxied.
+ * @note Thread safe.
+ * @arg set The set to expire
+ * @arg now The current time
+ * @return The number of points that expired.
+ */
+uint64_t hset_expire(struct hlld_set *set, time_t now);
+
 /**
  * Gracefully closes a set.
  * @arg set The set to close
@@ -107,6 +118,17 @@ int hset_delete(struct hlld_set *set);
 int hset_add(struct hlld_set *set, char *key, time_t timestamp);
 int hset_add_hash(struct hlld_set *set, uint64_t hash, time_t timestamp);
 
+/**
+ * Adds a batch of hashes seen at the same time,
+ * taking the update lock once.
+ * @arg set The set to add to
+ * @arg hashes The hashes to add
+ * @arg num_hashes The number of hashes
+ * @arg timestamp The time the hashes were seen
+ * @return 0 on success.
+ */
+int hset_add_hashes(struct hlld_set *set, const uint64_t *hashes, int num_hashes, time_t timestamp);
+
 /**
  * Gets the size of the set
  * @note Thread safe.
@@ -118,6 +140,19 @@ int hset_add_hash(struct hlld_set *set, uint64_t hash, time_t timestamp);
 uint64_t hset_size(struct hlld_set *set, time_t timestamp, uint64_t time_window);
 uint64_t hset_size_total(struct hlld_set *set);
 
+/**
+ * Gets the size of the set over several time windows
+ * in a single pass over the registers.
+ * @note Thread safe.
+ * @arg set The set to check
+ * @arg timestamp the current time
+ * @arg time_windows the amounts of time we're counting
+ * @arg num_windows the number of windows
+ * @arg estimates Output, the estimated size for each window
+ * @return 0 on success
+ */
+int hset_size_multi(struct hlld_set *set, time_t timestamp, const uint64_t *time_windows, int num_windows, uint64_t *estimates);
+
 /**
  * Gets the size of the union of a few sets
  * @arg sets num_sets number of sets that we take the union of
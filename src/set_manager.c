@@ -3,11 +3,13 @@
 #include <stdio.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include <dirent.h>
 #include <string.h>
 #include "spinlock.h"
 #include "set_manager.h"
 #include "art.h"
+#include "hash.h"
 #include "set.h"
 #include "sparse.h"
 #include "type_compat.h"
@@ -18,6 +20,12 @@
  */
 #define VACUUM_POLL_USEC 500000
 
+/**
+ * This defines how long the converter waits for work
+ * before checkpointing again, in microseconds
+ */
+#define CONVERT_POLL_USEC 250000
+
 /**
  * Wraps a struct hlld_set to ensure only a single
  * writer access it at a time. Tracks the outstanding
@@ -33,6 +41,15 @@ struct hlld_set_wrapper {
     struct hlld_config *custom;   // Custom config to cleanup
 };
 
+/**
+ * A sparse set waiting to be converted to dense
+ */
+typedef struct convert_request {
+    char *full_key;
+    int full_key_len;
+    struct convert_request *next;
+} convert_request;
+
 /**
  * We use a linked list of setmgr_client
  * structs to track any clients of the set manager.
@@ -83,9 +100,23 @@ struct hlld_setmgr {
     struct hlld_config *config;
     struct slidingd_sparsedb *sparsedb;
 
-    int should_run;  // Used to stop the vacuum thread
+    int should_run;  // Used to stop the vacuum and converter threads
     pthread_t vacuum_thread;
 
+    /*
+     * Sparse sets that outgrew SPARSE_MAX_VALUES are queued
+     * here, and converted to dense by the converter thread
+     * so clients do not wait for it. Until then they keep
+     * taking adds as sparse sets. The queued sets are also
+     * mapped by name, so a set is only queued once.
+     */
+    pthread_t converter_thread;
+    pthread_mutex_t convert_lock;
+    pthread_cond_t convert_cond;
+    convert_request *convert_head;
+    convert_request *convert_tail;
+    art_tree convert_queued;
+
     /*
      * To support vacuuming of old versions, we require that
      * workers 'periodically' checkpoint. This just updates an
@@ -138,16 +169,17 @@ static int set_map_delete_cb(void *data, const unsigned char *key, uint32_t key_
 static int load_existing_sets(struct hlld_setmgr *mgr);
 static unsigned long long create_delta_update(struct hlld_setmgr *mgr, delta_type type, struct hlld_set_wrapper *set);
 static void* setmgr_thread_main(void *in);
+static void* setmgr_converter_main(void *in);
+static void queue_conversion(struct hlld_setmgr *mgr, char *full_key, int full_key_len);
+static int convert_set(struct hlld_setmgr *mgr, char *full_key, int full_key_len);
 struct hlld_set_wrapper *setmgr_fetch_dense_set(struct hlld_setmgr *mgr, char *full_key, int full_key_len);
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
-
 /**
  * Initializer
  * @arg config The configuration
- * @arg vacuum Should vacuuming be enabled. True unless in a
- * test or embedded environment using setmgr_vacuum()
+ * @arg vacuum Should vacuuming and background conversion be
+ * enabled. True unless in a test or embedded environment
+ * using setmgr_vacuum() and setmgr_convert_sets()
  * @arg mgr Output, resulting manager.
  * @return 0 on success.
  */
@@ -167,6 +199,8 @@ int init_set_manager(struct hlld_config *config, int vacuum, struct hlld_setmgr
 
     // Initialize the locks
     pthread_mutex_init(&m->write_lock, NULL);
+    pthread_mutex_init(&m->convert_lock, NULL);
+    pthread_cond_init(&m->convert_cond, NULL);
     INIT_HLLD_SPIN(&m->clients_lock);
     INIT_HLLD_SPIN(&m->pending_lock);
 
@@ -182,6 +216,7 @@ int init_set_manager(struct hlld_config *config, int vacuum, struct hlld_setmgr
         free(m);
         return -1;
     }
+    init_art_tree(&m->convert_queued);
 
     // Discover existing sets
     load_existing_sets(m);
@@ -202,6 +237,13 @@ int init_set_manager(struct hlld_config *config, int vacuum, struct hlld_setmgr
         return 1;
     }
 
+    // Start the converter thread
+    if (vacuum && pthread_create(&m->converter_thread, NULL, setmgr_converter_main, m)) {
+        perror("Failed to start converter thread!");
+        destroy_set_manager(m);
+        return 1;
+    }
+
     // Done
     return 0;
 }
@@ -212,9 +254,26 @@ int init_set_manager(struct hlld_config *config, int vacuum, struct hlld_setmgr
  * @return 0 on success.
  */
 int destroy_set_manager(struct hlld_setmgr *mgr) {
-    // Stop the vacuum thread
+    // Stop the vacuum and converter threads
     mgr->should_run = 0;
     if (mgr->vacuum_thread) pthread_join(mgr->vacuum_thread, NULL);
+    pthread_mutex_lock(&mgr->convert_lock);
+    pthread_cond_broadcast(&mgr->convert_cond);
+    pthread_mutex_unlock(&mgr->convert_lock);
+    if (mgr->converter_thread) pthread_join(mgr->converter_thread, NULL);
+
+    // Drop pending conversions, the sets are still valid
+    // sparse sets and are queued again on their next add
+    convert_request *req_next, *req = mgr->convert_head;
+    while (req) {
+        req_next = req->next;
+        free(req->full_key);
+        free(req);
+        req = req_next;
+    }
+    destroy_art_tree(&mgr->convert_queued);
+    pthread_mutex_destroy(&mgr->convert_lock);
+    pthread_cond_destroy(&mgr->convert_cond);
 
     // Nuke all the keys in the current version.
     art_iter(mgr->set_map, set_map_delete_cb, mgr);
@@ -256,6 +315,9 @@ char *setmgr_get_stats(struct hlld_setmgr *mgr) {
     char *sparse_stats = sparse_get_stats(mgr->sparsedb);
     if (!sparse_stats) return NULL;
 
+    sparse_cache_stats cache;
+    sparse_get_cache_stats(mgr->sparsedb, &cache);
+
     int res;
     char *output;
     res = asprintf(&output, "\
@@ -265,11 +327,28 @@ char *setmgr_get_stats(struct hlld_setmgr *mgr) {
 \n\
 count:%lu\n\
 \n\
-=========================\n\
-== RocksDB Sparse Sets ==\n\
-=========================\n\
+======================\n\
+== Sparse Set Cache ==\n\
+======================\n\
+\n\
+hits:%llu\n\
+misses:%llu\n\
+evictions:%llu\n\
+entries:%llu\n\
+dirty:%llu\n\
+memory:%llu\n\
+\n\
+=============\n\
+== RocksDB ==\n\
+=============\n\
 %s\n",
         art_size(mgr->set_map),
+        (unsigned long long)cache.hits,
+        (unsigned long long)cache.misses,
+        (unsigned long long)cache.evictions,
+        (unsigned long long)cache.entries,
+        (unsigned long long)cache.dirty,
+        (unsigned long long)cache.memory,
         sparse_stats
     );
     free(sparse_stats);
@@ -376,48 +455,84 @@ int setmgr_flush_dense_set(struct hlld_setmgr *mgr, char *full_key) {
     return res;
 }
 
+/**
+ * Writes the sparse sets that have changed since the
+ * last flush back to rocksdb
+ * @return 0 on success, -1 on error.
+ */
+int setmgr_flush_sparse_sets(struct hlld_setmgr *mgr) {
+    return sparse_flush(mgr->sparsedb);
+}
+
+/**
+ * Groups the sparse writes made by this thread until
+ * setmgr_commit_batch, so they are written back together.
+ */
+void setmgr_begin_batch(struct hlld_setmgr *mgr) {
+    (void)mgr;
+    sparse_begin_batch();
+}
+
+/**
+ * Writes back the sparse writes grouped since setmgr_begin_batch
+ * @arg failed Called with the name of each set that failed
+ * to be written back. May be NULL.
+ * @arg data Passed to the callback
+ * @return 0 on success, -1 if a write back failed.
+ */
+int setmgr_commit_batch(struct hlld_setmgr *mgr, commit_failed_cb failed, void *data) {
+    return sparse_commit_batch(mgr->sparsedb, failed, data);
+}
+
 /**
  * Sets keys in a given set
  * @arg full_key The name of the set
  * @arg keys A list of points to character arrays to add
+ * @arg key_lens The length of each key, or NULL if the
+ * keys are null terminated
  * @arg num_keys The number of keys to add
  * * @return 0 on success, -1 on internal error.
  */
-int setmgr_set_keys(struct hlld_setmgr *mgr, char *full_key, int full_key_len, char **values, int num_values, time_t timestamp) {
+int setmgr_set_keys(struct hlld_setmgr *mgr, char *full_key, int full_key_len, char **values, int *value_lens, int num_values, time_t timestamp) {
 
     if (num_values > MULTI_OP_SIZE) {
         syslog(LOG_ERR, "Received too many values on setmgr_set_keys");
         return -1;
     }
 
-    int res;
     uint64_t hashes[MULTI_OP_SIZE];
-
-    uint64_t out[2];
     for (int i = 0; i < num_values; i++) {
-      MurmurHash3_x64_128(values[i], strlen(values[i]), 0, &out);
-      hashes[i] = out[1];
+      size_t len = value_lens ? (size_t)value_lens[i] : strlen(values[i]);
+      hashes[i] = hash_value(values[i], len);
     }
 
-    res = sparse_add(
+    return setmgr_set_hashes(mgr, full_key, full_key_len, hashes, num_values, timestamp);
+}
+
+/**
+ * Adds hashes that were computed by the client to a given set
+ * @arg full_key The name of the set
+ * @arg hashes The hashes to add
+ * @arg num_hashes The number of hashes to add
+ * @return 0 on success, -1 on internal error.
+ */
+int setmgr_set_hashes(struct hlld_setmgr *mgr, char *full_key, int full_key_len, uint64_t *hashes, int num_hashes, time_t timestamp) {
+    if (num_hashes > MULTI_OP_SIZE) {
+        syslog(LOG_ERR, "Received too many values on setmgr_set_hashes");
+        return -1;
+    }
+
+    int res = sparse_add(
         mgr->sparsedb, full_key, full_key_len,
-        hashes, num_values, timestamp
+        hashes, num_hashes, timestamp
     );
 
     struct hlld_set_wrapper *set;
     if (res >= 0) {
         if (res > SPARSE_MAX_VALUES) {
-          // We went over the maximum number of sparse keys, convert the set to dense
-          set = setmgr_fetch_dense_set(mgr, full_key, full_key_len);
-          if (!set) return -1;
-
-          pthread_rwlock_rdlock(&set->rwlock);
-          sparse_convert_dense(
-              mgr->sparsedb, full_key, full_key_len,
-              set->set
-          );
-          set->is_hot = 1;
-          pthread_rwlock_unlock(&set->rwlock);
+          // We went over the maximum number of sparse keys, have the
+          // set converted to dense. It stays sparse until then.
+          queue_conversion(mgr, full_key, full_key_len);
       }
       return 0;
     } else if (res != HLL_IS_DENSE) {
@@ -439,10 +554,7 @@ int setmgr_set_keys(struct hlld_setmgr *mgr, char *full_key, int full_key_len, c
     pthread_rwlock_rdlock(&set->rwlock);
 
     // Set the keys, store the results
-    for (int i = 0; i < num_values; i++) {
-        res = hset_add_hash(set->set, hashes[i], timestamp);
-        if (res) break;
-    }
+    res = hset_add_hashes(set->set, hashes, num_hashes, timestamp);
 
     // Mark as hot
     set->is_hot = 1;
@@ -545,7 +657,7 @@ int setmgr_set_union_size(struct hlld_setmgr *mgr, int num_sets, char **full_key
  * @arg est Output pointer, the estimate on success.
  * @arg timestamp
  * @arg time_window Time window we query over
- * @return 0 on success
+ * @return 0 on success, -1 on internal error.
  */
 int setmgr_set_size(struct hlld_setmgr *mgr, char *full_key, int full_key_len, uint64_t *est, time_t timestamp, uint64_t time_window) {
     // If it's in the sparsedb return the value from that
@@ -573,6 +685,77 @@ int setmgr_set_size(struct hlld_setmgr *mgr, char *full_key, int full_key_len, u
 
     // Release the lock
     pthread_rwlock_unlock(&set->rwlock);
+    return (*est == (uint64_t)-1) ? -1 : 0;
+}
+
+/**
+ * Estimates the size of a set over several time windows
+ * @arg full_key The name of the set
+ * @arg timestamp The end of the windows
+ * @arg time_windows The window lengths
+ * @arg num_windows The number of windows
+ * @arg est Output array, the estimate for each window on success.
+ * @return 0 on success, -1 on internal error.
+ */
+int setmgr_set_size_multi(struct hlld_setmgr *mgr, char *full_key, int full_key_len, time_t timestamp, const uint64_t *time_windows, int num_windows, uint64_t *est) {
+    // If it's in the sparsedb return the values from that
+    int res = sparse_size_multi(mgr->sparsedb, full_key, full_key_len, timestamp, time_windows, num_windows, est);
+    if (res == 0) {
+      return 0;
+    } else if (res != HLL_IS_DENSE) {
+      return -1;
+    }
+
+    // Get the set
+    struct hlld_set_wrapper *set = take_set(mgr, full_key);
+    if (!set) {
+      for (int i = 0; i < num_windows; i++) est[i] = 0;
+      return 0;
+    }
+
+    // Acquire the READ lock. We use the read lock
+    // since we can handle concurrent read/writes.
+    pthread_rwlock_rdlock(&set->rwlock);
+
+    // Get the sizes
+    res = hset_size_multi(set->set, timestamp, time_windows, num_windows, est);
+
+    // Release the lock
+    pthread_rwlock_unlock(&set->rwlock);
+    return res;
+}
+
+int setmgr_set_size_keys(struct hlld_setmgr *mgr, char **full_keys, int *full_key_lens, int num_keys, time_t timestamp, uint64_t time_window, uint64_t *est) {
+    int64_t *counts = (int64_t*)malloc(num_keys * sizeof(int64_t));
+    if (!counts) return -1;
+
+    // Resolve all the sparse sets at once
+    int res = sparse_size_keys(mgr->sparsedb, full_keys, full_key_lens, num_keys, timestamp, time_window, counts);
+    if (res) {
+      free(counts);
+      return -1;
+    }
+
+    for (int i = 0; i < num_keys; i++) {
+      if (counts[i] != HLL_IS_DENSE) {
+        est[i] = counts[i];
+        continue;
+      }
+
+      struct hlld_set_wrapper *set = take_set(mgr, full_keys[i]);
+      if (!set) {
+        est[i] = 0;
+        continue;
+      }
+      pthread_rwlock_rdlock(&set->rwlock);
+      est[i] = hset_size(set->set, timestamp, time_window);
+      pthread_rwlock_unlock(&set->rwlock);
+      if (est[i] == (uint64_t)-1) {
+        free(counts);
+        return -1;
+      }
+    }
+    free(counts);
     return 0;
 }
 
@@ -642,12 +825,13 @@ int setmgr_drop_set(struct hlld_setmgr *mgr, char *full_key, int full_key_len) {
     if (is_dense == -1) return -1;
     else if (is_dense < 0) return -2;
     else if (is_dense) {
-      // Lock the deletion
-      pthread_mutex_lock(&mgr->write_lock);
-
-      // Get the set
+      // Get the set, which takes the write lock to fault it in
       struct hlld_set_wrapper *set = take_set(mgr, full_key);
-      if (!set) {
+      if (!set) return -1;
+
+      // Lock the deletion, unless it was dropped meanwhile
+      pthread_mutex_lock(&mgr->write_lock);
+      if (!set->is_active) {
           pthread_mutex_unlock(&mgr->write_lock);
           return -1;
       }
@@ -676,9 +860,9 @@ int setmgr_clear_set(struct hlld_setmgr *mgr, char *full_key, int full_key_len)
     int res = 0;
     pthread_mutex_lock(&mgr->write_lock);
 
-    // Get the set
-    struct hlld_set_wrapper *set = take_set(mgr, full_key);
-    if (!set) {
+    // Get the set, without faulting in one that is not loaded
+    struct hlld_set_wrapper *set = find_set(mgr, full_key, strlen(full_key));
+    if (!set || !set->is_active) {
         res = -1;
         goto LEAVE;
     }
@@ -1307,6 +1491,132 @@ static void* setmgr_thread_main(void *in) {
 }
 
 
+/**
+ * Queues a sparse set to be converted to dense.
+ * Sets that are already queued are ignored.
+ */
+static void queue_conversion(struct hlld_setmgr *mgr, char *full_key, int full_key_len) {
+    pthread_mutex_lock(&mgr->convert_lock);
+    if (art_search(&mgr->convert_queued, (unsigned char*)full_key, full_key_len + 1)) {
+        pthread_mutex_unlock(&mgr->convert_lock);
+        return;
+    }
+
+    convert_request *req = (convert_request*)malloc(sizeof(convert_request));
+    char *key = (char*)malloc(full_key_len + 1);
+    if (!req || !key) {
+        pthread_mutex_unlock(&mgr->convert_lock);
+        free(req);
+        free(key);
+        syslog(LOG_ERR, "Failed to queue set for conversion: %.*s", full_key_len, full_key);
+        return;
+    }
+    memcpy(key, full_key, full_key_len);
+    key[full_key_len] = '\0';
+    req->full_key = key;
+    req->full_key_len = full_key_len;
+    req->next = NULL;
+    art_insert(&mgr->convert_queued, (unsigned char*)key, full_key_len + 1, req);
+
+    if (mgr->convert_tail) mgr->convert_tail->next = req;
+    else mgr->convert_head = req;
+    mgr->convert_tail = req;
+
+    pthread_cond_signal(&mgr->convert_cond);
+    pthread_mutex_unlock(&mgr->convert_lock);
+}
+
+/**
+ * Pops the next queued conversion
+ * @return The request, or NULL if none are queued
+ */
+static convert_request *pop_conversion(struct hlld_setmgr *mgr) {
+    convert_request *req = mgr->convert_head;
+    if (req) {
+        mgr->convert_head = req->next;
+        if (!mgr->convert_head) mgr->convert_tail = NULL;
+        art_delete(&mgr->convert_queued, (unsigned char*)req->full_key, req->full_key_len + 1);
+    }
+    return req;
+}
+
+/**
+ * Converts a sparse set to dense. Adds that race with
+ * the conversion either land in the sparse points before
+ * they are replayed, or see the set as dense.
+ * @return 0 on success, -1 on error
+ */
+static int convert_set(struct hlld_setmgr *mgr, char *full_key, int full_key_len) {
+    struct hlld_set_wrapper *set = setmgr_fetch_dense_set(mgr, full_key, full_key_len);
+    if (!set) return -1;
+
+    pthread_rwlock_rdlock(&set->rwlock);
+    int res = sparse_convert_dense(
+        mgr->sparsedb, full_key, full_key_len,
+        set->set
+    );
+    set->is_hot = 1;
+    pthread_rwlock_unlock(&set->rwlock);
+    return res;
+}
+
+/**
+ * Converts every queued sparse set to dense. This is done
+ * by the converter thread, but can be used in an embedded
+ * or test environment without one.
+ * @return The number of sets converted
+ */
+int setmgr_convert_sets(struct hlld_setmgr *mgr) {
+    int converted = 0;
+    convert_request *req;
+    while (1) {
+        pthread_mutex_lock(&mgr->convert_lock);
+        req = pop_conversion(mgr);
+        pthread_mutex_unlock(&mgr->convert_lock);
+        if (!req) break;
+
+        if (convert_set(mgr, req->full_key, req->full_key_len) == 0) {
+            converted++;
+        } else {
+            syslog(LOG_ERR, "Failed to convert set to dense: %s", req->full_key);
+        }
+        free(req->full_key);
+        free(req);
+    }
+    return converted;
+}
+
+static void* setmgr_converter_main(void *in) {
+    struct hlld_setmgr *mgr = (struct hlld_setmgr*)in;
+    while (mgr->should_run) {
+        // Checkpoint while idle too, so the vacuum is not held back
+        setmgr_client_checkpoint(mgr);
+
+        pthread_mutex_lock(&mgr->convert_lock);
+        if (!mgr->convert_head && mgr->should_run) {
+            struct timeval now;
+            struct timespec deadline;
+            gettimeofday(&now, NULL);
+            uint64_t usec = now.tv_usec + CONVERT_POLL_USEC;
+            deadline.tv_sec = now.tv_sec + usec / 1000000;
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&mgr->convert_cond, &mgr->convert_lock, &deadline);
+        }
+        convert_request *req = pop_conversion(mgr);
+        pthread_mutex_unlock(&mgr->convert_lock);
+        if (!req) continue;
+
+        setmgr_client_checkpoint(mgr);
+        if (convert_set(mgr, req->full_key, req->full_key_len)) {
+            syslog(LOG_ERR, "Failed to convert set to dense: %s", req->full_key);
+        }
+        free(req->full_key);
+        free(req);
+    }
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
 /**
  * This method is used to force a vacuum up to the current
  * version. It is generally unsafe to use in hlld,
@@ -40,8 +40,9 @@ struct hlld_set_list_head {
 /**
  * Initializer
  * @arg config The configuration
- * @arg vacuum Should vacuuming be enabled. True unless in a
- * test or embedded environment using setmgr_vacuum()
+ * @arg vacuum Should vacuuming and background conversion be
+ * enabled. True unless in a test or embedded environment
+ * using setmgr_vacuum() and setmgr_convert_sets()
  * @arg mgr Output, resulting manager.
  * @return 0 on success.
  */
@@ -86,24 +87,87 @@ void setmgr_client_leave(struct hlld_setmgr *mgr);
  */
 int setmgr_flush_dense_set(struct hlld_setmgr *mgr, char *set_name);
 
+/**
+ * Writes cached sparse sets back to disk
+ * @return 0 on success, -1 on error.
+ */
+int setmgr_flush_sparse_sets(struct hlld_setmgr *mgr);
+
+/**
+ * Groups the sparse writes made by this thread until
+ * setmgr_commit_batch, so they are written back together.
+ */
+void setmgr_begin_batch(struct hlld_setmgr *mgr);
+
+/**
+ * Called with the name of a set that a batch
+ * commit failed to write back
+ */
+typedef void(*commit_failed_cb)(void *data, const char *full_key, int full_key_len);
+
+/**
+ * Writes back the sparse writes grouped since setmgr_begin_batch
+ * @arg failed Called with the name of each set that failed
+ * to be written back. May be NULL.
+ * @arg data Passed to the callback
+ * @return 0 on success, -1 if the write back failed.
+ */
+int setmgr_commit_batch(struct hlld_setmgr *mgr, commit_failed_cb failed, void *data);
+
 /**
  * Sets keys in a given set
  * @arg set_name The name of the set
  * @arg keys A list of points to character arrays to add
+ * @arg key_lens The length of each key, or NULL if the
+ * keys are null terminated
  * @arg num_keys The number of keys to add
  * @return 0 on success, -1 if the set does not exist.
  * -2 on internal error.
  */
-int setmgr_set_keys(struct hlld_setmgr *mgr, char *full_key, int full_key_len, char **keys, int num_keys, time_t time);
+int setmgr_set_keys(struct hlld_setmgr *mgr, char *full_key, int full_key_len, char **keys, int *key_lens, int num_keys, time_t time);
+
+/**
+ * Adds hashes that were computed by the client to a given
+ * set, skipping the server side hash.
+ * @arg set_name The name of the set
+ * @arg hashes The hashes to add
+ * @arg num_hashes The number of hashes to add, at most MULTI_OP_SIZE
+ * @return 0 on success, -1 on internal error.
+ */
+int setmgr_set_hashes(struct hlld_setmgr *mgr, char *full_key, int full_key_len, uint64_t *hashes, int num_hashes, time_t time);
 
 /**
  * Estimates the size of a set
  * @arg set_name The name of the set
  * @arg est Output pointer, the estimate on success.
- * @return 0 on success, -1 if the set does not exist.
+ * @return 0 on success, -1 on internal error.
  */
 int setmgr_set_size(struct hlld_setmgr *mgr, char *full_key, int full_key_len, uint64_t *est, time_t timestamp, uint64_t time_window);
 
+/**
+ * Estimates the size of a set over several time windows.
+ * Every register is only visited once for all the windows.
+ * @arg set_name The name of the set
+ * @arg timestamp The end of the windows
+ * @arg time_windows The window lengths
+ * @arg num_windows The number of windows
+ * @arg est Output array, the estimate for each window on success.
+ * @return 0 on success, -1 on internal error.
+ */
+int setmgr_set_size_multi(struct hlld_setmgr *mgr, char *full_key, int full_key_len, time_t timestamp, const uint64_t *time_windows, int num_windows, uint64_t *est);
+
+/**
+ * Estimates the size of several sets over the same time window.
+ * Sparse sets are read from rocksdb together, and dense sets
+ * are estimated from the loaded sets. Missing sets are 0.
+ * @arg full_keys The names of the sets
+ * @arg full_key_lens The length of each name
+ * @arg num_keys The number of sets
+ * @arg est Output array, the estimate for each set on success.
+ * @return 0 on success, -1 on internal error.
+ */
+int setmgr_set_size_keys(struct hlld_setmgr *mgr, char **full_keys, int *full_key_lens, int num_keys, time_t timestamp, uint64_t time_window, uint64_t *est);
+
 /**
  * Estimates the total size of a set
  * @arg set_name The name of the set
@@ -200,4 +264,12 @@ int setmgr_set_cb(struct hlld_setmgr *mgr, char *full_key, set_cb cb, void* data
  */
 void setmgr_vacuum(struct hlld_setmgr *mgr);
 
+/**
+ * Converts the sparse sets queued for conversion to dense.
+ * This is done by a background thread when vacuuming is
+ * enabled, but can be used in an embeded or test environment.
+ * @return The number of sets converted
+ */
+int setmgr_convert_sets(struct hlld_setmgr *mgr);
+
 #endif
@@ -2,81 +2,1741 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <rocksdb/c.h>
 
+#include "art.h"
 #include "hll.h"
 #include "set.h"
 #include "sparse.h"
+#include "serialize.h"
+#include "hash.h"
+#include "varint.h"
 
+/**
+ * The column families. Each holds a different kind of
+ * value, and is tuned for how that value is read.
+ */
+typedef enum {
+    CF_DEFAULT = 0,     // Only holds data written before the other families
+    CF_SPARSE,          // Sparse points, keyed by set
+    CF_DENSE,           // Serialized dense sets, keyed by set
+    CF_META,            // Dense markers keyed by set, and the hash algorithm
+    CF_COUNT
+} sparse_column_family;
+
+static const char *const CF_NAMES[CF_COUNT] = {"default", "sparse", "dense", "meta"};
+
+// Sparse values are at most a few KB, so small blocks keep a
+// point lookup from reading much more than the one value
+#define SPARSE_BLOCK_SIZE 4096
+#define SPARSE_BLOCK_CACHE_SIZE (64 * 1024 * 1024)
+#define SPARSE_BLOOM_BITS 10
+
+// Dense values are whole serialized sets
+#define DENSE_BLOCK_SIZE (64 * 1024)
+
+// Block cache for the metadata, in MB. It is small enough to stay cached.
+#define META_BLOCK_CACHE_MB 8
+
+// Keys moved out of the default family per write
+#define MIGRATE_BATCH_SIZE 1024
+
+// Independently locked parts of the sparse cache
+#define SPARSE_CACHE_SHARDS 16
+
+// Prefix of dense keys in the default family, before the dense family
 static const char DENSE_PREFIX[] = "dense~";
 static const int DENSE_PREFIX_LEN = sizeof(DENSE_PREFIX) - 1;
 
+// Records the hash algorithm the stored values were hashed with.
+// Set names cannot contain whitespace, so no set can collide with it.
+static const char HASH_META_KEY[] = "hash algorithm";
+static const int HASH_META_KEY_LEN = sizeof(HASH_META_KEY) - 1;
+
+// Where older versions kept the hash algorithm. It is also a valid
+// set name, so it is only taken as the algorithm if it parses as one.
+static const char LEGACY_HASH_META_KEY[] = "meta~hash";
+static const int LEGACY_HASH_META_KEY_LEN = sizeof(LEGACY_HASH_META_KEY) - 1;
+
+// Stored in the meta family once a set is dense
+static const char DENSE_MARKER[] = "-";
+
+/**
+ * Sparse values are encoded as a header of:
+ *   version byte, state byte, varint point count,
+ *   zigzag varint base timestamp, varint time quantum
+ * followed by each point, sorted by hash, as:
+ *   varint hash delta from the previous point,
+ *   varint (timestamp - base) / quantum
+ * A pad byte is appended when needed so an encoded value is
+ * never a multiple of sizeof(hll_sparse_point) long, which
+ * tells it apart from a raw array of points written before.
+ */
+#define SPARSE_ENCODING_VERSION 1
+
+/**
+ * What rocksdb holds for a cached set
+ */
+typedef enum {
+    SPARSE_MISSING = 0,
+    SPARSE_POINTS,
+    SPARSE_DENSE
+} sparse_state;
+
+/**
+ * A decoded set, kept in memory between requests.
+ * Dirty entries have points that have not been
+ * written back to rocksdb yet. Only the points added
+ * since the last write back are merged into rocksdb,
+ * unless there are more of those than points in the
+ * set, in which case all the points are merged.
+ * Entries being loaded or written back are pinned, and
+ * stay cached until their read or writes have landed.
+ */
+typedef struct sparse_cache_entry {
+    char *key;
+    int key_len;
+    sparse_state state;
+    int dirty;
+    hll_sparse_point *points;   // Sorted by hash
+    size_t size;
+    size_t capacity;
+    time_t min_timestamp;       // Bounds of the point timestamps. The minimum
+    time_t max_timestamp;       // is a lower bound, since points only move forward
+    hll_sparse_point *pending;  // Points added since the last write back
+    size_t pending_size;
+    size_t pending_capacity;
+    int merge_all;              // Merge all the points instead of pending
+    uint64_t generation;        // Bumped by every change to the set
+    int loading;                // Being read from rocksdb, not usable yet
+    int writing;                // Write backs of the set in flight
+    int evicting;               // Picked by an eviction that is writing it back
+    struct sparse_cache_entry *prev;  // Towards the most recently used
+    struct sparse_cache_entry *next;  // Towards the least recently used
+} sparse_cache_entry;
+
+/**
+ * A write back made outside the shard lock. The entry
+ * is pinned until the write lands, and is only marked
+ * clean if it has not changed since it was batched.
+ */
+typedef struct {
+    sparse_cache_entry *entry;
+    uint64_t generation;
+} cache_written;
+
+/**
+ * One part of the write-back cache. Sets are spread over
+ * the shards by a hash of their name, and rocksdb is only
+ * read and written with the shard lock released, so requests
+ * for other sets are not held up by the disk. Everything in
+ * a shard is protected by its lock.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Broadcast when a set is loaded or a write lands
+    art_tree map;
+    sparse_cache_entry *lru_head;
+    sparse_cache_entry *lru_tail;
+    sparse_cache_stats stats;
+    uint64_t generation;        // Last generation given to a set
+    uint64_t write_next;        // Ticket of the next batch built
+    uint64_t write_turn;        // Ticket of the batch allowed to write
+} sparse_cache_shard;
 
 struct slidingd_sparsedb {
     struct hlld_config *config;
     rocksdb_options_t *options;
+    rocksdb_options_t *cf_options[CF_COUNT];
+    rocksdb_readoptions_t *readoptions;     // Shared by every read
+    rocksdb_writeoptions_t *writeoptions;   // Shared by every write, set by durability
     rocksdb_t *db;
+    rocksdb_column_family_handle_t *cf[CF_COUNT];
+
+    // Write-back cache
+    sparse_cache_shard shards[SPARSE_CACHE_SHARDS];
+    pthread_mutex_t flush_lock;     // Held by a flush, which writes every shard
 };
 
-struct slidingd_sparsedb *global_sparse = NULL;
+struct slidingd_sparsedb *global_sparse = NULL;
+
+// Depth of the write batches open on this thread. While one is
+// open, evicting sets is left to sparse_commit_batch.
+static __thread int batch_depth = 0;
+
+// Set once the open batch has deferred an eviction, which
+// leaves sparse_commit_batch something to write back.
+static __thread int batch_deferred = 0;
+
+static sparse_cache_shard *cache_shard(struct slidingd_sparsedb *sparsedb, const char *key, int key_len);
+static sparse_cache_entry *cache_fetch(
+        struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard, const char *key, int key_len);
+static int cache_write_back(
+        struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard, sparse_cache_entry *entry);
+static int cache_batch_write_back(
+        struct slidingd_sparsedb *sparsedb, rocksdb_writebatch_t *batch, sparse_cache_entry *entry);
+static void cache_mark_clean(sparse_cache_shard *shard, sparse_cache_entry *entry);
+static void cache_remove(sparse_cache_shard *shard, sparse_cache_entry *entry);
+static void cache_pick_victims(
+    struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard, rocksdb_writebatch_t *batch,
+    cache_written **victims, size_t *num_victims, size_t *capacity, sparse_cache_entry **unencoded);
+static void cache_drop_victims(
+    sparse_cache_shard *shard, cache_written *victims, size_t num_victims, int success);
+static int cache_evict(struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard);
+
+static int sparse_point_cmp(const void *a, const void *b) {
+    uint64_t x = ((const hll_sparse_point*)a)->hash;
+    uint64_t y = ((const hll_sparse_point*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+static int sparse_point_time_cmp(const void *a, const void *b) {
+    time_t x = ((const hll_sparse_point*)a)->timestamp;
+    time_t y = ((const hll_sparse_point*)b)->timestamp;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sorts points by hash, and collapses points with the
+ * same hash into one with the latest timestamp. Values
+ * are stored this way, but ones written before that
+ * may need sorting.
+ * @return The number of points left
+ */
+static size_t sparse_sort_points(hll_sparse_point *points, size_t size) {
+    size_t i;
+    for (i = 1; i < size && points[i - 1].hash < points[i].hash; i++);
+    if (i >= size) return size;
+
+    qsort(points, size, sizeof(hll_sparse_point), sparse_point_cmp);
+    size_t out = 0;
+    for (i = 1; i < size; i++) {
+        if (points[i].hash != points[out].hash) {
+            points[++out] = points[i];
+        } else if (points[i].timestamp > points[out].timestamp) {
+            points[out].timestamp = points[i].timestamp;
+        }
+    }
+    return out + 1;
+}
+
+/**
+ * Merges two sorted arrays of points, keeping the latest
+ * timestamp for hashes in both.
+ * @arg out Output, room for a_size + b_size points
+ * @return The number of points in out
+ */
+static size_t sparse_merge_sorted(
+    const hll_sparse_point *a, size_t a_size,
+    const hll_sparse_point *b, size_t b_size,
+    hll_sparse_point *out
+) {
+    size_t i = 0, j = 0, size = 0;
+    while (i < a_size && j < b_size) {
+        if (a[i].hash < b[j].hash) {
+            out[size++] = a[i++];
+        } else if (b[j].hash < a[i].hash) {
+            out[size++] = b[j++];
+        } else {
+            out[size] = a[i++];
+            if (b[j].timestamp > out[size].timestamp) {
+                out[size].timestamp = b[j].timestamp;
+            }
+            j++;
+            size++;
+        }
+    }
+    while (i < a_size) out[size++] = a[i++];
+    while (j < b_size) out[size++] = b[j++];
+    return size;
+}
+
+static uint64_t gcd_u64(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+/**
+ * Encodes points for storage. Timestamps are stored in units
+ * of their common divisor, so quantized points take less room.
+ * @arg points The points, sorted by hash without duplicates
+ * @arg len Output, the length of the value
+ * @return A malloc'd value, or NULL
+ */
+static char *sparse_encode_points(const hll_sparse_point *points, size_t size, size_t *len) {
+    time_t base = size ? points[0].timestamp : 0;
+    for (size_t i = 1; i < size; i++) {
+        if (points[i].timestamp < base) base = points[i].timestamp;
+    }
+    uint64_t quantum = 0;
+    for (size_t i = 0; i < size && quantum != 1; i++) {
+        quantum = gcd_u64(quantum, (uint64_t)(points[i].timestamp - base));
+    }
+    if (!quantum) quantum = 1;
+
+    unsigned char *value = (unsigned char*)malloc(2 + 3 * VARINT_MAX_LEN + size * 2 * VARINT_MAX_LEN + 1);
+    if (!value) return NULL;
+
+    size_t out = 0;
+    value[out++] = SPARSE_ENCODING_VERSION;
+    value[out++] = SPARSE_POINTS;
+    out += varint_put(value + out, size);
+    out += varint_put(value + out, zigzag_encode(base));
+    out += varint_put(value + out, quantum);
+
+    uint64_t prev = 0;
+    for (size_t i = 0; i < size; i++) {
+        out += varint_put(value + out, points[i].hash - prev);
+        out += varint_put(value + out, (uint64_t)(points[i].timestamp - base) / quantum);
+        prev = points[i].hash;
+    }
+    if (out % sizeof(hll_sparse_point) == 0) value[out++] = 0;
+
+    *len = out;
+    return (char*)value;
+}
+
+/**
+ * Decodes a stored value, either encoded or a raw
+ * array of points written before the encoding.
+ * @arg points Output, malloc'd points sorted by hash, or NULL if there are none
+ * @arg size Output, the number of points
+ * @return 0 on success, -1 if the value is corrupt or on a failed allocation
+ */
+static int sparse_decode_points(const char *value, size_t len, hll_sparse_point **points, size_t *size) {
+    *points = NULL;
+    *size = 0;
+    if (!len) return 0;
+
+    // Raw points are copied out, since rocksdb values are not aligned
+    if (len % sizeof(hll_sparse_point) == 0) {
+        *points = (hll_sparse_point*)malloc(len);
+        if (!*points) return -1;
+        memcpy(*points, value, len);
+        *size = sparse_sort_points(*points, len / sizeof(hll_sparse_point));
+        return 0;
+    }
+
+    const unsigned char *in = (const unsigned char*)value;
+    const unsigned char *end = in + len;
+    if (len < 2 || in[0] != SPARSE_ENCODING_VERSION) {
+        syslog(LOG_ERR, "Unknown sparse encoding version: %d", len ? in[0] : -1);
+        return -1;
+    }
+    in += 2;
+
+    uint64_t count, zigzag, quantum;
+    if (varint_get(&in, end, &count) || varint_get(&in, end, &zigzag) ||
+        varint_get(&in, end, &quantum) || count > (uint64_t)(end - in) / 2) {
+        syslog(LOG_ERR, "Corrupt sparse value header");
+        return -1;
+    }
+    time_t base = (time_t)zigzag_decode(zigzag);
+    if (!count) return 0;
+
+    *points = (hll_sparse_point*)malloc(count * sizeof(hll_sparse_point));
+    if (!*points) return -1;
+    uint64_t hash = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t delta, offset;
+        if (varint_get(&in, end, &delta) || varint_get(&in, end, &offset) || (i && !delta)) {
+            syslog(LOG_ERR, "Corrupt sparse value points");
+            free(*points);
+            *points = NULL;
+            return -1;
+        }
+        hash += delta;
+        (*points)[i].hash = hash;
+        (*points)[i].timestamp = base + (time_t)(offset * quantum);
+    }
+    *size = count;
+    return 0;
+}
+
+/**
+ * Merges stored values into one. Each is decoded and
+ * merged into the points so far in a single pass.
+ * @return A malloc'd encoded value, or NULL
+ */
+static char *sparse_merge_points(
+    const char *existing, size_t existing_len,
+    const char *const *operands, const size_t *operand_lens, int num_operands,
+    size_t *new_len
+) {
+    hll_sparse_point *points;
+    size_t size;
+    if (sparse_decode_points(existing, existing_len, &points, &size)) return NULL;
+
+    for (int i = 0; i < num_operands; i++) {
+        hll_sparse_point *operand;
+        size_t operand_size;
+        if (sparse_decode_points(operands[i], operand_lens[i], &operand, &operand_size)) {
+            free(points);
+            return NULL;
+        }
+        if (!operand_size) continue;
+
+        hll_sparse_point *merged = (hll_sparse_point*)malloc(
+            (size + operand_size) * sizeof(hll_sparse_point)
+        );
+        if (!merged) {
+            free(points);
+            free(operand);
+            return NULL;
+        }
+        size = sparse_merge_sorted(points, size, operand, operand_size, merged);
+        free(points);
+        free(operand);
+        points = merged;
+    }
+
+    char *value = sparse_encode_points(points, size, new_len);
+    free(points);
+    return value;
+}
+
+/**
+ * Applies merge operands, which are arrays of points,
+ * to a stored set. Adds to a set that has become dense
+ * are dropped, since the dense set has them already.
+ * Only the default family can hold a dense marker under
+ * points, the others delete the points of a dense set.
+ */
+static char *sparse_full_merge(
+    void *state, const char *key, size_t key_len,
+    const char *existing, size_t existing_len,
+    const char *const *operands, const size_t *operand_lens, int num_operands,
+    unsigned char *success, size_t *new_len
+) {
+    (void)state;
+    (void)key;
+    (void)key_len;
+
+    char *value;
+    if (existing_len == 1) {
+        value = (char*)malloc(1);
+        if (value) {
+            *value = DENSE_MARKER[0];
+            *new_len = 1;
+        }
+    } else {
+        value = sparse_merge_points(
+            existing, existing_len,
+            operands, operand_lens, num_operands,
+            new_len
+        );
+    }
+    *success = value != NULL;
+    return value;
+}
+
+/**
+ * Combines merge operands into a single operand
+ */
+static char *sparse_partial_merge(
+    void *state, const char *key, size_t key_len,
+    const char *const *operands, const size_t *operand_lens, int num_operands,
+    unsigned char *success, size_t *new_len
+) {
+    (void)state;
+    (void)key;
+    (void)key_len;
+
+    char *value = sparse_merge_points(NULL, 0, operands, operand_lens, num_operands, new_len);
+    *success = value != NULL;
+    return value;
+}
+
+static void sparse_merge_delete(void *state, const char *value, size_t value_len) {
+    (void)state;
+    (void)value_len;
+    free((char*)value);
+}
+
+static void sparse_merge_destroy(void *state) {
+    (void)state;
+}
+
+static const char *sparse_merge_name(void *state) {
+    (void)state;
+    // Persisted by rocksdb, must not change
+    return "slidingd.sparse_points";
+}
+
+/**
+ * Creates the merge operator for sparse points. Each
+ * options object takes ownership of its own operator.
+ */
+static rocksdb_mergeoperator_t *sparse_merge_operator_create(void) {
+    return rocksdb_mergeoperator_create(
+        NULL, sparse_merge_destroy,
+        sparse_full_merge, sparse_partial_merge,
+        sparse_merge_delete, sparse_merge_name
+    );
+}
+
+/**
+ * Expires data during compaction. A filter is created for
+ * each compaction, and only used by the thread running it.
+ */
+typedef struct {
+    sparse_column_family cf;
+    time_t now;             // When the compaction started
+    int period;             // Sliding period of every sparse set
+    char *value;            // The last rewritten value, rocksdb copies it
+} expire_filter;
+
+static void expire_filter_keep(expire_filter *filter, char *value, size_t len,
+        char **new_value, size_t *new_value_len, unsigned char *value_changed) {
+    free(filter->value);
+    filter->value = value;
+    *new_value = value;
+    *new_value_len = len;
+    *value_changed = 1;
+}
+
+/**
+ * Drops sparse points older than the sliding period,
+ * and the whole set once none are left. Sparse sets do
+ * not store settings of their own, so every one of them
+ * expires by the configured sliding_period, even if it
+ * was created with another one. Dense sets expire by the
+ * period they were created with.
+ * @return 1 to remove the key
+ */
+static unsigned char sparse_expire_filter(
+    void *state, int level, const char *key, size_t key_len,
+    const char *existing_value, size_t value_len,
+    char **new_value, size_t *new_value_len, unsigned char *value_changed
+) {
+    (void)level;
+    expire_filter *filter = (expire_filter*)state;
+
+    hll_sparse_point *points;
+    size_t size;
+    if (sparse_decode_points(existing_value, value_len, &points, &size)) {
+        syslog(LOG_WARNING, "Not expiring undecodable sparse set: %.*s", (int)key_len, key);
+        return 0;
+    }
+
+    time_t cutoff = filter->now - filter->period;
+    size_t live = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (points[i].timestamp >= cutoff) points[live++] = points[i];
+    }
+    if (!live) {
+        free(points);
+        return 1;
+    }
+    if (live < size) {
+        size_t len;
+        char *value = sparse_encode_points(points, live, &len);
+        if (value) expire_filter_keep(filter, value, len, new_value, new_value_len, value_changed);
+    }
+    free(points);
+    return 0;
+}
+
+/**
+ * Drops the points of a serialized dense set that are
+ * older than its window period. The set itself is kept,
+ * unless it was deleted and only an empty value is left.
+ * @return 1 to remove the key
+ */
+static unsigned char dense_expire_filter(
+    void *state, int level, const char *key, size_t key_len,
+    const char *existing_value, size_t value_len,
+    char **new_value, size_t *new_value_len, unsigned char *value_changed
+) {
+    (void)level;
+    expire_filter *filter = (expire_filter*)state;
+    if (!value_len) return 1;
+
+    hll_t h;
+    serialize_t in = {(unsigned char*)existing_value, 0, value_len};
+    if (unserialize_hll(&in, &h)) {
+        syslog(LOG_WARNING, "Not expiring undecodable dense set: %.*s", (int)key_len, key);
+        return 0;
+    }
+
+    if (hll_expire(&h, filter->now)) {
+        size_t size = serialized_hll_size(&h);
+        unsigned char *value = (unsigned char*)malloc(size);
+        serialize_t out = {value, 0, size};
+        if (value && !serialize_hll(&out, &h)) {
+            expire_filter_keep(filter, (char*)value, out.offset, new_value, new_value_len, value_changed);
+        } else {
+            free(value);
+        }
+    }
+    hll_destroy(&h);
+    return 0;
+}
+
+static void expire_filter_destroy(void *state) {
+    expire_filter *filter = (expire_filter*)state;
+    free(filter->value);
+    free(filter);
+}
+
+static const char *expire_filter_name(void *state) {
+    return ((expire_filter*)state)->cf == CF_SPARSE ? "slidingd.expire_sparse" : "slidingd.expire_dense";
+}
+
+/**
+ * Creates the expiry filters of a column family
+ */
+typedef struct {
+    sparse_column_family cf;
+    struct hlld_config *config;
+} expire_factory;
+
+static rocksdb_compactionfilter_t *expire_factory_create_filter(
+    void *state, rocksdb_compactionfiltercontext_t *context
+) {
+    (void)context;
+    expire_factory *factory = (expire_factory*)state;
+    expire_filter *filter = (expire_filter*)calloc(1, sizeof(expire_filter));
+    if (!filter) return NULL;
+    filter->cf = factory->cf;
+    filter->now = time(NULL);
+    filter->period = factory->config->sliding_period;
+    return rocksdb_compactionfilter_create(
+        filter, expire_filter_destroy,
+        factory->cf == CF_SPARSE ? sparse_expire_filter : dense_expire_filter,
+        expire_filter_name
+    );
+}
+
+static void expire_factory_destroy(void *state) {
+    free(state);
+}
+
+static const char *expire_factory_name(void *state) {
+    return ((expire_factory*)state)->cf == CF_SPARSE ? "slidingd.expire_sparse" : "slidingd.expire_dense";
+}
+
+static rocksdb_compactionfilterfactory_t *expire_factory_create(
+    struct hlld_config *config, sparse_column_family cf
+) {
+    expire_factory *factory = (expire_factory*)malloc(sizeof(expire_factory));
+    if (!factory) {
+        syslog(LOG_ERR, "Failed to allocate the expiry filter, data will not expire");
+        return NULL;
+    }
+    factory->cf = cf;
+    factory->config = config;
+    return rocksdb_compactionfilterfactory_create(
+        factory, expire_factory_destroy,
+        expire_factory_create_filter, expire_factory_name
+    );
+}
+
+struct slidingd_sparsedb *sparse_get_global(void) {
+  return global_sparse;
+}
+
+/**
+ * Creates the options for a column family
+ */
+static rocksdb_options_t *create_cf_options(struct hlld_config *config, sparse_column_family cf) {
+  rocksdb_options_t *options = rocksdb_options_create();
+  rocksdb_block_based_table_options_t *table;
+  rocksdb_cache_t *cache;
+  rocksdb_compactionfilterfactory_t *expire;
+
+  switch (cf) {
+      case CF_SPARSE:
+          // Point lookups of small values, which are
+          // mostly for sets that do not exist yet
+          rocksdb_options_optimize_level_style_compaction(options, config->memtable_memory);
+          table = rocksdb_block_based_options_create();
+          cache = rocksdb_cache_create_lru(SPARSE_BLOCK_CACHE_SIZE);
+          rocksdb_block_based_options_set_block_size(table, SPARSE_BLOCK_SIZE);
+          rocksdb_block_based_options_set_block_cache(table, cache);
+          rocksdb_block_based_options_set_filter_policy(
+              table, rocksdb_filterpolicy_create_bloom(SPARSE_BLOOM_BITS));
+          rocksdb_block_based_options_set_cache_index_and_filter_blocks(table, 1);
+          rocksdb_options_set_block_based_table_factory(options, table);
+          rocksdb_block_based_options_destroy(table);
+          rocksdb_cache_destroy(cache);
+
+          // Adds are written as merges of the new points
+          rocksdb_options_set_merge_operator(options, sparse_merge_operator_create());
+
+          // Points past the sliding period are dropped as they are compacted
+          expire = expire_factory_create(config, CF_SPARSE);
+          if (expire) rocksdb_options_set_compaction_filter_factory(options, expire);
+          break;
+
+      case CF_DENSE:
+          // Large values that are read whole, and compress well
+          table = rocksdb_block_based_options_create();
+          rocksdb_block_based_options_set_block_size(table, DENSE_BLOCK_SIZE);
+          rocksdb_options_set_block_based_table_factory(options, table);
+          rocksdb_block_based_options_destroy(table);
+          rocksdb_options_set_compression(options, rocksdb_lz4_compression);
+          expire = expire_factory_create(config, CF_DENSE);
+          if (expire) rocksdb_options_set_compaction_filter_factory(options, expire);
+          break;
+
+      case CF_META:
+          // Checked before every sparse read, and small
+          // enough to always be in the block cache
+          rocksdb_options_optimize_for_point_lookup(options, META_BLOCK_CACHE_MB);
+          break;
+
+      default:
+          break;
+  }
+  return options;
+}
+
+/**
+ * Checks if a legacy meta~hash record holds a hash algorithm,
+ * rather than the data of a set with that name.
+ * @return The algorithm, or -1 if it is not one
+ */
+static int parse_legacy_hash(const char *key, size_t key_len, const char *value, size_t value_len) {
+  if (key_len != (size_t)LEGACY_HASH_META_KEY_LEN ||
+      memcmp(key, LEGACY_HASH_META_KEY, key_len)) {
+      return -1;
+  }
+  char name[32];
+  if (value_len >= sizeof(name)) return -1;
+  memcpy(name, value, value_len);
+  name[value_len] = 0;
+  return hash_algorithm_from_name(name);
+}
+
+/**
+ * Moves data written before the column families out of
+ * the default family. Each key is moved and deleted in one
+ * batch, so an interrupted migration resumes on the next start.
+ * @return 0 on success, -1 on error
+ */
+static int sparse_migrate_default(struct slidingd_sparsedb *sparsedb) {
+  rocksdb_iterator_t *iter = rocksdb_create_iterator_cf(
+      sparsedb->db, sparsedb->readoptions, sparsedb->cf[CF_DEFAULT]);
+  rocksdb_iter_seek_to_first(iter);
+  if (!rocksdb_iter_valid(iter)) {
+      rocksdb_iter_destroy(iter);
+      return 0;
+  }
+
+  syslog(LOG_NOTICE, "Moving sparse data into column families");
+  rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+  uint64_t moved = 0;
+  char *err = NULL;
+  for (; rocksdb_iter_valid(iter) && !err; rocksdb_iter_next(iter)) {
+      size_t key_len, value_len;
+      const char *key = rocksdb_iter_key(iter, &key_len);
+      const char *value = rocksdb_iter_value(iter, &value_len);
+
+      if (parse_legacy_hash(key, key_len, value, value_len) >= 0) {
+          rocksdb_writebatch_put_cf(batch, sparsedb->cf[CF_META],
+                  HASH_META_KEY, HASH_META_KEY_LEN, value, value_len);
+      } else if (key_len >= (size_t)DENSE_PREFIX_LEN && !memcmp(key, DENSE_PREFIX, DENSE_PREFIX_LEN)) {
+          rocksdb_writebatch_put_cf(batch, sparsedb->cf[CF_DENSE],
+                  key + DENSE_PREFIX_LEN, key_len - DENSE_PREFIX_LEN, value, value_len);
+      } else if (value_len == 1) {
+          rocksdb_writebatch_put_cf(batch, sparsedb->cf[CF_META], key, key_len, DENSE_MARKER, 1);
+      } else {
+          // Encode the points on the way, a corrupt value is moved as is
+          hll_sparse_point *points;
+          size_t size, len;
+          char *encoded = NULL;
+          if (!sparse_decode_points(value, value_len, &points, &size)) {
+              encoded = sparse_encode_points(points, size, &len);
+              free(points);
+          }
+          if (encoded) {
+              rocksdb_writebatch_put_cf(batch, sparsedb->cf[CF_SPARSE], key, key_len, encoded, len);
+              free(encoded);
+          } else {
+              rocksdb_writebatch_put_cf(batch, sparsedb->cf[CF_SPARSE], key, key_len, value, value_len);
+          }
+      }
+      rocksdb_writebatch_delete_cf(batch, sparsedb->cf[CF_DEFAULT], key, key_len);
+      moved++;
+
+      if (rocksdb_writebatch_count(batch) >= MIGRATE_BATCH_SIZE) {
+          rocksdb_write(sparsedb->db, sparsedb->writeoptions, batch, &err);
+          rocksdb_writebatch_clear(batch);
+      }
+  }
+  if (!err) rocksdb_iter_get_error(iter, &err);
+  if (!err && rocksdb_writebatch_count(batch)) {
+      rocksdb_write(sparsedb->db, sparsedb->writeoptions, batch, &err);
+  }
+  rocksdb_writebatch_destroy(batch);
+  rocksdb_iter_destroy(iter);
+
+  if (err) {
+      syslog(LOG_ERR, "Failed to move sparse data into column families: %s", err);
+      free(err);
+      return -1;
+  }
+  syslog(LOG_NOTICE, "Moved %llu keys into column families", (unsigned long long)moved);
+  return 0;
+}
+
+int init_sparse(struct hlld_config *config, struct slidingd_sparsedb **sparsedb) {
+  // Allocate a new object
+  *sparsedb = (struct slidingd_sparsedb*)calloc(1, sizeof(struct slidingd_sparsedb));
+
+  // Copy the config
+  (*sparsedb)->config = config;
+
+  for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+      sparse_cache_shard *shard = &(*sparsedb)->shards[i];
+      pthread_mutex_init(&shard->lock, NULL);
+      pthread_cond_init(&shard->cond, NULL);
+      init_art_tree(&shard->map);
+  }
+  pthread_mutex_init(&(*sparsedb)->flush_lock, NULL);
+
+  (*sparsedb)->options = rocksdb_options_create();
+
+  // Optimize RocksDB. This is the easiest way to
+  // get RocksDB to perform well
+  rocksdb_options_increase_parallelism(
+      (*sparsedb)->options,
+      (int)(sysconf(_SC_NPROCESSORS_ONLN))
+  );
+  rocksdb_options_optimize_level_style_compaction(
+      (*sparsedb)->options,
+      config->memtable_memory
+  );
+
+  // Points written before the column families may still
+  // be unmerged in the default family
+  rocksdb_options_set_merge_operator((*sparsedb)->options, sparse_merge_operator_create());
+
+  // The options are never changed after this, so every
+  // thread can share them instead of creating their own
+  (*sparsedb)->readoptions = rocksdb_readoptions_create();
+  (*sparsedb)->writeoptions = rocksdb_writeoptions_create();
+  switch (config->durability_level) {
+      case DURABILITY_NONE:
+          rocksdb_writeoptions_disable_WAL((*sparsedb)->writeoptions, 1);
+          break;
+      case DURABILITY_SYNC:
+          // Concurrent synced writes are group committed by rocksdb
+          rocksdb_writeoptions_set_sync((*sparsedb)->writeoptions, 1);
+          break;
+      default:
+          break;
+  }
+
+  // create the DB and the column families if they're not already present
+  rocksdb_options_set_create_if_missing((*sparsedb)->options, 1);
+  rocksdb_options_set_create_missing_column_families((*sparsedb)->options, 1);
+  (*sparsedb)->cf_options[CF_DEFAULT] = (*sparsedb)->options;
+  for (int i = CF_DEFAULT + 1; i < CF_COUNT; i++) {
+      (*sparsedb)->cf_options[i] = create_cf_options(config, (sparse_column_family)i);
+  }
+
+  // open DB
+  char *err = NULL;
+  (*sparsedb)->db = rocksdb_open_column_families(
+      (*sparsedb)->options, config->data_dir,
+      CF_COUNT, CF_NAMES,
+      (const rocksdb_options_t *const *)(*sparsedb)->cf_options,
+      (*sparsedb)->cf, &err
+  );
+  if (err) {
+      syslog(LOG_ERR, "failed to open sliding sparse rocksdb: %s", err);
+      free(err);
+      return -1;
+  }
+
+  if (sparse_migrate_default(*sparsedb)) {
+      return -1;
+  }
+
+  if (sparse_load_hash(*sparsedb)) {
+      return -1;
+  }
+
+  global_sparse = (*sparsedb);
+
+  return 0;
+}
+
+/**
+ * Selects the hash algorithm for the database. A new database
+ * records the configured algorithm. An existing one keeps the
+ * algorithm it was created with, since changing it would make
+ * the stored registers and hashes meaningless.
+ * @return 0 on success, -1 on error
+ */
+int sparse_load_hash(struct slidingd_sparsedb *sparsedb) {
+    struct hlld_config *config = sparsedb->config;
+    const char *configured = hash_algorithm_name((hash_algorithm)config->hash_algorithm);
+
+    size_t len;
+    char *err = NULL;
+    char *stored = rocksdb_get_cf(
+        sparsedb->db, sparsedb->readoptions, sparsedb->cf[CF_META],
+        HASH_META_KEY, HASH_META_KEY_LEN,
+        &len, &err
+    );
+    if (err) {
+        syslog(LOG_ERR, "failed to read the hash algorithm from rocksdb");
+        free(err);
+        return -1;
+    }
+
+    // Older versions kept it under a key a set could also use
+    if (!stored) {
+        char *legacy = rocksdb_get_cf(
+            sparsedb->db, sparsedb->readoptions, sparsedb->cf[CF_META],
+            LEGACY_HASH_META_KEY, LEGACY_HASH_META_KEY_LEN,
+            &len, &err
+        );
+        if (err) {
+            syslog(LOG_ERR, "failed to read the hash algorithm from rocksdb");
+            free(err);
+            return -1;
+        }
+        if (legacy && parse_legacy_hash(LEGACY_HASH_META_KEY, LEGACY_HASH_META_KEY_LEN, legacy, len) >= 0) {
+            rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+            rocksdb_writebatch_put_cf(batch, sparsedb->cf[CF_META],
+                    HASH_META_KEY, HASH_META_KEY_LEN, legacy, len);
+            rocksdb_writebatch_delete_cf(batch, sparsedb->cf[CF_META],
+                    LEGACY_HASH_META_KEY, LEGACY_HASH_META_KEY_LEN);
+            rocksdb_write(sparsedb->db, sparsedb->writeoptions, batch, &err);
+            rocksdb_writebatch_destroy(batch);
+            if (err) {
+                syslog(LOG_ERR, "failed to move the hash algorithm in rocksdb");
+                free(err);
+                free(legacy);
+                return -1;
+            }
+            stored = legacy;
+        } else {
+            free(legacy);
+        }
+    }
+
+    // New database, record the configured algorithm
+    if (!stored) {
+        rocksdb_put_cf(
+            sparsedb->db, sparsedb->writeoptions, sparsedb->cf[CF_META],
+            HASH_META_KEY, HASH_META_KEY_LEN,
+            configured, strlen(configured),
+            &err
+        );
+        if (err) {
+            syslog(LOG_ERR, "failed to write the hash algorithm to rocksdb");
+            free(err);
+            return -1;
+        }
+        hash_use_algorithm((hash_algorithm)config->hash_algorithm);
+        return 0;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%.*s", (int)len, stored);
+    free(stored);
+    int algorithm = hash_algorithm_from_name(name);
+    if (algorithm < 0) {
+        syslog(LOG_ERR, "Unknown hash algorithm in database: %s", name);
+        return -1;
+    }
+    if (algorithm != config->hash_algorithm) {
+        syslog(LOG_WARNING, "Database was created with the %s hash, ignoring configured %s hash",
+                name, configured);
+        config->hash_algorithm = algorithm;
+    }
+    hash_use_algorithm((hash_algorithm)algorithm);
+    return 0;
+}
+
+int destroy_sparse(struct slidingd_sparsedb *sparsedb) {
+  // Write back anything the cache is still holding
+  int res = sparse_flush(sparsedb);
+
+  for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+      sparse_cache_shard *shard = &sparsedb->shards[i];
+      pthread_mutex_lock(&shard->lock);
+      while (shard->lru_head) {
+          cache_remove(shard, shard->lru_head);
+      }
+      pthread_mutex_unlock(&shard->lock);
+      destroy_art_tree(&shard->map);
+      pthread_cond_destroy(&shard->cond);
+      pthread_mutex_destroy(&shard->lock);
+  }
+  pthread_mutex_destroy(&sparsedb->flush_lock);
+
+  // Handles must go before the db is closed
+  for (int i = 0; i < CF_COUNT; i++) {
+      if (sparsedb->cf[i]) rocksdb_column_family_handle_destroy(sparsedb->cf[i]);
+  }
+  rocksdb_close(sparsedb->db);
+  for (int i = CF_DEFAULT + 1; i < CF_COUNT; i++) {
+      rocksdb_options_destroy(sparsedb->cf_options[i]);
+  }
+  rocksdb_options_destroy(sparsedb->options);
+  rocksdb_readoptions_destroy(sparsedb->readoptions);
+  rocksdb_writeoptions_destroy(sparsedb->writeoptions);
+
+  if (global_sparse == sparsedb) {
+    global_sparse = NULL;
+  }
+
+  return res;
+}
+
+/**
+ * Gets the rocksdb stats of each column family,
+ * followed by the stats of the whole database
+ * @return A malloc'd string, or NULL on error
+ */
+char *sparse_get_stats(struct slidingd_sparsedb *sparsedb) {
+    char *output = rocksdb_property_value(sparsedb->db, "rocksdb.dbstats");
+    if (!output) return NULL;
+
+    for (int i = CF_COUNT - 1; i > CF_DEFAULT; i--) {
+        char *stats = rocksdb_property_value_cf(sparsedb->db, sparsedb->cf[i], "rocksdb.cfstats");
+        char *joined = NULL;
+        int res = asprintf(&joined, "== %s ==\n%s\n%s", CF_NAMES[i], stats ? stats : "", output);
+        free(stats);
+        free(output);
+        if (res == -1) return NULL;
+        output = joined;
+    }
+    return output;
+}
+
+/**
+ * Copies out the cache counters, summed over the shards
+ * @arg stats Output, the counters
+ */
+void sparse_get_cache_stats(struct slidingd_sparsedb *sparsedb, sparse_cache_stats *stats) {
+    memset(stats, 0, sizeof(sparse_cache_stats));
+    for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+        sparse_cache_shard *shard = &sparsedb->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->evictions += shard->stats.evictions;
+        stats->entries += shard->stats.entries;
+        stats->dirty += shard->stats.dirty;
+        stats->memory += shard->stats.memory;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * Waits for the turn of a batch built in a shard. Batches
+ * of a shard are written in the order they were built, so
+ * an older write back of a set never lands after a newer one.
+ * Must be called with the shard lock held.
+ */
+static void shard_wait_turn(sparse_cache_shard *shard, uint64_t ticket) {
+    while (shard->write_turn != ticket) {
+        pthread_cond_wait(&shard->cond, &shard->lock);
+    }
+}
+
+/**
+ * Lets the next batch of a shard write.
+ * Must be called with the shard lock held.
+ */
+static void shard_end_turn(sparse_cache_shard *shard) {
+    shard->write_turn++;
+    pthread_cond_broadcast(&shard->cond);
+}
+
+/**
+ * Writes a batch built under the shard lock, which is
+ * released for the write. Entries must be pinned to be
+ * used once it returns.
+ * Must be called with the shard lock held, and returns with it held.
+ * @arg err Output, the rocksdb error on failure
+ */
+static void shard_write(
+    struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard,
+    rocksdb_writebatch_t *batch, char **err
+) {
+    uint64_t ticket = shard->write_next++;
+    shard_wait_turn(shard, ticket);
+    pthread_mutex_unlock(&shard->lock);
+    rocksdb_write(sparsedb->db, sparsedb->writeoptions, batch, err);
+    pthread_mutex_lock(&shard->lock);
+    shard_end_turn(shard);
+}
+
+/**
+ * Pins an entry that was added to a batch, growing the list
+ * of written entries as needed
+ * @return 0 on success, -1 on a failed allocation
+ */
+static int cache_pin_written(
+    cache_written **written, size_t *size, size_t *capacity, sparse_cache_entry *entry
+) {
+    if (*size == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        cache_written *grown = (cache_written*)realloc(*written, new_capacity * sizeof(cache_written));
+        if (!grown) return -1;
+        *written = grown;
+        *capacity = new_capacity;
+    }
+    (*written)[*size].entry = entry;
+    (*written)[*size].generation = entry->generation;
+    (*size)++;
+    entry->writing++;
+    return 0;
+}
+
+/**
+ * Unpins written entries once their write has landed, marking
+ * the ones that did not change in the meantime clean.
+ * Must be called with the shard lock held.
+ */
+static void cache_unpin_written(
+    sparse_cache_shard *shard, cache_written *written, size_t size, int success
+) {
+    for (size_t i = 0; i < size; i++) {
+        sparse_cache_entry *entry = written[i].entry;
+        entry->writing--;
+        if (success && entry->generation == written[i].generation) {
+            cache_mark_clean(shard, entry);
+        }
+    }
+}
+
+/**
+ * Waits for the turn of a multi-shard batch in every shard
+ * it took a ticket from. Callers hold the flush lock, so two
+ * of them never wait on each other's tickets.
+ * @arg first Index of the first entry of each shard, followed
+ * by the total, so shards with no entries took no ticket
+ * @arg tickets The ticket taken from each shard
+ */
+static void cache_wait_turns(
+    struct slidingd_sparsedb *sparsedb, const size_t *first, const uint64_t *tickets
+) {
+    for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+        if (first[i + 1] == first[i]) continue;
+        sparse_cache_shard *shard = &sparsedb->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard_wait_turn(shard, tickets[i]);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * Writes every dirty set in the cache back to rocksdb in
+ * a single batch, so a synced flush only syncs once. The
+ * batch is built one shard at a time, and written with
+ * the shard locks released.
+ * Sets stay cached, and are clean afterwards unless they
+ * changed while being written.
+ * @return 0 on success, -1 on error
+ */
+int sparse_flush(struct slidingd_sparsedb *sparsedb) {
+    // Flushes take their turn in every shard, so two
+    // of them must not interleave their tickets
+    pthread_mutex_lock(&sparsedb->flush_lock);
+
+    rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+    cache_written *written = NULL;
+    size_t num_written = 0, capacity = 0;
+    size_t first[SPARSE_CACHE_SHARDS + 1];
+    uint64_t tickets[SPARSE_CACHE_SHARDS];
+    int res = 0;
+    for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+        sparse_cache_shard *shard = &sparsedb->shards[i];
+        first[i] = num_written;
+        pthread_mutex_lock(&shard->lock);
+        for (sparse_cache_entry *entry = shard->lru_head; entry && shard->stats.dirty; entry = entry->next) {
+            if (!entry->dirty) continue;
+            if (cache_batch_write_back(sparsedb, batch, entry) ||
+                cache_pin_written(&written, &num_written, &capacity, entry)) {
+                // The set stays dirty for the next flush
+                res = -1;
+            }
+        }
+        if (num_written > first[i]) tickets[i] = shard->write_next++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    first[SPARSE_CACHE_SHARDS] = num_written;
+
+    if (num_written) {
+        cache_wait_turns(sparsedb, first, tickets);
+
+        char *err = NULL;
+        rocksdb_write(sparsedb->db, sparsedb->writeoptions, batch, &err);
+        if (err) {
+            syslog(LOG_ERR, "Failed to flush sparse sets: %s", err);
+            free(err);
+            res = -1;
+        }
+
+        for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+            if (first[i + 1] == first[i]) continue;
+            sparse_cache_shard *shard = &sparsedb->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            shard_end_turn(shard);
+            cache_unpin_written(shard, written + first[i], first[i + 1] - first[i], !err);
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+    rocksdb_writebatch_destroy(batch);
+    free(written);
+    pthread_mutex_unlock(&sparsedb->flush_lock);
+    return res;
+}
+
+/**
+ * Opens a write batch on this thread. Until it is committed,
+ * sets are not evicted from the cache, so the writes made in
+ * the meantime are written back together.
+ */
+void sparse_begin_batch(void) {
+    batch_depth++;
+}
+
+/**
+ * Checks if the write batch opened on this thread has
+ * deferred evictions, which its commit has to write back.
+ * @return 1 if the commit writes back sets, 0 otherwise.
+ */
+int sparse_batch_pending(void) {
+    return batch_depth && batch_deferred;
+}
+
+/**
+ * Commits the write batch opened on this thread. The sets over
+ * the cache budget of every shard are written back in a single
+ * rocksdb write, and evicted once it lands. Sets that fail to
+ * write back stay cached for the next flush.
+ * @arg failed Called with the key of each set that failed to
+ * write back, with its shard locked. May be NULL.
+ * @arg data Passed to the callback
+ * @return 0 on success, -1 if a write back failed.
+ */
+int sparse_commit_batch(struct slidingd_sparsedb *sparsedb, sparse_failed_cb failed, void *data) {
+    if (!batch_depth || --batch_depth || !batch_deferred) return 0;
+    batch_deferred = 0;
+
+    // Commits take their turn in every shard, like flushes
+    pthread_mutex_lock(&sparsedb->flush_lock);
+
+    rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+    cache_written *victims = NULL;
+    size_t num_victims = 0, capacity = 0;
+    size_t first[SPARSE_CACHE_SHARDS + 1];
+    uint64_t tickets[SPARSE_CACHE_SHARDS];
+    int res = 0;
+    for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+        sparse_cache_shard *shard = &sparsedb->shards[i];
+        first[i] = num_victims;
+        pthread_mutex_lock(&shard->lock);
+        sparse_cache_entry *unencoded;
+        cache_pick_victims(sparsedb, shard, batch, &victims, &num_victims, &capacity, &unencoded);
+        if (unencoded) {
+            res = -1;
+            if (failed) failed(data, unencoded->key, unencoded->key_len);
+        }
+        if (num_victims > first[i]) tickets[i] = shard->write_next++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    first[SPARSE_CACHE_SHARDS] = num_victims;
+
+    if (num_victims) {
+        cache_wait_turns(sparsedb, first, tickets);
+
+        char *err = NULL;
+        rocksdb_write(sparsedb->db, sparsedb->writeoptions, batch, &err);
+        if (err) {
+            syslog(LOG_ERR, "Failed to write back evicted sparse sets: %s", err);
+            free(err);
+            res = -1;
+        }
+
+        for (int i = 0; i < SPARSE_CACHE_SHARDS; i++) {
+            if (first[i + 1] == first[i]) continue;
+            sparse_cache_shard *shard = &sparsedb->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            shard_end_turn(shard);
+            for (size_t j = first[i]; err && failed && j < first[i + 1]; j++) {
+                failed(data, victims[j].entry->key, victims[j].entry->key_len);
+            }
+            cache_drop_victims(shard, victims + first[i], first[i + 1] - first[i], !err);
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+    rocksdb_writebatch_destroy(batch);
+    free(victims);
+    pthread_mutex_unlock(&sparsedb->flush_lock);
+    return res;
+}
+
+/**
+ * Compacts the sparse and dense sets, so expired data
+ * is dropped now instead of by background compactions.
+ * Only what has been written back to rocksdb is compacted.
+ */
+void sparse_compact(struct slidingd_sparsedb *sparsedb) {
+    rocksdb_compact_range_cf(sparsedb->db, sparsedb->cf[CF_SPARSE], NULL, 0, NULL, 0);
+    rocksdb_compact_range_cf(sparsedb->db, sparsedb->cf[CF_DENSE], NULL, 0, NULL, 0);
+}
+
+/**
+ * Returns the memory accounted to a cache entry
+ */
+static size_t cache_entry_memory(sparse_cache_entry *entry) {
+    return sizeof(sparse_cache_entry) + entry->key_len +
+        (entry->capacity + entry->pending_capacity) * sizeof(hll_sparse_point);
+}
+
+/**
+ * Picks the shard of a set. FNV-1a is enough to
+ * spread the names, they are not chosen to collide.
+ */
+static sparse_cache_shard *cache_shard(struct slidingd_sparsedb *sparsedb, const char *key, int key_len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < key_len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return &sparsedb->shards[hash % SPARSE_CACHE_SHARDS];
+}
+
+/**
+ * Drops the points waiting to be merged
+ */
+static void cache_clear_pending(sparse_cache_shard *shard, sparse_cache_entry *entry) {
+    shard->stats.memory -= entry->pending_capacity * sizeof(hll_sparse_point);
+    free(entry->pending);
+    entry->pending = NULL;
+    entry->pending_size = 0;
+    entry->pending_capacity = 0;
+    entry->merge_all = 0;
+}
+
+static void lru_unlink(sparse_cache_shard *shard, sparse_cache_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else shard->lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else shard->lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push(sparse_cache_shard *shard, sparse_cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->prev = entry;
+    else shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+/**
+ * Records a change to a cached set
+ */
+static void cache_mark_dirty(sparse_cache_shard *shard, sparse_cache_entry *entry) {
+    entry->generation = ++shard->generation;
+    if (!entry->dirty) {
+        entry->dirty = 1;
+        shard->stats.dirty++;
+    }
+}
+
+/**
+ * Reads what rocksdb holds for a set. The dense marker is
+ * checked first, since the meta family stays cached.
+ * @arg pinned Output, the points of a sparse set, or NULL.
+ * Must be destroyed by the caller.
+ * @return The state of the set, or -1 on error
+ */
+static int sparse_read_state(
+    struct slidingd_sparsedb *sparsedb,
+    const char *key, int key_len,
+    rocksdb_pinnableslice_t **pinned
+) {
+    *pinned = NULL;
+    char *err = NULL;
+    rocksdb_pinnableslice_t *marker = rocksdb_get_pinned_cf(
+        sparsedb->db, sparsedb->readoptions, sparsedb->cf[CF_META], key, key_len, &err
+    );
+    if (!err && marker) {
+        rocksdb_pinnableslice_destroy(marker);
+        return SPARSE_DENSE;
+    }
+    if (!err) {
+        *pinned = rocksdb_get_pinned_cf(
+            sparsedb->db, sparsedb->readoptions, sparsedb->cf[CF_SPARSE], key, key_len, &err
+        );
+    }
+    if (err) {
+        syslog(LOG_ERR, "failed to fetch sparse points from rocksdb: %s", err);
+        free(err);
+        return -1;
+    }
+
+    size_t len = 0;
+    if (*pinned) rocksdb_pinnableslice_value(*pinned, &len);
+    if (!len) {
+        if (*pinned) rocksdb_pinnableslice_destroy(*pinned);
+        *pinned = NULL;
+        return SPARSE_MISSING;
+    }
+    return SPARSE_POINTS;
+}
+
+/**
+ * Looks up a cached set, waiting for it if another
+ * thread is still reading it from rocksdb.
+ * Must be called with the shard lock held.
+ * @return The entry, or NULL if it is not cached
+ */
+static sparse_cache_entry *cache_find(sparse_cache_shard *shard, const char *key, int key_len) {
+    sparse_cache_entry *entry;
+    while ((entry = (sparse_cache_entry*)art_search(&shard->map, (unsigned char*)key, key_len)) &&
+           entry->loading) {
+        pthread_cond_wait(&shard->cond, &shard->lock);
+    }
+    return entry;
+}
+
+/**
+ * Adds an empty entry for a set to the cache.
+ * Must be called with the shard lock held.
+ * @return The entry, or NULL on a failed allocation
+ */
+static sparse_cache_entry *cache_insert(sparse_cache_shard *shard, const char *key, int key_len) {
+    sparse_cache_entry *entry = (sparse_cache_entry*)calloc(1, sizeof(sparse_cache_entry));
+    char *key_copy = (char*)malloc(key_len);
+    if (!entry || !key_copy) {
+        syslog(LOG_ERR, "Failed to allocate memory for a sparse cache entry");
+        free(entry);
+        free(key_copy);
+        return NULL;
+    }
+    memcpy(key_copy, key, key_len);
+    entry->key = key_copy;
+    entry->key_len = key_len;
+    entry->state = SPARSE_MISSING;
+    entry->generation = ++shard->generation;
+
+    art_insert(&shard->map, (unsigned char*)key, key_len, entry);
+    lru_push(shard, entry);
+    shard->stats.entries++;
+    shard->stats.memory += cache_entry_memory(entry);
+    return entry;
+}
+
+/**
+ * Finds a set in the cache, reading it from rocksdb on a
+ * miss. The read is made with the shard lock released,
+ * while the entry is pinned so other readers of the set
+ * wait for it. Sets only leave the cache once their writes
+ * have landed, so rocksdb is up to date for a missing set.
+ * Must be called with the shard lock held. The entry is
+ * only valid until the lock is released, or the cache is
+ * next evicted.
+ * @return The entry, or NULL on error
+ */
+static sparse_cache_entry *cache_fetch(
+    struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard, const char *key, int key_len
+) {
+    sparse_cache_entry *entry = cache_find(shard, key, key_len);
+    if (entry) {
+        shard->stats.hits++;
+        if (entry != shard->lru_head) {
+            lru_unlink(shard, entry);
+            lru_push(shard, entry);
+        }
+        return entry;
+    }
+    shard->stats.misses++;
+
+    entry = cache_insert(shard, key, key_len);
+    if (!entry) return NULL;
+    entry->loading = 1;
+    pthread_mutex_unlock(&shard->lock);
+
+    // Pin the value, so only the decoded points are copied
+    rocksdb_pinnableslice_t *pinned;
+    int state = sparse_read_state(sparsedb, key, key_len, &pinned);
+    hll_sparse_point *points = NULL;
+    size_t num_points = 0;
+    if (pinned) {
+        size_t len;
+        const char *value = rocksdb_pinnableslice_value(pinned, &len);
+        int res = sparse_decode_points(value, len, &points, &num_points);
+        rocksdb_pinnableslice_destroy(pinned);
+        if (res) {
+            syslog(LOG_ERR, "Failed to decode sparse set: %.*s", key_len, key);
+            state = -1;
+        } else if (!num_points) {
+            state = SPARSE_MISSING;
+        }
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    entry->loading = 0;
+    pthread_cond_broadcast(&shard->cond);
+    if (state < 0) {
+        cache_remove(shard, entry);
+        return NULL;
+    }
 
-struct slidingd_sparsedb *sparse_get_global(void) {
-  return global_sparse;
+    entry->state = (sparse_state)state;
+    if (points) {
+        entry->points = points;
+        entry->capacity = num_points;
+        entry->size = num_points;
+        entry->min_timestamp = entry->points[0].timestamp;
+        entry->max_timestamp = entry->points[0].timestamp;
+        for (size_t i = 1; i < entry->size; i++) {
+            if (entry->points[i].timestamp < entry->min_timestamp) {
+                entry->min_timestamp = entry->points[i].timestamp;
+            } else if (entry->points[i].timestamp > entry->max_timestamp) {
+                entry->max_timestamp = entry->points[i].timestamp;
+            }
+        }
+        shard->stats.memory += num_points * sizeof(hll_sparse_point);
+    }
+    return entry;
 }
 
-int init_sparse(struct hlld_config *config, struct slidingd_sparsedb **sparsedb) {
-  // Allocate a new object
-  *sparsedb = (struct slidingd_sparsedb*)calloc(1, sizeof(struct slidingd_sparsedb));
-
-  // Copy the config
-  (*sparsedb)->config = config;
+/**
+ * Adds the write back of a cached set to a batch. A dense
+ * set has its marker written and its points deleted.
+ * @return 0 on success, -1 if the points could not be encoded
+ */
+static int cache_batch_write_back(
+    struct slidingd_sparsedb *sparsedb, rocksdb_writebatch_t *batch, sparse_cache_entry *entry
+) {
+    if (entry->state == SPARSE_DENSE) {
+        rocksdb_writebatch_put_cf(
+            batch, sparsedb->cf[CF_META],
+            entry->key, entry->key_len,
+            DENSE_MARKER, 1
+        );
+        rocksdb_writebatch_delete_cf(
+            batch, sparsedb->cf[CF_SPARSE],
+            entry->key, entry->key_len
+        );
+    } else if (entry->merge_all || entry->pending_size) {
+        // Pending points are in the order they were added
+        if (!entry->merge_all) {
+            entry->pending_size = sparse_sort_points(entry->pending, entry->pending_size);
+        }
+        hll_sparse_point *points = entry->merge_all ? entry->points : entry->pending;
+        size_t size = entry->merge_all ? entry->size : entry->pending_size;
+        size_t len;
+        char *value = sparse_encode_points(points, size, &len);
+        if (!value) {
+            syslog(LOG_ERR, "Failed to allocate memory to encode sparse points");
+            return -1;
+        }
+        rocksdb_writebatch_merge_cf(
+            batch, sparsedb->cf[CF_SPARSE],
+            entry->key, entry->key_len,
+            value, len
+        );
+        free(value);
+    }
+    return 0;
+}
 
-  (*sparsedb)->options = rocksdb_options_create();
+/**
+ * Marks a cached set clean once its batch is written
+ */
+static void cache_mark_clean(sparse_cache_shard *shard, sparse_cache_entry *entry) {
+    cache_clear_pending(shard, entry);
+    if (entry->dirty) {
+        entry->dirty = 0;
+        shard->stats.dirty--;
+    }
+}
 
-  // Optimize RocksDB. This is the easiest way to
-  // get RocksDB to perform well
-  rocksdb_options_increase_parallelism(
-      (*sparsedb)->options,
-      (int)(sysconf(_SC_NPROCESSORS_ONLN))
-  );
-  rocksdb_options_optimize_level_style_compaction(
-      (*sparsedb)->options,
-      config->memtable_memory
-  );
+/**
+ * Writes a cached set to rocksdb, with the shard lock
+ * released for the write, and marks it clean unless it
+ * changed in the meantime. The entry stays valid.
+ * Must be called with the shard lock held.
+ * @return 0 on success, -1 on error
+ */
+static int cache_write_back(
+    struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard, sparse_cache_entry *entry
+) {
+    rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+    if (cache_batch_write_back(sparsedb, batch, entry)) {
+        rocksdb_writebatch_destroy(batch);
+        return -1;
+    }
 
-  // create the DB if it's not already present
-  rocksdb_options_set_create_if_missing((*sparsedb)->options, 1);
+    cache_written written = {entry, entry->generation};
+    entry->writing++;
+    char *err = NULL;
+    shard_write(sparsedb, shard, batch, &err);
+    rocksdb_writebatch_destroy(batch);
+    cache_unpin_written(shard, &written, 1, !err);
+    if (err) {
+        syslog(LOG_ERR, "Sparse rocksdb error: %s", err);
+        free(err);
+        return -1;
+    }
+    return 0;
+}
 
-  // open DB
-  char *err = NULL;
-  (*sparsedb)->db = rocksdb_open((*sparsedb)->options, config->data_dir, &err);
-  if (err) {
-      syslog(LOG_ERR, "failed to open sliding sparse rocksdb");
-      return -1;
-  }
+/**
+ * Drops a set from the cache without writing it back.
+ * The entry must not be pinned.
+ * Must be called with the shard lock held.
+ */
+static void cache_remove(sparse_cache_shard *shard, sparse_cache_entry *entry) {
+    lru_unlink(shard, entry);
+    art_delete(&shard->map, (unsigned char*)entry->key, entry->key_len);
+    shard->stats.entries--;
+    shard->stats.memory -= cache_entry_memory(entry);
+    if (entry->dirty) shard->stats.dirty--;
+
+    free(entry->points);
+    free(entry->pending);
+    free(entry->key);
+    free(entry);
+}
 
-  global_sparse = (*sparsedb);
+/**
+ * Picks the least recently used sets to evict until the shard
+ * fits its share of the memory budget. Clean sets are dropped at
+ * once, and dirty ones are added to the batch and pinned for
+ * writing back. Pinned sets are skipped. Picking stops at a set
+ * we fail to encode, which is kept with everything newer for the
+ * next flush.
+ * Must be called with the shard lock held.
+ * @arg unencoded Output, the set that failed to encode, or NULL
+ */
+static void cache_pick_victims(
+    struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard, rocksdb_writebatch_t *batch,
+    cache_written **victims, size_t *num_victims, size_t *capacity, sparse_cache_entry **unencoded
+) {
+    uint64_t budget = sparsedb->config->sparse_cache_memory / SPARSE_CACHE_SHARDS;
+    uint64_t memory = shard->stats.memory;
+    sparse_cache_entry *entry = shard->lru_tail;
+    *unencoded = NULL;
+    while (entry && memory > budget) {
+        sparse_cache_entry *prev = entry->prev;
+        if (entry->evicting) {
+            // Already on its way out
+            memory -= cache_entry_memory(entry);
+        } else if (entry->loading || entry->writing) {
+            // Pinned, left for a later eviction
+        } else if (!entry->dirty) {
+            memory -= cache_entry_memory(entry);
+            cache_remove(shard, entry);
+            shard->stats.evictions++;
+        } else {
+            if (cache_batch_write_back(sparsedb, batch, entry) ||
+                cache_pin_written(victims, num_victims, capacity, entry)) {
+                *unencoded = entry;
+                break;
+            }
+            entry->evicting = 1;
+            memory -= cache_entry_memory(entry);
+        }
+        entry = prev;
+    }
+}
 
-  return 0;
+/**
+ * Removes the evicted sets once their write back has landed.
+ * Sets that failed, or changed while being written, stay cached.
+ * Must be called with the shard lock held.
+ */
+static void cache_drop_victims(
+    sparse_cache_shard *shard, cache_written *victims, size_t num_victims, int success
+) {
+    cache_unpin_written(shard, victims, num_victims, success);
+    for (size_t i = 0; i < num_victims; i++) {
+        sparse_cache_entry *entry = victims[i].entry;
+        entry->evicting = 0;
+        if (!entry->writing && !entry->dirty) {
+            cache_remove(shard, entry);
+            shard->stats.evictions++;
+        }
+    }
 }
 
-int destroy_sparse(struct slidingd_sparsedb *sparsedb) {
-  rocksdb_options_destroy(sparsedb->options);
-  rocksdb_close(sparsedb->db);
+/**
+ * Evicts the least recently used sets until the shard fits
+ * its share of the memory budget. Dirty sets are written back
+ * first in a single batch, with the shard lock released for the
+ * write. While a batch is open, the eviction is deferred to its
+ * commit instead.
+ * Must be called with the shard lock held.
+ * @return 0 on success, -1 if the write back failed.
+ */
+static int cache_evict(struct slidingd_sparsedb *sparsedb, sparse_cache_shard *shard) {
+    uint64_t budget = sparsedb->config->sparse_cache_memory / SPARSE_CACHE_SHARDS;
+    if (shard->stats.memory <= budget) return 0;
+    if (batch_depth) {
+        batch_deferred = 1;
+        return 0;
+    }
 
-  if (global_sparse == sparsedb) {
-    global_sparse = NULL;
-  }
+    rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+    cache_written *victims = NULL;
+    size_t num_victims = 0, capacity = 0;
+    sparse_cache_entry *unencoded;
+    cache_pick_victims(sparsedb, shard, batch, &victims, &num_victims, &capacity, &unencoded);
 
-  return 0;
+    char *err = NULL;
+    if (num_victims) {
+        shard_write(sparsedb, shard, batch, &err);
+        if (err) {
+            syslog(LOG_ERR, "Failed to write back evicted sparse sets: %s", err);
+            free(err);
+        }
+        cache_drop_victims(shard, victims, num_victims, !err);
+    }
+    rocksdb_writebatch_destroy(batch);
+    free(victims);
+    return (err) ? -1 : 0;
 }
 
-char *sparse_get_stats(struct slidingd_sparsedb *sparsedb) {
-    return rocksdb_property_value(sparsedb->db, "rocksdb.stats");
+/**
+ * Counts the cached points in a time window. The scan is
+ * skipped when the window holds all or none of the points.
+ */
+static size_t cache_count_window(sparse_cache_entry *entry, time_t timestamp, time_t time_window) {
+    time_t start = timestamp - time_window;
+    if (!entry->size || timestamp < entry->min_timestamp || start > entry->max_timestamp) {
+        return 0;
+    }
+    if (start <= entry->min_timestamp && timestamp >= entry->max_timestamp) {
+        return entry->size;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < entry->size; i++) {
+        if (entry->points[i].timestamp >= start &&
+            entry->points[i].timestamp <= timestamp)
+        {
+            count++;
+        }
+    }
+    return count;
 }
 
 /**
- * Drop a sparse hyperloglog
+ * Drop a sparse hyperloglog. The cached set is emptied and
+ * kept pinned until the delete lands, so it is not read back
+ * from rocksdb in the meantime.
  * @return 0 if success
  *         HLL_IS_DENSE if the we should use a dense set
  */
@@ -84,25 +1744,56 @@ int sparse_drop(
     struct slidingd_sparsedb *sparsedb,
     const char *set_name, int set_name_len
 ) {
-    rocksdb_writeoptions_t *writeoptions = rocksdb_writeoptions_create();
+    sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+    pthread_mutex_lock(&shard->lock);
+    sparse_cache_entry *entry = cache_find(shard, set_name, set_name_len);
+    if (!entry) entry = cache_insert(shard, set_name, set_name_len);
+    if (!entry) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    // Forget the points, the set reads as missing from now on
+    cache_clear_pending(shard, entry);
+    shard->stats.memory -= entry->capacity * sizeof(hll_sparse_point);
+    free(entry->points);
+    entry->points = NULL;
+    entry->size = 0;
+    entry->capacity = 0;
+    entry->state = SPARSE_MISSING;
+    entry->generation = ++shard->generation;
+    if (entry->dirty) {
+        entry->dirty = 0;
+        shard->stats.dirty--;
+    }
+    uint64_t generation = entry->generation;
 
+    rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+    rocksdb_writebatch_delete_cf(batch, sparsedb->cf[CF_SPARSE], set_name, set_name_len);
+    rocksdb_writebatch_delete_cf(batch, sparsedb->cf[CF_META], set_name, set_name_len);
+    entry->writing++;
     char *err = NULL;
-    rocksdb_delete(
-        sparsedb->db, writeoptions,
-        set_name, set_name_len,
-        &err
-    );
+    shard_write(sparsedb, shard, batch, &err);
+    rocksdb_writebatch_destroy(batch);
+    entry->writing--;
+
+    // Drop the set even if the delete failed, so it is read back
+    if (!entry->writing && entry->generation == generation) {
+        cache_remove(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
     if (err) {
         syslog(LOG_ERR, "failed to delete sparse key");
+        free(err);
         return -1;
     }
 
-    rocksdb_writeoptions_destroy(writeoptions);
     return 0;
 }
 
 /**
- * Check if a set is dense
+ * Check if a set is dense. Sets that are not cached
+ * are not loaded, their values are only pinned.
  * @return 1 if dense
  *         0 if sparse
  *         -1 if missing
@@ -112,31 +1803,41 @@ int sparse_is_dense(
     struct slidingd_sparsedb *sparsedb,
     const char *set_name, int set_name_len
 ) {
-    size_t len;
-    char *err = NULL;
-    rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
-    hll_sparse_point *points = (hll_sparse_point *)
-        rocksdb_get(sparsedb->db, readoptions, set_name, set_name_len, &len, &err);
-    if (err) {
-        syslog(LOG_ERR, "failed to fetch sparse points from rocksdb");
-        return -2;
+    sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+    pthread_mutex_lock(&shard->lock);
+    sparse_cache_entry *entry = (sparse_cache_entry*)art_search(
+        &shard->map, (unsigned char*)set_name, set_name_len
+    );
+    if (entry && !entry->loading) {
+        shard->stats.hits++;
+        int res = entry->state == SPARSE_DENSE ? 1 : (entry->state == SPARSE_POINTS ? 0 : -1);
+        pthread_mutex_unlock(&shard->lock);
+        return res;
     }
-
-    // If the length is 1 this is a dense set
-    rocksdb_readoptions_destroy(readoptions);
-    free(points);
-
-    if (len == 0) {
-      return -1;
-    } else if (len == 1) {
-        return 1;
-    } else {
-        return 0;
+    shard->stats.misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    // Sets only leave the cache once their writes have
+    // landed, so an uncached set is read without the lock
+    rocksdb_pinnableslice_t *pinned;
+    int state = sparse_read_state(sparsedb, set_name, set_name_len, &pinned);
+    if (pinned) rocksdb_pinnableslice_destroy(pinned);
+
+    switch (state) {
+        case SPARSE_DENSE:
+            return 1;
+        case SPARSE_POINTS:
+            return 0;
+        case SPARSE_MISSING:
+            return -1;
+        default:
+            return -2;
     }
 }
 
 /**
  * Fetch all the points in a hll
+ * @arg points Output, a copy of the points the caller must free
  * @return 0 if success
  *         -1 on error
  *         HLL_IS_DENSE if the we should use a dense set
@@ -146,33 +1847,29 @@ int sparse_get_points(
     const char *set_name, int set_name_len,
     hll_sparse_point **points, size_t *size
 ) {
-  rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
-
-  size_t len;
-  char *err = NULL;
-  *points = (hll_sparse_point *)
-      rocksdb_get(sparsedb->db, readoptions, set_name, set_name_len, &len, &err);
-  rocksdb_readoptions_destroy(readoptions);
-  if (err) {
-      syslog(LOG_ERR, "failed to fetch sparse points from rocksdb");
-      return -1;
-  }
-
-  if (len == 0) {
-    if (*points) free(*points);
-    *points = NULL;
-    *size = 0;
-    return 0;
-  }
-
-  // If the length is 1 this is a dense set
-  if (len == 1) {
-    free(*points);
-    return HLL_IS_DENSE;
+  sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+  pthread_mutex_lock(&shard->lock);
+  sparse_cache_entry *entry = cache_fetch(sparsedb, shard, set_name, set_name_len);
+  int res = 0;
+  *points = NULL;
+  *size = 0;
+  if (!entry) {
+      res = -1;
+  } else if (entry->state == SPARSE_DENSE) {
+      res = HLL_IS_DENSE;
+  } else if (entry->size) {
+      *points = (hll_sparse_point*)malloc(entry->size * sizeof(hll_sparse_point));
+      if (*points) {
+          memcpy(*points, entry->points, entry->size * sizeof(hll_sparse_point));
+          *size = entry->size;
+      } else {
+          syslog(LOG_ERR, "Failed to allocate memory for sparse points");
+          res = -1;
+      }
   }
-
-  *size = len / sizeof(hll_sparse_point);
-  return 0;
+  cache_evict(sparsedb, shard);
+  pthread_mutex_unlock(&shard->lock);
+  return res;
 }
 
 /**
@@ -185,13 +1882,20 @@ int sparse_size_total(
     struct slidingd_sparsedb *sparsedb,
     const char *set_name, int set_name_len
 ) {
-  hll_sparse_point *points;
-  size_t size;
-
-  int err = sparse_get_points(sparsedb, set_name, set_name_len, &points, &size);
-  if (err) return err;
-  free(points);
-  return size;
+  sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+  pthread_mutex_lock(&shard->lock);
+  sparse_cache_entry *entry = cache_fetch(sparsedb, shard, set_name, set_name_len);
+  int res;
+  if (!entry) {
+      res = -1;
+  } else if (entry->state == SPARSE_DENSE) {
+      res = HLL_IS_DENSE;
+  } else {
+      res = entry->size;
+  }
+  cache_evict(sparsedb, shard);
+  pthread_mutex_unlock(&shard->lock);
+  return res;
 }
 /**
  * Estimates the cardinality of the HLL
@@ -204,227 +1908,519 @@ int sparse_size(
     const char *set_name, int set_name_len,
     time_t timestamp, unsigned int time_window
 ) {
-  rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
-
-  size_t len;
-  char *err = NULL;
-  hll_sparse_point *points = (hll_sparse_point *)
-      rocksdb_get(sparsedb->db, readoptions, set_name, set_name_len, &len, &err);
-  if (err) {
-      syslog(LOG_ERR, "failed to fetch sparse points from rocksdb");
+  sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+  pthread_mutex_lock(&shard->lock);
+  sparse_cache_entry *entry = cache_fetch(sparsedb, shard, set_name, set_name_len);
+  if (!entry) {
+      pthread_mutex_unlock(&shard->lock);
       return -1;
   }
 
-  // If the length is 1 this is a dense set
-  if (len == 1) {
-    rocksdb_readoptions_destroy(readoptions);
-    free(points);
+  if (entry->state == SPARSE_DENSE) {
+    cache_evict(sparsedb, shard);
+    pthread_mutex_unlock(&shard->lock);
     return HLL_IS_DENSE;
   }
 
-  int size = len / sizeof(hll_sparse_point);
-  int count = 0;
+  int count = cache_count_window(entry, timestamp, time_window);
+
+  cache_evict(sparsedb, shard);
+  pthread_mutex_unlock(&shard->lock);
+
+  return count;
+}
+
+/**
+ * Counts the points of a sparse hyperloglog that fall
+ * in each of several time windows, using a single read.
+ * @arg counts Output, the count for each window
+ * @return 0 if success
+ *         -1 on error
+ *         HLL_IS_DENSE if the we should use a dense set
+ */
+int sparse_size_multi(
+    struct slidingd_sparsedb *sparsedb,
+    const char *set_name, int set_name_len,
+    time_t timestamp, const uint64_t *time_windows, int num_windows,
+    uint64_t *counts
+) {
+  sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+  pthread_mutex_lock(&shard->lock);
+  sparse_cache_entry *entry = cache_fetch(sparsedb, shard, set_name, set_name_len);
+  if (!entry) {
+      pthread_mutex_unlock(&shard->lock);
+      return -1;
+  }
+  if (entry->state == SPARSE_DENSE) {
+      cache_evict(sparsedb, shard);
+      pthread_mutex_unlock(&shard->lock);
+      return HLL_IS_DENSE;
+  }
+
+  for (int w = 0; w < num_windows; w++) {
+      counts[w] = cache_count_window(entry, timestamp, (time_t)time_windows[w]);
+  }
+
+  cache_evict(sparsedb, shard);
+  pthread_mutex_unlock(&shard->lock);
+  return 0;
+}
 
-  for(int i = 0; i < size; i++) {
-      if (points[i].timestamp >= timestamp - (time_t)time_window &&
-          points[i].timestamp <= timestamp)
-      {
-          count++;
+/**
+ * Counts the points of several sets in one time window.
+ * Cached sets are counted from the cache. The dense markers
+ * and points of the rest are read with a single multi get,
+ * and those sets are not cached. Sets only leave the cache once
+ * their writes have landed, so they can be read without the lock.
+ * @arg counts Output, the count of each set, or HLL_IS_DENSE
+ * @return 0 on success, -1 on error
+ */
+int sparse_size_keys(
+    struct slidingd_sparsedb *sparsedb,
+    char *const *set_names, const int *set_name_lens, int num_sets,
+    time_t timestamp, uint64_t time_window,
+    int64_t *counts
+) {
+  int *uncached = (int*)malloc(num_sets * sizeof(int));
+  if (!uncached) return -1;
+  int num_uncached = 0;
+
+  for (int i = 0; i < num_sets; i++) {
+      sparse_cache_shard *shard = cache_shard(sparsedb, set_names[i], set_name_lens[i]);
+      pthread_mutex_lock(&shard->lock);
+      sparse_cache_entry *entry = (sparse_cache_entry*)art_search(
+          &shard->map, (unsigned char*)set_names[i], set_name_lens[i]
+      );
+      if (entry && !entry->loading) {
+          shard->stats.hits++;
+          counts[i] = entry->state == SPARSE_DENSE ? HLL_IS_DENSE :
+              (int64_t)cache_count_window(entry, timestamp, (time_t)time_window);
+      } else {
+          shard->stats.misses++;
+          uncached[num_uncached++] = i;
       }
+      pthread_mutex_unlock(&shard->lock);
+  }
+  if (!num_uncached) {
+      free(uncached);
+      return 0;
   }
 
-  rocksdb_readoptions_destroy(readoptions);
-  free(points);
+  // The marker of each set, followed by its points
+  size_t num_keys = 2 * num_uncached;
+  const rocksdb_column_family_handle_t **cfs = (const rocksdb_column_family_handle_t**)malloc(
+      num_keys * sizeof(rocksdb_column_family_handle_t*));
+  const char **keys = (const char**)malloc(num_keys * sizeof(char*));
+  size_t *key_lens = (size_t*)malloc(num_keys * sizeof(size_t));
+  char **values = (char**)calloc(num_keys, sizeof(char*));
+  size_t *value_lens = (size_t*)malloc(num_keys * sizeof(size_t));
+  char **errs = (char**)calloc(num_keys, sizeof(char*));
+  int res = -1;
+  if (!cfs || !keys || !key_lens || !values || !value_lens || !errs) {
+      syslog(LOG_ERR, "Failed to allocate memory for a sparse multi get");
+      goto LEAVE;
+  }
+  for (int i = 0; i < num_uncached; i++) {
+      cfs[2 * i] = sparsedb->cf[CF_META];
+      cfs[2 * i + 1] = sparsedb->cf[CF_SPARSE];
+      keys[2 * i] = keys[2 * i + 1] = set_names[uncached[i]];
+      key_lens[2 * i] = key_lens[2 * i + 1] = set_name_lens[uncached[i]];
+  }
+  rocksdb_multi_get_cf(
+      sparsedb->db, sparsedb->readoptions, cfs, num_keys,
+      keys, key_lens, values, value_lens, errs
+  );
 
-  return count;
+  res = 0;
+  for (int i = 0; i < num_uncached && !res; i++) {
+      if (errs[2 * i] || errs[2 * i + 1]) {
+          syslog(LOG_ERR, "failed to fetch sparse points from rocksdb: %s",
+                  errs[2 * i] ? errs[2 * i] : errs[2 * i + 1]);
+          res = -1;
+      } else if (values[2 * i]) {
+          counts[uncached[i]] = HLL_IS_DENSE;
+      } else {
+          hll_sparse_point *points;
+          size_t size;
+          if (sparse_decode_points(values[2 * i + 1], value_lens[2 * i + 1], &points, &size)) {
+              res = -1;
+              break;
+          }
+          time_t start = timestamp - (time_t)time_window;
+          int64_t count = 0;
+          for (size_t p = 0; p < size; p++) {
+              if (points[p].timestamp >= start && points[p].timestamp <= timestamp) count++;
+          }
+          counts[uncached[i]] = count;
+          free(points);
+      }
+  }
+
+LEAVE:
+  if (values) {
+      for (size_t i = 0; i < num_keys; i++) {
+          free(values[i]);
+          if (errs) free(errs[i]);
+      }
+  }
+  free(cfs);
+  free(keys);
+  free(key_lens);
+  free(values);
+  free(value_lens);
+  free(errs);
+  free(uncached);
+  return res;
 }
 
 
+/**
+ * Adds hashes to a sparse hyperloglog. Hashes that are
+ * already present have their timestamp bumped. The points
+ * are only updated in the cache, and are merged into
+ * rocksdb when the set is flushed or evicted.
+ * @return The number of points in the set,
+ *         -1 on error
+ *         HLL_IS_DENSE if the we should use a dense set
+ */
 int sparse_add(
     struct slidingd_sparsedb *sparsedb,
     const char *set_name, int set_name_len,
     uint64_t *hashes, int hash_count,
     time_t timestamp
 ) {
-  char *err = NULL;
-
-  size_t len;
-  rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
-  hll_sparse_point *points = (hll_sparse_point *)
-      rocksdb_get(sparsedb->db, readoptions, set_name, set_name_len, &len, &err);
-  rocksdb_readoptions_destroy(readoptions);
-  if (err) {
-      syslog(LOG_ERR, "failed to fetch sparse points from rocksdb");
+  sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+  pthread_mutex_lock(&shard->lock);
+  sparse_cache_entry *entry = cache_fetch(sparsedb, shard, set_name, set_name_len);
+  if (!entry) {
+      pthread_mutex_unlock(&shard->lock);
       return -1;
   }
 
-  if (len == 1) {
-    free(points);
+  if (entry->state == SPARSE_DENSE) {
+    cache_evict(sparsedb, shard);
+    pthread_mutex_unlock(&shard->lock);
     return HLL_IS_DENSE;
   }
 
-  int size = len / sizeof(hll_sparse_point);
+  // Round down to the precision a dense set keeps, so
+  // the stored timestamps share a divisor
+  int precision = sparsedb->config->sliding_precision;
+  if (sparsedb->config->sparse_quantize && precision > 1) {
+    time_t rem = timestamp % precision;
+    if (rem < 0) rem += precision;
+    timestamp -= rem;
+  }
 
-  // If any hashes are already taken try just update the timestamps
+  // Sort the batch so it can be merged into the set in one pass
+  hll_sparse_point stack_batch[64];
+  hll_sparse_point *batch = stack_batch;
+  if (hash_count > 64) {
+    batch = (hll_sparse_point *)malloc(sizeof(hll_sparse_point) * hash_count);
+    if (!batch) {
+      pthread_mutex_unlock(&shard->lock);
+      syslog(LOG_ERR, "Failed to allocate memory for additional points");
+      return -1;
+    }
+  }
   for (int hash = 0; hash < hash_count; hash++) {
-      for(int i = 0; i < size; i++) {
-          if (points[i].hash == hashes[hash]) {
-              points[i].timestamp = timestamp;
-
-              // Not finished, swap order before reducing
-              if (hash + 1 < hash_count) {
-                uint64_t temp = hashes[hash_count - 1];
-                hashes[hash_count - 1] = hashes[hash];
-                hashes[hash] = temp;
-              }
-              hash_count--;
-          }
-      }
+    batch[hash].timestamp = timestamp;
+    batch[hash].hash = hashes[hash];
+  }
+  size_t batch_size = sparse_sort_points(batch, hash_count);
+
+  // Hashes that are already taken just have their timestamp
+  // updated, which like the merge operator only moves forward.
+  // The new ones are left at the front of the batch.
+  size_t new_size = 0;
+  for (size_t i = 0; i < batch_size; i++) {
+    hll_sparse_point *found = NULL;
+    if (entry->size) {
+      found = (hll_sparse_point *)bsearch(
+          batch + i, entry->points, entry->size,
+          sizeof(hll_sparse_point), sparse_point_cmp
+      );
+    }
+    if (!found) {
+      batch[new_size++] = batch[i];
+    } else if (timestamp > found->timestamp) {
+      found->timestamp = timestamp;
+    }
   }
 
-  // We might still have some hashes to insert at this point
-  if (hash_count > 0) {
-    size += hash_count;
+  // Make room for the new hashes, doubling so that
+  // repeated adds to a growing set are amortized
+  size_t memory = cache_entry_memory(entry);
+  if (entry->size + new_size > entry->capacity) {
+    size_t capacity = entry->capacity * 2;
+    if (capacity < entry->size + new_size) capacity = entry->size + new_size;
 
-    // Grow the list of points
-    hll_sparse_point *new_points = (hll_sparse_point *)realloc(points, sizeof(hll_sparse_point) * size);
-    if (new_points) {
-      points = new_points;
-    } else {
-      free(points);
+    hll_sparse_point *new_points = (hll_sparse_point *)realloc(
+        entry->points, sizeof(hll_sparse_point) * capacity
+    );
+    if (!new_points) {
+      pthread_mutex_unlock(&shard->lock);
+      if (batch != stack_batch) free(batch);
       syslog(LOG_ERR, "Failed to allocate memory for additional points");
       return -1;
     }
+    entry->points = new_points;
+    entry->capacity = capacity;
+  }
 
-    for (int hash = 0; hash < hash_count; hash++) {
-      points[(size - hash_count) + hash].timestamp = timestamp;
-      points[(size - hash_count) + hash].hash = hashes[hash];
+  // Merge from the back, so the set does not need to be copied
+  if (!entry->size) {
+    entry->min_timestamp = timestamp;
+    entry->max_timestamp = timestamp;
+  } else {
+    if (new_size && timestamp < entry->min_timestamp) entry->min_timestamp = timestamp;
+    if (timestamp > entry->max_timestamp) entry->max_timestamp = timestamp;
+  }
+  size_t i = entry->size, j = new_size, out = entry->size + new_size;
+  while (j > 0) {
+    if (i > 0 && entry->points[i - 1].hash > batch[j - 1].hash) {
+      entry->points[--out] = entry->points[--i];
+    } else {
+      entry->points[--out] = batch[--j];
     }
   }
+  entry->size += new_size;
+  if (batch != stack_batch) free(batch);
+  entry->state = SPARSE_POINTS;
+
+  // Queue the hashes for the next merge. Once more hashes are
+  // queued than the set holds, merging the set is cheaper.
+  if (!entry->merge_all) {
+    size_t pending_size = entry->pending_size + hash_count;
+    if (pending_size > entry->pending_capacity && pending_size <= entry->size) {
+      size_t capacity = entry->pending_capacity * 2;
+      if (capacity < pending_size) capacity = pending_size;
+      hll_sparse_point *new_pending = (hll_sparse_point *)realloc(
+          entry->pending, sizeof(hll_sparse_point) * capacity
+      );
+      if (new_pending) {
+        entry->pending = new_pending;
+        entry->pending_capacity = capacity;
+      }
+    }
 
-  rocksdb_writeoptions_t *writeoptions = rocksdb_writeoptions_create();
-  rocksdb_put(
-      sparsedb->db, writeoptions,
-      set_name, set_name_len,
-      (char *)points, sizeof(hll_sparse_point) * size,
-      &err
-  );
-  rocksdb_writeoptions_destroy(writeoptions);
-
-  if (points) free(points);
-
-  if (err) {
-    syslog(LOG_ERR, "Sparse rocksdb error: %s", err);
-    return -1;
+    if (pending_size <= entry->pending_capacity) {
+      for (int hash = 0; hash < hash_count; hash++) {
+        entry->pending[entry->pending_size].timestamp = timestamp;
+        entry->pending[entry->pending_size].hash = hashes[hash];
+        entry->pending_size++;
+      }
+    } else {
+      free(entry->pending);
+      entry->pending = NULL;
+      entry->pending_size = 0;
+      entry->pending_capacity = 0;
+      entry->merge_all = 1;
+    }
   }
+  cache_mark_dirty(shard, entry);
+  shard->stats.memory += cache_entry_memory(entry) - memory;
 
+  int size = entry->size;
+  cache_evict(sparsedb, shard);
+  pthread_mutex_unlock(&shard->lock);
   return size;
 }
 
+/**
+ * Replays points into a dense set. Points are sorted by
+ * time, so runs that share a timestamp are added together.
+ * @return 0 on success, -1 on a failed allocation
+ */
+static int sparse_replay_points(struct hlld_set *set, hll_sparse_point *points, size_t size) {
+    if (!size) return 0;
+    uint64_t *hashes = (uint64_t*)malloc(size * sizeof(uint64_t));
+    if (!hashes) return -1;
+    qsort(points, size, sizeof(hll_sparse_point), sparse_point_time_cmp);
+    for (size_t i = 0; i < size;) {
+        int num_hashes = 0;
+        time_t timestamp = points[i].timestamp;
+        for (; i < size && points[i].timestamp == timestamp; i++) {
+            hashes[num_hashes++] = points[i].hash;
+        }
+        hset_add_hashes(set, hashes, num_hashes, timestamp);
+    }
+    free(hashes);
+    return 0;
+}
+
+/**
+ * Converts a sparse set to dense. The points are copied out
+ * and replayed without the shard lock, so the rest of the
+ * shard is not held up. The lock is then retaken to replay
+ * the points added in the meantime, and to replace the points
+ * with the dense marker, which is written through.
+ * @return 0 on success, -1 on error
+ */
 int sparse_convert_dense(
     struct slidingd_sparsedb *sparsedb,
     const char *set_name, int set_name_len,
     struct hlld_set *set
 ) {
-
-    size_t len;
-    char *err = NULL;
-    rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
-    hll_sparse_point *points = (hll_sparse_point *)
-        rocksdb_get(sparsedb->db, readoptions, set_name, set_name_len, &len, &err);
-    rocksdb_readoptions_destroy(readoptions);
-
-    if (err) {
-        syslog(LOG_ERR, "failed to fetch sparse points from rocksdb");
+    sparse_cache_shard *shard = cache_shard(sparsedb, set_name, set_name_len);
+    pthread_mutex_lock(&shard->lock);
+    sparse_cache_entry *entry = cache_fetch(sparsedb, shard, set_name, set_name_len);
+    if (!entry) {
+        pthread_mutex_unlock(&shard->lock);
         return -1;
     }
 
     // Set was already dense
-    if (len == 0) {
-      free(points);
-      return 0;
+    if (entry->state != SPARSE_POINTS) {
+        cache_evict(sparsedb, shard);
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
     }
 
-    int size = len / sizeof(hll_sparse_point);
-    for(int i = 0; i < size; i++) {
-        hset_add_hash(set, points[i].hash, points[i].timestamp);
+    // Copy the points, sorted by hash, so the ones
+    // added during the replay can be found after it
+    size_t size = entry->size;
+    uint64_t generation = entry->generation;
+    hll_sparse_point *copied = (hll_sparse_point*)malloc(size * sizeof(hll_sparse_point));
+    hll_sparse_point *replay = (hll_sparse_point*)malloc(size * sizeof(hll_sparse_point));
+    if (!copied || !replay) {
+        pthread_mutex_unlock(&shard->lock);
+        free(copied);
+        free(replay);
+        return -1;
+    }
+    memcpy(copied, entry->points, size * sizeof(hll_sparse_point));
+    memcpy(replay, entry->points, size * sizeof(hll_sparse_point));
+    pthread_mutex_unlock(&shard->lock);
+
+    int res = sparse_replay_points(set, replay, size);
+    free(replay);
+    if (res) {
+        free(copied);
+        return -1;
     }
-    free(points);
 
-    // Write '-' set (= dense)
-    rocksdb_writeoptions_t *writeoptions = rocksdb_writeoptions_create();
-    rocksdb_put(
-        sparsedb->db, writeoptions,
-        set_name, set_name_len,
-        "-", 1,
-        &err
-    );
-    rocksdb_writeoptions_destroy(writeoptions);
-    return 0;
-}
+    // The set may have been evicted in the meantime, but it was
+    // written back first, so it is read back whole. A reloaded
+    // set has a new generation, so it is checked for new points.
+    pthread_mutex_lock(&shard->lock);
+    entry = cache_fetch(sparsedb, shard, set_name, set_name_len);
+    if (!entry || entry->state != SPARSE_POINTS) {
+        // Dropped, or converted by someone else
+        pthread_mutex_unlock(&shard->lock);
+        free(copied);
+        return entry ? 0 : -1;
+    }
 
-char *alloc_dense_key(const char *full_key, int full_key_len, int *output_len) {
-    *output_len = full_key_len + DENSE_PREFIX_LEN;
-    char *buffer = (char *)malloc(sizeof(char) * (*output_len));
-    if (!buffer) {
-      return NULL;
+    // Replay what was added since the copy. That is a point
+    // the copy does not have, or one with a later timestamp.
+    // There are few, so this is done under the lock.
+    if (entry->generation != generation) {
+        hll_sparse_point *added = (hll_sparse_point*)malloc(entry->size * sizeof(hll_sparse_point));
+        if (!added) {
+            pthread_mutex_unlock(&shard->lock);
+            free(copied);
+            return -1;
+        }
+        size_t num_added = 0;
+        for (size_t i = 0; i < entry->size; i++) {
+            hll_sparse_point *found = NULL;
+            if (size) {
+                found = (hll_sparse_point*)bsearch(
+                    entry->points + i, copied, size,
+                    sizeof(hll_sparse_point), sparse_point_cmp
+                );
+            }
+            if (!found || found->timestamp < entry->points[i].timestamp) {
+                added[num_added++] = entry->points[i];
+            }
+        }
+        res = sparse_replay_points(set, added, num_added);
+        free(added);
+        if (res) {
+            pthread_mutex_unlock(&shard->lock);
+            free(copied);
+            return -1;
+        }
+    }
+    free(copied);
+
+    // Replace the points with the dense marker. This is written
+    // through, since the dense data is stored under its own key
+    cache_clear_pending(shard, entry);
+    shard->stats.memory -= cache_entry_memory(entry);
+    free(entry->points);
+    entry->points = NULL;
+    entry->size = 0;
+    entry->capacity = 0;
+    entry->state = SPARSE_DENSE;
+    shard->stats.memory += cache_entry_memory(entry);
+    cache_mark_dirty(shard, entry);
+    if (cache_write_back(sparsedb, shard, entry)) {
+        // The set stays dirty, so the next flush retries the marker
+        syslog(LOG_ERR, "Failed to mark converted set dense on disk: %.*s",
+                set_name_len, set_name);
     }
-    memcpy(buffer, DENSE_PREFIX, sizeof(char) * DENSE_PREFIX_LEN); 
-    memcpy(buffer + DENSE_PREFIX_LEN, full_key, sizeof(char) * full_key_len); 
-    return buffer;
+
+    cache_evict(sparsedb, shard);
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
 }
 
-int sparse_read_dense_data(
+/**
+ * Reads the serialized dense set without copying it
+ * @arg value Output, the pinned data. Empty if the set is
+ * missing. Must be released with sparse_release_value.
+ * @return 0 on success, -1 on error
+ */
+int sparse_read_dense_value(
     struct slidingd_sparsedb *sparsedb,
     const char *full_key, int full_key_len,
-    unsigned char **output, size_t *data_len
+    sparse_value *value
 ) {
-    int key_len;
-    char *key = alloc_dense_key(full_key, full_key_len, &key_len);
-    if (!key) {
-        syslog(LOG_ERR, "failed to allocate memory for dense key");
-        return -1;
-    }
+    value->data = NULL;
+    value->len = 0;
+    value->handle = NULL;
 
     char *err = NULL;
-    rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
-    *output = (unsigned char *)
-        rocksdb_get(sparsedb->db, readoptions, key, key_len, data_len, &err);
-    rocksdb_readoptions_destroy(readoptions);
-
-    free(key);
-
+    rocksdb_pinnableslice_t *pinned = rocksdb_get_pinned_cf(
+        sparsedb->db, sparsedb->readoptions, sparsedb->cf[CF_DENSE],
+        full_key, full_key_len, &err
+    );
     if (err) {
-        syslog(LOG_ERR, "rocksdb dense read fail: %p\n", err);
+        syslog(LOG_ERR, "rocksdb dense read fail: %s", err);
+        free(err);
         return -1;
     }
-    if (*data_len == 0) {
-        if (*output) {
-            free(*output);
-            *output = NULL;
-        }
+    if (pinned) {
+        value->data = (const unsigned char *)rocksdb_pinnableslice_value(pinned, &value->len);
+        value->handle = pinned;
     }
     return 0;
 }
 
+/**
+ * Releases a value read with sparse_read_dense_value
+ */
+void sparse_release_value(sparse_value *value) {
+    if (value->handle) {
+        rocksdb_pinnableslice_destroy((rocksdb_pinnableslice_t *)value->handle);
+    }
+    value->data = NULL;
+    value->len = 0;
+    value->handle = NULL;
+}
+
 int sparse_write_dense_data(
     struct slidingd_sparsedb *sparsedb,
     const char *full_key, int full_key_len,
     const unsigned char *data, size_t data_len
 ) {
-    int key_len;
-    char *key = alloc_dense_key(full_key, full_key_len, &key_len);
-    if (!key) {
-        syslog(LOG_ERR, "failed to allocate memory for dense key");
-        return -1;
-    }
-
     char *err = NULL;
-    rocksdb_writeoptions_t *writeoptions = rocksdb_writeoptions_create();
-    rocksdb_put(sparsedb->db, writeoptions, key, key_len, (char *)data, data_len, &err);
-    rocksdb_writeoptions_destroy(writeoptions);
-
-    free(key);
+    rocksdb_put_cf(
+        sparsedb->db, sparsedb->writeoptions, sparsedb->cf[CF_DENSE],
+        full_key, full_key_len, (const char *)data, data_len, &err
+    );
     if (err) {
         syslog(LOG_ERR, "dense write failure: %p: %s", err, err);
         return -1;
@@ -20,13 +20,48 @@ typedef struct {
     hll_sparse_point *points;
 } hll_sparse;
 
+/**
+ * A value read from rocksdb without copying it. The data
+ * stays valid until it is released with sparse_release_value.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    void *handle;
+} sparse_value;
+
+/**
+ * Counters for the in-memory cache of sparse sets
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;   // Sets currently cached
+    uint64_t dirty;     // Cached sets not yet written to rocksdb
+    uint64_t memory;    // Bytes used by the cached sets
+} sparse_cache_stats;
+
 /**
  * Initializer
  * @return 0 on success.
  */
 int init_sparse(struct hlld_config *config, struct slidingd_sparsedb **sparsedb);
+int sparse_load_hash(struct slidingd_sparsedb *sparsedb);
 int destroy_sparse(struct slidingd_sparsedb *sparsedb);
 char *sparse_get_stats(struct slidingd_sparsedb *sparsedb);
+void sparse_get_cache_stats(struct slidingd_sparsedb *sparsedb, sparse_cache_stats *stats);
+int sparse_flush(struct slidingd_sparsedb *sparsedb);
+void sparse_compact(struct slidingd_sparsedb *sparsedb);
+void sparse_begin_batch(void);
+int sparse_batch_pending(void);
+
+/**
+ * Called with the key of a set that a batch commit
+ * failed to write back
+ */
+typedef void(*sparse_failed_cb)(void *data, const char *key, int key_len);
+int sparse_commit_batch(struct slidingd_sparsedb *sparsedb, sparse_failed_cb failed, void *data);
 
 int sparse_drop(
     struct slidingd_sparsedb *sparsedb,
@@ -49,6 +84,18 @@ int sparse_size(
     const char *full_key, int full_key_len,
     time_t timestamp, unsigned int time_window
 );
+int sparse_size_multi(
+    struct slidingd_sparsedb *sparsedb,
+    const char *full_key, int full_key_len,
+    time_t timestamp, const uint64_t *time_windows, int num_windows,
+    uint64_t *counts
+);
+int sparse_size_keys(
+    struct slidingd_sparsedb *sparsedb,
+    char *const *full_keys, const int *full_key_lens, int num_keys,
+    time_t timestamp, uint64_t time_window,
+    int64_t *counts
+);
 int sparse_add(
     struct slidingd_sparsedb *sparsedb,
     const char *full_key, int full_key_len,
@@ -68,11 +115,12 @@ int sparse_write_dense_data(
     const char *full_key, int full_key_len,
     const unsigned char *data, size_t data_len
 );
-int sparse_read_dense_data(
+int sparse_read_dense_value(
     struct slidingd_sparsedb *sparsedb,
     const char *full_key, int full_key_len,
-    unsigned char **output, size_t *data_len
+    sparse_value *value
 );
+void sparse_release_value(sparse_value *value);
 int sparse_get_points(
     struct slidingd_sparsedb *sparsedb,
     const char *set_name, int set_name_len,
@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef VARINT_H
+#define VARINT_H
+
+// Longest encoding of a 64 bit varint
+#define VARINT_MAX_LEN 10
+
+/**
+ * Writes a value as a little-endian base 128 varint
+ * @arg out The buffer, with room for VARINT_MAX_LEN bytes
+ * @return The number of bytes written
+ */
+static inline size_t varint_put(unsigned char *out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (unsigned char)value;
+    return len;
+}
+
+/**
+ * Reads a varint, advancing the input past it
+ * @return 0 on success, -1 if the varint runs past the end
+ */
+static inline int varint_get(const unsigned char **in, const unsigned char *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *in < end; shift += 7) {
+        unsigned char byte = *(*in)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Maps signed values to unsigned ones so that values
+ * near zero stay small: 0, -1, 1, -2 become 0, 1, 2, 3
+ */
+static inline uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+#endif
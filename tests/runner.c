@@ -9,26 +9,27 @@
 #include "test_art.c"
 #include "test_serialize.c"
 #include "test_sparse.c"
+#include "test_hash.c"
 
 int main(void)
 {
     setlogmask(LOG_UPTO(LOG_DEBUG));
 
     Suite *s1 = suite_create("hlld");
-    /*
     TCase *tc1 = tcase_create("config");
     TCase *tc4 = tcase_create("shll");
+    /*
     TCase *tc5 = tcase_create("set");
     TCase *tc7 = tcase_create("art");
+    */
     TCase *tc8 = tcase_create("hll");
     TCase *tc9 = tcase_create("serialize");
-    */
     TCase *tc6 = tcase_create("manager");
     TCase *tc10 = tcase_create("sparse");
+    TCase *tc11 = tcase_create("hash");
     SRunner *sr = srunner_create(s1);
     int nf;
 
-    /*
     // Add the config tests
     suite_add_tcase(s1, tc1);
     tcase_add_test(tc1, test_config_get_default);
@@ -48,6 +49,9 @@ int main(void)
     tcase_add_test(tc1, test_sane_in_memory);
     tcase_add_test(tc1, test_sane_use_mmap);
     tcase_add_test(tc1, test_sane_worker_threads);
+    tcase_add_test(tc1, test_sane_hash);
+    tcase_add_test(tc1, test_sane_sparse_cache_memory);
+    tcase_add_test(tc1, test_sane_durability);
     tcase_add_test(tc1, test_set_config_bad_file);
     tcase_add_test(tc1, test_set_config_empty_file);
     tcase_add_test(tc1, test_set_config_basic_config);
@@ -63,12 +67,14 @@ int main(void)
     tcase_add_test(tc4, test_hll_add_size);
     tcase_add_test(tc4, test_hll_size_total);
     tcase_add_test(tc4, test_hll_error_bound);
+    tcase_add_test(tc4, test_hll_sum_kernels);
     tcase_add_test(tc4, test_hll_precision_for_error);
     tcase_add_test(tc4, test_hll_error_for_precision);
     tcase_add_test(tc4, test_hll_bytes_for_precision);
     tcase_add_test(tc4, test_hll_union_sparse);
     tcase_add_test(tc4, test_hll_union_dense);
 
+    /*
     // Add the set tests
     suite_add_tcase(s1, tc5);
     tcase_set_timeout(tc5, 3);
@@ -93,6 +99,8 @@ int main(void)
     tcase_add_test(tc6, test_mgr_list_prefix);
     tcase_add_test(tc6, test_mgr_list_no_sets);
     tcase_add_test(tc6, test_mgr_add_keys);
+    tcase_add_test(tc6, test_mgr_add_hashes);
+    tcase_add_test(tc6, test_mgr_background_convert);
     tcase_add_test(tc6, test_mgr_add_no_set);
     tcase_add_test(tc6, test_mgr_flush_no_set);
     tcase_add_test(tc6, test_mgr_flush);
@@ -120,32 +128,63 @@ int main(void)
     tcase_add_test(tc7, test_art_insert_iter);
     tcase_add_test(tc7, test_art_iter_prefix);
     tcase_add_test(tc7, test_art_insert_copy_delete);
+    */
 
     suite_add_tcase(s1, tc8);
     tcase_set_timeout(tc8, 3);
     tcase_add_test(tc8, test_shll_init_and_destroy);
     tcase_add_test(tc8, test_shll_add_register);
+    tcase_add_test(tc8, test_shll_lazy_registers);
+    tcase_add_test(tc8, test_shll_point_offset);
     tcase_add_test(tc8, test_shll_add_hash);
+    tcase_add_test(tc8, test_shll_add_hashes);
     tcase_add_test(tc8, test_shll_remove_smaller);
+    tcase_add_test(tc8, test_shll_skip_dominated);
+    tcase_add_test(tc8, test_shll_ordered_register);
+    tcase_add_test(tc8, test_shll_register_lookup);
+    tcase_add_test(tc8, test_shll_time_bucket);
     tcase_add_test(tc8, test_shll_remove_time);
     tcase_add_test(tc8, test_shll_shrink_register);
+    tcase_add_test(tc8, test_shll_expire);
+    tcase_add_test(tc8, test_shll_arena_compact);
+    tcase_add_test(tc8, test_shll_load_registers);
     tcase_add_test(tc8, test_shll_error_bound);
+    tcase_add_test(tc8, test_shll_size_multi);
     tcase_add_test(tc8, test_shll_time_queries);
 
     suite_add_tcase(s1, tc9);
-    tcase_set_timeout(tc8, 3);
+    tcase_set_timeout(tc9, 3);
     tcase_add_test(tc9, test_serialize_primitives);
     tcase_add_test(tc9, test_hll_serialize);
     tcase_add_test(tc9, test_hll_serialize_sparse);
     tcase_add_test(tc9, test_hll_serialize_registers);
+    tcase_add_test(tc9, test_hll_serialize_v2);
+    tcase_add_test(tc9, test_hll_serialize_v3);
+    tcase_add_test(tc9, test_hll_serialize_compressed);
     tcase_add_test(tc9, test_serialize_register);
-    */
+    tcase_add_test(tc9, test_serialize_register_epoch);
 
     suite_add_tcase(s1, tc10);
     tcase_add_test(tc10, test_sparse_init_destroy);
     tcase_add_test(tc10, test_sparse_insert);
+    tcase_add_test(tc10, test_sparse_size_multi);
+    tcase_add_test(tc10, test_sparse_cache);
+    tcase_add_test(tc10, test_sparse_merge);
+    tcase_add_test(tc10, test_sparse_sorted);
+    tcase_add_test(tc10, test_sparse_pinned_reads);
+    tcase_add_test(tc10, test_sparse_column_families);
+    tcase_add_test(tc10, test_sparse_encoding);
+    tcase_add_test(tc10, test_sparse_expire);
+    tcase_add_test(tc10, test_sparse_size_keys);
+    tcase_add_test(tc10, test_sparse_batch);
+    tcase_add_test(tc10, test_sparse_hash_meta);
     tcase_add_test(tc10, test_sparse_convert);
 
+    suite_add_tcase(s1, tc11);
+    tcase_add_test(tc11, test_hash_names);
+    tcase_add_test(tc11, test_hash_murmur3);
+    tcase_add_test(tc11, test_hash_xxh64);
+
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
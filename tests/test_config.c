@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include "config.h"
+#include "hash.h"
 
 START_TEST(test_config_get_default)
 {
@@ -15,12 +16,12 @@ START_TEST(test_config_get_default)
     fail_unless(res == 0);
     fail_unless(config.tcp_port == 9007);
     fail_unless(config.udp_port == 4554);
-    fail_unless(strcmp(config.dense_dir, "/tmp/hlld/dense") == 0);
+    fail_unless(strcmp(config.data_dir, "/tmp/slidingd") == 0);
     fail_unless(strcmp(config.log_level, "INFO") == 0);
     fail_unless(config.syslog_log_level == LOG_INFO);
     fail_unless(config.default_eps == 0.01625);
     fail_unless(config.default_precision == 12);
-    fail_unless(config.flush_interval == 60);
+    fail_unless(config.flush_interval == 10);
     fail_unless(config.cold_interval == 3600);
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
@@ -37,12 +38,12 @@ START_TEST(test_config_bad_file)
     // Should get the defaults...
     fail_unless(config.tcp_port == 9007);
     fail_unless(config.udp_port == 4554);
-    fail_unless(strcmp(config.dense_dir, "/tmp/hlld/dense") == 0);
+    fail_unless(strcmp(config.data_dir, "/tmp/slidingd") == 0);
     fail_unless(strcmp(config.log_level, "INFO") == 0);
     fail_unless(config.syslog_log_level == LOG_INFO);
     fail_unless(config.default_eps == 0.01625);
     fail_unless(config.default_precision == 12);
-    fail_unless(config.flush_interval == 60);
+    fail_unless(config.flush_interval == 10);
     fail_unless(config.cold_interval == 3600);
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
@@ -63,12 +64,12 @@ START_TEST(test_config_empty_file)
     // Should get the defaults...
     fail_unless(config.tcp_port == 9007);
     fail_unless(config.udp_port == 4554);
-    fail_unless(strcmp(config.dense_dir, "/tmp/hlld/dense") == 0);
+    fail_unless(strcmp(config.data_dir, "/tmp/slidingd") == 0);
     fail_unless(strcmp(config.log_level, "INFO") == 0);
     fail_unless(config.syslog_log_level == LOG_INFO);
     fail_unless(config.default_eps == 0.01625);
     fail_unless(config.default_precision == 12);
-    fail_unless(config.flush_interval == 60);
+    fail_unless(config.flush_interval == 10);
     fail_unless(config.cold_interval == 3600);
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
@@ -88,8 +89,7 @@ flush_interval = 120\n\
 cold_interval = 12000\n\
 in_memory = 1\n\
 default_eps = 0.05\n\
-dense_dir = /tmp/test/dense\n\
-sparse_dir = /tmp/test/sparse\n\
+data_dir = /tmp/test\n\
 workers = 2\n\
 use_mmap = 1\n\
 log_level = INFO\n";
@@ -104,8 +104,7 @@ log_level = INFO\n";
     // Should get the config
     fail_unless(config.tcp_port == 10000);
     fail_unless(config.udp_port == 10001);
-    fail_unless(strcmp(config.dense_dir, "/tmp/test/dense") == 0);
-    fail_unless(strcmp(config.sparse_dir, "/tmp/test/sparse") == 0);
+    fail_unless(strcmp(config.data_dir, "/tmp/test") == 0);
     fail_unless(strcmp(config.log_level, "INFO") == 0);
     fail_unless(config.default_eps - 0.045961941 < 0.0001, "EPS %f", config.default_eps);
     fail_unless(config.default_precision == 9, "PREC %d", config.default_precision);
@@ -129,8 +128,7 @@ flush_interval = 120\n\
 cold_interval = 12000\n\
 in_memory = 1\n\
 default_precision = 14\n\
-dense_dir = /tmp/test/dense\n\
-sparse_dir = /tmp/test/sparse\n\
+data_dir = /tmp/test\n\
 workers = 2\n\
 use_mmap = 1\n\
 log_level = INFO\n";
@@ -145,8 +143,7 @@ log_level = INFO\n";
     // Should get the config
     fail_unless(config.tcp_port == 10000);
     fail_unless(config.udp_port == 10001);
-    fail_unless(strcmp(config.dense_dir, "/tmp/test/dense") == 0);
-    fail_unless(strcmp(config.sparse_dir, "/tmp/test/sparse") == 0);
+    fail_unless(strcmp(config.data_dir, "/tmp/test") == 0);
     fail_unless(strcmp(config.log_level, "INFO") == 0);
     fail_unless(config.default_precision == 14, "PREC %d", config.default_precision);
     fail_unless(config.default_eps == .008125, "EPS %f", config.default_eps);
@@ -294,6 +291,38 @@ START_TEST(test_sane_worker_threads)
 }
 END_TEST
 
+START_TEST(test_sane_hash)
+{
+    int algorithm;
+    fail_unless(sane_hash((char*)"murmur3", &algorithm) == 0);
+    fail_unless(algorithm == HASH_MURMUR3);
+    fail_unless(sane_hash((char*)"xxh64", &algorithm) == 0);
+    fail_unless(algorithm == HASH_XXH64);
+    fail_unless(sane_hash((char*)"md5", &algorithm) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_durability)
+{
+    int level;
+    fail_unless(sane_durability((char*)"none", &level) == 0);
+    fail_unless(level == DURABILITY_NONE);
+    fail_unless(sane_durability((char*)"async", &level) == 0);
+    fail_unless(level == DURABILITY_ASYNC);
+    fail_unless(sane_durability((char*)"SYNC", &level) == 0);
+    fail_unless(level == DURABILITY_SYNC);
+    fail_unless(sane_durability((char*)"fsync", &level) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_sparse_cache_memory)
+{
+    fail_unless(sane_sparse_cache_memory(-1) == 1);
+    fail_unless(sane_sparse_cache_memory(0) == 0);
+    fail_unless(sane_sparse_cache_memory(67108864) == 0);
+}
+END_TEST
+
 START_TEST(test_set_config_bad_file)
 {
     hlld_set_config config;
@@ -0,0 +1,44 @@
+#include <check.h>
+#include <string.h>
+#include "hash.h"
+
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+START_TEST(test_hash_names)
+{
+    fail_unless(hash_algorithm_from_name("murmur3") == HASH_MURMUR3);
+    fail_unless(hash_algorithm_from_name("XXH64") == HASH_XXH64);
+    fail_unless(hash_algorithm_from_name("md5") == -1);
+    fail_unless(strcmp(hash_algorithm_name(HASH_XXH64), "xxh64") == 0);
+    fail_unless(hash_current_algorithm() == HASH_MURMUR3);
+}
+END_TEST
+
+START_TEST(test_hash_murmur3)
+{
+    // Must match the values stored before hashes were pluggable
+    const char *key = "test_hash_murmur3";
+    uint64_t out[2];
+    MurmurHash3_x64_128(key, strlen(key), 0, &out);
+    fail_unless(hash_value_with(HASH_MURMUR3, key, strlen(key)) == out[1]);
+    fail_unless(hash_value(key, strlen(key)) == out[1]);
+}
+END_TEST
+
+START_TEST(test_hash_xxh64)
+{
+    // Reference values from the xxHash test vectors
+    fail_unless(hash_value_with(HASH_XXH64, "", 0) == 0xEF46DB3751D8E999ULL);
+    fail_unless(hash_value_with(HASH_XXH64, "a", 1) == 0xD24EC4F1A98C6E5BULL);
+    fail_unless(hash_value_with(HASH_XXH64, "abc", 3) == 0x44BC2CF5AD770999ULL);
+    const char *longer = "Nobody inspects the spammish repetition";
+    fail_unless(hash_value_with(HASH_XXH64, longer, strlen(longer)) == 0xFBCEA83C8A378BF1ULL);
+
+    // Only the given length is hashed
+    fail_unless(hash_value_with(HASH_XXH64, "abcdef", 3) == 0x44BC2CF5AD770999ULL);
+
+    hash_use_algorithm(HASH_XXH64);
+    fail_unless(hash_value("abc", 3) == 0x44BC2CF5AD770999ULL);
+    hash_use_algorithm(HASH_MURMUR3);
+}
+END_TEST
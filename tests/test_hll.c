@@ -6,6 +6,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <math.h>
+#include <string.h>
 #include "hll.h"
 
 START_TEST(test_hll_init_bad)
@@ -109,6 +111,39 @@ START_TEST(test_hll_error_bound)
 }
 END_TEST
 
+START_TEST(test_hll_sum_kernels)
+{
+    // Odd length so the SIMD kernels also take the scalar tail
+    int num_reg = NUM_REG(12) + 7;
+    unsigned char *regs = (unsigned char*)malloc(num_reg);
+    double expected = 0;
+    int expected_zero = 0;
+    for (int i=0; i < num_reg; i++) {
+        regs[i] = (i % 3 == 0) ? 0 : rand() % 52;
+        expected += pow(2.0, -1 * regs[i]);
+        if (!regs[i]) expected_zero++;
+    }
+
+    const char *kernels[] = {"scalar", "sse4.1", "avx2"};
+    for (int i=0; i < 3; i++) {
+        // Skip kernels this CPU cannot run
+        if (hll_use_sum_kernel(kernels[i])) continue;
+        fail_unless(strcmp(hll_sum_kernel_name(), kernels[i]) == 0);
+
+        double inv_sum = 0;
+        int num_zero = 0;
+        hll_sum_registers(regs, num_reg, &inv_sum, &num_zero);
+        fail_unless(fabs(inv_sum - expected) < 1e-9 * expected);
+        fail_unless(num_zero == expected_zero);
+    }
+
+    fail_unless(hll_use_sum_kernel("bogus") == -1);
+    fail_unless(hll_use_sum_kernel("scalar") == 0);
+    fail_unless(hll_use_sum_kernel(NULL) == 0);
+    free(regs);
+}
+END_TEST
+
 START_TEST(test_hll_precision_for_error)
 {
     fail_unless(hll_precision_for_error(1.0) == -1);
@@ -9,13 +9,12 @@ START_TEST(test_hll_serialize)
     
     hll_t h, h_unserialize;
     fail_unless(hll_init(HLL_MIN_PRECISION, 100+(1<<12), 12, &h) == 0);
-    serialize_hll(&s, &h, (char *)"test1!", 6);
+    fail_unless(serialize_hll(&s, &h) == 0);
+    fail_unless(s.offset == serialized_hll_size(&h));
     fail_unless(hll_destroy(&h) == 0);
 
     s.offset = 0;
-    char *out_str;
-    int out_len;
-    fail_unless(unserialize_hll(&s, &h_unserialize, &out_str, &out_len) == 0);
+    fail_unless(unserialize_hll(&s, &h_unserialize) == 0);
 
     fail_unless(h_unserialize.precision == HLL_MIN_PRECISION);
     fail_unless(h_unserialize.window_period == 100+(1<<12));
@@ -29,18 +28,46 @@ START_TEST(test_serialize_register)
     unsigned char buf[2048];
     serialize_t s = { buf, 0, 2048 };
     
-    hll_register r = {0, 0, NULL}, r_unserialize;
+    hll_t h;
+    fail_unless(hll_init(HLL_MIN_PRECISION, 100, 1, &h) == 0);
     hll_dense_point p = {13, 19};
-    hll_register_add_point(&r, p);
+    hll_register_add_point(&h, hll_create_register(&h, 0), p);
 
-    serialize_hll_register(&s, &r);
+    serialize_hll_register(&s, &h, 0);
 
     s.offset = 0;
-    fail_unless(unserialize_hll_register(&s, &r_unserialize) == 0);
-    fail_unless(r_unserialize.size == 1);
-    fail_unless(r_unserialize.points[0].timestamp == 13);
-    fail_unless(r_unserialize.points[0].register_ == 19);
+    fail_unless(unserialize_hll_register(&s, &h, 1) == 0);
+    hll_register *r_unserialize = hll_find_register(&h, 1);
+    fail_unless(r_unserialize->size == 1);
+    fail_unless(hll_register_points(&h, r_unserialize)[0].timestamp == 13);
+    fail_unless(hll_register_points(&h, r_unserialize)[0].register_ == 19);
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_serialize_register_epoch)
+{
+    unsigned char buf[2048];
+    serialize_t s = { buf, 0, 2048 };
+
+    // Points are relative to the epoch, but written as absolute times
+    hll_t h, h_unserialize;
+    fail_unless(hll_init(HLL_MIN_PRECISION, 100, 1, &h) == 0);
+    fail_unless(hll_init(HLL_MIN_PRECISION, 100, 1, &h_unserialize) == 0);
+    h.epoch = 1000;
+    h_unserialize.epoch = 900;
+    hll_dense_point p = {13, 19};
+    hll_register_add_point(&h, hll_create_register(&h, 0), p);
+    serialize_hll_register(&s, &h, 0);
 
+    s.offset = 0;
+    fail_unless(unserialize_hll_register(&s, &h_unserialize, 0) == 0);
+    hll_register *r_unserialize = hll_find_register(&h_unserialize, 0);
+    fail_unless(r_unserialize->size == 1);
+    fail_unless(hll_register_points(&h_unserialize, r_unserialize)[0].timestamp == 113);
+    fail_unless(hll_register_points(&h_unserialize, r_unserialize)[0].register_ == 19);
+    fail_unless(hll_destroy(&h) == 0);
+    fail_unless(hll_destroy(&h_unserialize) == 0);
 }
 END_TEST
 
@@ -52,32 +79,33 @@ START_TEST(test_hll_serialize_registers)
     hll_t h, h_unserialize;
     fail_unless(hll_init(HLL_MIN_PRECISION, 100, 1, &h) == 0);
 
-    hll_dense_point p = {2, 2};
-    hll_register_add_point(&h.dense_registers[0], p);
+    hll_dense_point p = {1, 2};
+    hll_register_add_point(&h, hll_create_register(&h, 0), p);
     p.register_ = 1;
-    p.timestamp = 1;
-    hll_register_add_point(&h.dense_registers[0], p);
+    p.timestamp = 2;
+    hll_register_add_point(&h, hll_create_register(&h, 0), p);
     p.register_ = 2;
-    hll_register_add_point(&h.dense_registers[1], p);
-    serialize_hll(&s, &h, (char *)"test!", 5);
+    hll_register_add_point(&h, hll_create_register(&h, 1), p);
+    fail_unless(serialize_hll(&s, &h) == 0);
+    fail_unless(s.offset <= serialized_hll_size(&h));
     fail_unless(hll_destroy(&h) == 0);
 
+    // The version leads, little-endian
+    fail_unless(buf[0] == 4 && buf[1] == 0 && buf[2] == 0 && buf[3] == 0);
+
     s.offset = 0;
+    fail_unless(unserialize_hll(&s, &h_unserialize) == 0);
 
-    char *out_str;
-    int out_len;
-    fail_unless(unserialize_hll(&s, &h_unserialize, &out_str, &out_len) == 0);
-
-    fail_unless(out_len == 5);
-    fail_unless(memcmp(out_str, "test!", 5) == 0);
-    fail_unless(h_unserialize.dense_registers[0].size == 2);
-    fail_unless(h_unserialize.dense_registers[1].size == 1);
-    fail_unless(h_unserialize.dense_registers[0].points[0].register_ == 2);
-    fail_unless(h_unserialize.dense_registers[0].points[0].timestamp == 2);
-    fail_unless(h_unserialize.dense_registers[0].points[1].register_ == 1);
-    fail_unless(h_unserialize.dense_registers[0].points[1].timestamp == 1);
-    fail_unless(h_unserialize.dense_registers[1].points[0].register_ == 2);
-    fail_unless(h_unserialize.dense_registers[1].points[0].timestamp == 1);
+    fail_unless(hll_find_register(&h_unserialize, 0)->size == 2);
+    fail_unless(hll_find_register(&h_unserialize, 1)->size == 1);
+    hll_dense_point *points = hll_register_points(&h_unserialize, hll_find_register(&h_unserialize, 0));
+    fail_unless(points[0].register_ == 2);
+    fail_unless(points[0].timestamp == 1);
+    fail_unless(points[1].register_ == 1);
+    fail_unless(points[1].timestamp == 2);
+    points = hll_register_points(&h_unserialize, hll_find_register(&h_unserialize, 1));
+    fail_unless(points[0].register_ == 2);
+    fail_unless(points[0].timestamp == 2);
 
     fail_unless(h_unserialize.precision == HLL_MIN_PRECISION);
     fail_unless(h_unserialize.window_period == 100);
@@ -86,6 +114,144 @@ START_TEST(test_hll_serialize_registers)
 }
 END_TEST
 
+START_TEST(test_hll_serialize_v2)
+{
+    unsigned char buf[2048];
+    serialize_t s = { buf, 0, 2048 };
+
+    // Write a set the way version 2 did, point by point
+    hll_t h, h_unserialize;
+    fail_unless(hll_init(HLL_MIN_PRECISION, 100, 1, &h) == 0);
+    hll_dense_point p = {1, 2};
+    hll_register_add_point(&h, hll_create_register(&h, 0), p);
+    p.register_ = 1;
+    p.timestamp = 2;
+    hll_register_add_point(&h, hll_create_register(&h, 0), p);
+    hll_register_add_point(&h, hll_create_register(&h, 5), p);
+    fail_unless(serialize_int(&s, 2) == 0);
+    fail_unless(serialize_int(&s, HLL_MIN_PRECISION) == 0);
+    fail_unless(serialize_int(&s, 100) == 0);
+    fail_unless(serialize_int(&s, 1) == 0);
+    for (int i=0; i < NUM_REG(HLL_MIN_PRECISION); i++) {
+        fail_unless(serialize_hll_register(&s, &h, i) == 0);
+    }
+    time_t epoch = h.epoch;
+    fail_unless(hll_destroy(&h) == 0);
+
+    s.size = s.offset;
+    s.offset = 0;
+    fail_unless(unserialize_hll(&s, &h_unserialize) == 0);
+    fail_unless(h_unserialize.window_period == 100);
+    fail_unless(hll_find_register(&h_unserialize, 0)->size == 2);
+    fail_unless(hll_find_register(&h_unserialize, 5)->size == 1);
+    fail_unless(hll_find_register(&h_unserialize, 1) == NULL);
+    hll_dense_point *points = hll_register_points(&h_unserialize, hll_find_register(&h_unserialize, 0));
+    fail_unless(h_unserialize.epoch + points[1].timestamp == epoch + 2);
+    fail_unless(points[1].register_ == 1);
+
+    // Rewriting it upgrades to the current version
+    unsigned char buf2[2048];
+    serialize_t s2 = { buf2, 0, 2048 };
+    fail_unless(serialize_hll(&s2, &h_unserialize) == 0);
+    fail_unless(s2.offset < s.size);
+    fail_unless(hll_destroy(&h_unserialize) == 0);
+
+    s2.size = s2.offset;
+    s2.offset = 0;
+    fail_unless(unserialize_hll(&s2, &h_unserialize) == 0);
+    fail_unless(hll_find_register(&h_unserialize, 0)->size == 2);
+    fail_unless(hll_find_register(&h_unserialize, 5)->size == 1);
+    fail_unless(hll_destroy(&h_unserialize) == 0);
+
+    // Truncated sets are rejected
+    s2.size -= 1;
+    s2.offset = 0;
+    fail_unless(unserialize_hll(&s2, &h_unserialize) == -1);
+}
+END_TEST
+
+START_TEST(test_hll_serialize_v3)
+{
+    // Header, register sizes, timestamps, then registers
+    unsigned char buf[28 + 2 * 16 + 5 * 2] = {
+        3, 0, 0, 0, 4, 0, 0, 0, 100, 0, 0, 0, 1, 0, 0, 0,
+        0xe8, 0x03, 0, 0, 0, 0, 0, 0,
+        2, 0, 0, 0,
+    };
+    buf[28 + 2 * 3] = 2;
+    buf[60] = 5;
+    buf[64] = 7;
+    buf[68] = 3;
+    buf[69] = 2;
+    serialize_t s = { buf, 0, sizeof(buf) };
+
+    hll_t h;
+    fail_unless(unserialize_hll(&s, &h) == 0);
+    fail_unless(s.offset == sizeof(buf));
+    fail_unless(h.precision == HLL_MIN_PRECISION);
+    fail_unless(h.window_period == 100);
+    fail_unless(h.epoch == 1000);
+    fail_unless(hll_find_register(&h, 0) == NULL);
+    fail_unless(hll_find_register(&h, 3)->size == 2);
+    hll_dense_point *points = hll_register_points(&h, hll_find_register(&h, 3));
+    fail_unless(points[0].timestamp == 5);
+    fail_unless(points[0].register_ == 3);
+    fail_unless(points[1].timestamp == 7);
+    fail_unless(points[1].register_ == 2);
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_serialize_compressed)
+{
+    hll_t h, h_unserialize;
+    fail_unless(hll_init(12, 86400, 60, &h) == 0);
+    time_t now = h.epoch;
+    for (uint64_t i=0; i < 50000; i++) {
+        uint64_t hash = (i + 1) * 0x9E3779B97F4A7C15ULL;
+        hll_add_hash_at_time(&h, hash, now - 3600 + (time_t)(i % 3600));
+    }
+
+    size_t size = serialized_hll_size(&h);
+    unsigned char *buf = (unsigned char*)malloc(size);
+    serialize_t s = { buf, 0, size };
+    fail_unless(serialize_hll(&s, &h) == 0);
+
+    // Much smaller than 5 bytes a point
+    uint64_t total = 0;
+    for (int i=0; i < NUM_REG(12); i++) {
+        hll_register *r = hll_find_register(&h, i);
+        if (r) total += r->size;
+    }
+    fail_unless(s.offset < 28 + 2 * NUM_REG(12) + 5 * total);
+
+    s.size = s.offset;
+    s.offset = 0;
+    fail_unless(unserialize_hll(&s, &h_unserialize) == 0);
+    fail_unless(s.offset == s.size);
+    for (int i=0; i < NUM_REG(12); i++) {
+        hll_register *r = hll_find_register(&h, i);
+        hll_register *r2 = hll_find_register(&h_unserialize, i);
+        if (!r || !r->size) {
+            fail_unless(!r2 || !r2->size);
+            continue;
+        }
+        fail_unless(r2->size == r->size);
+        hll_dense_point *points = hll_register_points(&h, r);
+        hll_dense_point *points2 = hll_register_points(&h_unserialize, r2);
+        for (int j=0; j < r->size; j++) {
+            fail_unless(points2[j].timestamp == points[j].timestamp);
+            fail_unless(points2[j].register_ == points[j].register_);
+        }
+    }
+    fail_unless(hll_size_total(&h) == hll_size_total(&h_unserialize));
+
+    fail_unless(hll_destroy(&h) == 0);
+    fail_unless(hll_destroy(&h_unserialize) == 0);
+    free(buf);
+}
+END_TEST
+
 START_TEST(test_serialize_primitives)
 {
     unsigned char buf[2048];
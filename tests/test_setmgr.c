@@ -10,6 +10,7 @@
 #include "config.h"
 #include "set.h"
 #include "set_manager.h"
+#include "hash.h"
 
 char *sample_keys[] = {
   (char *)"a", (char *)"b", (char *)"c", (char *)"d", (char *)"e", (char *)"f",
@@ -44,7 +45,7 @@ START_TEST(test_mgr_create_drop)
     res = init_set_manager(&config, 0, &mgr);
     fail_unless(res == 0);
 
-    res = setmgr_set_keys(mgr, (char*)"foo1", 4, sample_keys, 1, time(NULL));
+    res = setmgr_set_keys(mgr, (char*)"foo1", 4, sample_keys, NULL, 1, time(NULL));
     fail_unless(res == 0);
 
     res = setmgr_drop_set(mgr, (char*)"foo1", 4);
@@ -65,7 +66,7 @@ START_TEST(test_mgr_create_double_drop)
     res = init_set_manager(&config, 0, &mgr);
     fail_unless(res == 0);
 
-    res = setmgr_set_keys(mgr, (char*)"dub1", 4, sample_keys, 1, time(NULL));
+    res = setmgr_set_keys(mgr, (char*)"dub1", 4, sample_keys, NULL, 1, time(NULL));
     fail_unless(res == 0);
 
     res = setmgr_drop_set(mgr, (char*)"dub1", 4);
@@ -215,7 +216,7 @@ START_TEST(test_mgr_add_keys)
     fail_unless(res == 0);
 
     char *keys[] = {(char*)"hey",(char*)"there",(char*)"person"};
-    res = setmgr_set_keys(mgr, (char*)"zab1", 4, (char**)&keys, 3, time(NULL));
+    res = setmgr_set_keys(mgr, (char*)"zab1", 4, (char**)&keys, NULL, 3, time(NULL));
     fail_unless(res == 0);
 
     res = setmgr_drop_set(mgr, (char*)"zab1", 4);
@@ -226,6 +227,85 @@ START_TEST(test_mgr_add_keys)
 }
 END_TEST
 
+START_TEST(test_mgr_add_hashes)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Client hashes are stored as given, so repeats are not counted
+    uint64_t hashes[] = {123, 456, 789, 123};
+    res = setmgr_set_hashes(mgr, (char*)"hash1", 5, hashes, 4, time(NULL));
+    fail_unless(res == 0);
+
+    uint64_t est;
+    res = setmgr_set_size(mgr, (char*)"hash1", 5, &est, time(NULL), 60);
+    fail_unless(res == 0);
+    fail_unless(est == 3);
+
+    res = setmgr_drop_set(mgr, (char*)"hash1", 5);
+    fail_unless(res == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_background_convert)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    setmgr_drop_set(mgr, (char*)"conv1", 5);
+
+    // Grow the set past the sparse limit, it is only queued
+    time_t now = time(NULL);
+    uint64_t hashes[MULTI_OP_SIZE];
+    int num_hashes = 0;
+    for (int i = 0; num_hashes <= SPARSE_MAX_VALUES; i++) {
+        for (int j = 0; j < MULTI_OP_SIZE; j++) {
+            hashes[j] = hash_value(&num_hashes, sizeof(num_hashes));
+            num_hashes++;
+        }
+        res = setmgr_set_hashes(mgr, (char*)"conv1", 5, hashes, MULTI_OP_SIZE, now);
+        fail_unless(res == 0);
+    }
+
+    // Still sparse, so the count is exact
+    uint64_t est;
+    res = setmgr_set_size(mgr, (char*)"conv1", 5, &est, now, 60);
+    fail_unless(res == 0);
+    fail_unless(est == (uint64_t)num_hashes);
+
+    fail_unless(setmgr_convert_sets(mgr) == 1);
+    fail_unless(setmgr_convert_sets(mgr) == 0);
+
+    // Dense now, every point was carried over
+    res = setmgr_set_size(mgr, (char*)"conv1", 5, &est, now, 60);
+    fail_unless(res == 0);
+    fail_unless(est > num_hashes * 0.95 && est < num_hashes * 1.05);
+
+    res = setmgr_set_hashes(mgr, (char*)"conv1", 5, hashes, 1, now);
+    fail_unless(res == 0);
+    fail_unless(setmgr_convert_sets(mgr) == 0);
+
+    res = setmgr_drop_set(mgr, (char*)"conv1", 5);
+    fail_unless(res == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_mgr_add_no_set)
 {
     hlld_config config;
@@ -237,7 +317,7 @@ START_TEST(test_mgr_add_no_set)
     fail_unless(res == 0);
 
     char *keys[] = {(char*)"hey",(char*)"there",(char*)"person"};
-    res = setmgr_set_keys(mgr, (char*)"noop1", 5, (char**)&keys, 3, time(NULL));
+    res = setmgr_set_keys(mgr, (char*)"noop1", 5, (char**)&keys, NULL, 3, time(NULL));
     fail_unless(res == 0);
 
     res = setmgr_drop_set(mgr, (char*)"noop1", 5);
@@ -641,7 +721,7 @@ START_TEST(test_mgr_restore)
     fail_unless(res == 0);
 
     char *keys[] = {(char*)"hey",(char*)"there",(char*)"person"};
-    res = setmgr_set_keys(mgr, (char*)"zab8", 4, (char**)&keys, 3, time(NULL));
+    res = setmgr_set_keys(mgr, (char*)"zab8", 4, (char**)&keys, NULL, 3, time(NULL));
     fail_unless(res == 0);
 
     // Shutdown
@@ -685,11 +765,22 @@ START_TEST(test_mgr_callback)
     res = init_set_manager(&config, 0, &mgr);
     fail_unless(res == 0);
 
-    res = setmgr_set_keys(mgr, (char*)"cb1", 3, sample_keys, SPARSE_MAX_VALUES + 1, time(NULL));
-    fail_unless(res == 0);
+    // Grow the set past the sparse limit, and convert it
+    uint64_t hashes[MULTI_OP_SIZE];
+    int num_hashes = 0;
+    while (num_hashes <= SPARSE_MAX_VALUES) {
+        for (int j = 0; j < MULTI_OP_SIZE; j++) {
+            hashes[j] = hash_value(&num_hashes, sizeof(num_hashes));
+            num_hashes++;
+        }
+        res = setmgr_set_hashes(mgr, (char*)"cb1", 3, hashes, MULTI_OP_SIZE, time(NULL));
+        fail_unless(res == 0);
+    }
+    fail_unless(setmgr_convert_sets(mgr) == 1);
 
     int val = 0;
-    res = setmgr_set_cb(mgr, (char*)"cb1", 3, test_mgr_cb, &val);
+    res = setmgr_dense_set_cb(mgr, (char*)"cb1", 3, test_mgr_cb, &val);
+    fail_unless(res == 0);
     fail_unless(val == 1);
 
     res = setmgr_drop_set(mgr, (char*)"cb1", 3);
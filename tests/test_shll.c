@@ -1,4 +1,6 @@
 #include <check.h>
+#include <stdlib.h>
+#include <string.h>
 #include "hll.h"
 
 START_TEST(test_shll_init_and_destroy)
@@ -15,13 +17,89 @@ START_TEST(test_shll_add_register)
     fail_unless(hll_init(10, 100, 1, &h) == 0);
     hll_dense_point p = {100, 3};
     fail_unless(h.precision == 10);
-    hll_register_add_point(&h.dense_registers[0], p);
-    fail_unless(h.dense_registers[0].size == 1);
+    hll_register_add_point(&h, hll_create_register(&h, 0), p);
+    fail_unless(hll_find_register(&h, 0)->size == 1);
 
     fail_unless(hll_destroy(&h) == 0);
 }
 END_TEST
 
+START_TEST(test_shll_lazy_registers)
+{
+    fail_unless(sizeof(hll_register) <= 8);
+
+    hll_t h;
+    fail_unless(hll_init(18, 100, 1, &h) == 0);
+    fail_unless(hll_find_register(&h, 12345) == NULL);
+    fail_unless(hll_get_register(&h, 12345, 100, 100) == 0);
+
+    // Only the registers that were written get a header
+    uint64_t hashes[] = {0, 1ULL << 63, 1ULL << 62, 1ULL << 63 | 1};
+    for (int i=0; i < 4; i++) {
+        hll_add_hash_at_time(&h, hashes[i], 100);
+    }
+    int present = 0;
+    for (int i=0; i < NUM_REG(18) / HLL_BLOCK_REGISTERS; i++) {
+        present += __builtin_popcountll(h.register_blocks[i].present);
+    }
+    fail_unless(present == 3);
+    fail_unless(hll_find_register(&h, 0) != NULL);
+    fail_unless(hll_find_register(&h, 1 << 17) != NULL);
+    fail_unless(hll_find_register(&h, 1 << 16) != NULL);
+    fail_unless(hll_find_register(&h, 1) == NULL);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_shll_point_offset)
+{
+    fail_unless(sizeof(hll_dense_point) <= 8);
+
+    fail_unless(hll_time_offset(1000, 1100) == 100);
+    fail_unless(hll_time_offset(1000, 900) == -100);
+    fail_unless(hll_time_offset(0, (time_t)1 << 40) == INT32_MAX);
+    fail_unless(hll_time_offset((time_t)1 << 40, 0) == INT32_MIN);
+}
+END_TEST
+
+START_TEST(test_shll_add_hashes)
+{
+    hll_t h, h_single;
+    fail_unless(hll_init(10, 100, 1, &h) == 0);
+    fail_unless(hll_init(10, 100, 1, &h_single) == 0);
+
+    // Batches should match adding the hashes one at a time,
+    // including several hashes landing in one register
+    uint64_t hashes[200];
+    uint64_t x = 42;
+    for (int i=0; i < 200; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        hashes[i] = x;
+    }
+    for (int t=0; t < 4; t++) {
+        hll_add_hashes_at_time(&h, hashes + 50*t, 50, 1000 + t);
+        for (int i=0; i < 50; i++) {
+            hll_add_hash_at_time(&h_single, hashes[50*t + i], 1000 + t);
+        }
+    }
+
+    for (int i=0; i < NUM_REG(10); i++) {
+        hll_register *r = hll_find_register(&h, i);
+        hll_register *r_single = hll_find_register(&h_single, i);
+        fail_unless((r == NULL) == (r_single == NULL));
+        if (!r) continue;
+        fail_unless(r->size == r_single->size);
+        for (int w=0; w < 4; w++) {
+            fail_unless(hll_get_register(&h, i, 1003, w) == hll_get_register(&h_single, i, 1003, w));
+        }
+    }
+
+    fail_unless(hll_destroy(&h) == 0);
+    fail_unless(hll_destroy(&h_single) == 0);
+}
+END_TEST
+
 START_TEST(test_shll_remove_smaller)
 {
     hll_t h;
@@ -30,10 +108,10 @@ START_TEST(test_shll_remove_smaller)
     int points_leading_value[] = {8, 9, 6, 6, 7, 4, 5, 2, 9, 1, 5};
     int expected_size[] = {1, 1, 2, 2, 2, 3, 3, 4, 1, 2, 2};
 
-    hll_register *r = &h.dense_registers[0];
+    hll_register *r = hll_create_register(&h, 0);
     for(int i=0; i<num_points; i++) {
-        hll_dense_point p = {100, points_leading_value[i]};
-        hll_register_add_point(r, p);
+        hll_dense_point p = {100+i, (unsigned char)points_leading_value[i]};
+        hll_register_add_point(&h, r, p);
         fail_unless(r->size == expected_size[i]);
     }
 
@@ -49,10 +127,10 @@ START_TEST(test_shll_remove_time)
     int points_time[] = {100, 200, 299, 300, 301, 302};
     int expected_size[] = {1, 1, 2, 2, 3, 4};
 
-    hll_register *r = &h.dense_registers[0];
+    hll_register *r = hll_create_register(&h, 0);
     for(int i=0; i<num_points; i++) {
-        hll_dense_point p = {points_time[i], num_points-i};
-        hll_register_add_point(r, p);
+        hll_dense_point p = {points_time[i], (unsigned char)(num_points-i)};
+        hll_register_add_point(&h, r, p);
         fail_unless(r->size == expected_size[i]);
     }
 
@@ -60,6 +138,129 @@ START_TEST(test_shll_remove_time)
 }
 END_TEST
 
+START_TEST(test_shll_skip_dominated)
+{
+    hll_t h;
+    fail_unless(hll_init(10, 100, 1, &h) == 0);
+    hll_register *r = hll_create_register(&h, 0);
+
+    hll_dense_point p1 = {100, 5};
+    hll_register_add_point(&h, r, p1);
+
+    // Same time and smaller or equal value adds nothing
+    hll_dense_point p2 = {100, 5};
+    hll_register_add_point(&h, r, p2);
+    hll_dense_point p3 = {100, 3};
+    hll_register_add_point(&h, r, p3);
+    fail_unless(r->size == 1);
+
+    // An older point with a larger value must not drop the newer one
+    hll_dense_point p4 = {50, 7};
+    hll_register_add_point(&h, r, p4);
+    fail_unless(r->size == 2);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_shll_ordered_register)
+{
+    hll_t h;
+    fail_unless(hll_init(10, 1000, 1, &h) == 0);
+    hll_register *r = hll_create_register(&h, 0);
+
+    // Insert out of order, including points that
+    // dominate or are dominated by existing ones
+    int times[] = {100, 300, 200, 250, 400, 150, 300, 50};
+    int values[] = {9, 5, 7, 3, 2, 8, 6, 10};
+    for (int i=0; i < 8; i++) {
+        hll_dense_point p = {times[i], (unsigned char)values[i]};
+        hll_register_add_point(&h, r, p);
+    }
+
+    // Sorted by time, with strictly decreasing values
+    int expect_times[] = {50, 100, 150, 200, 300, 400};
+    int expect_values[] = {10, 9, 8, 7, 6, 2};
+    fail_unless(r->size == 6);
+    hll_dense_point *points = hll_register_points(&h, r);
+    for (int i=0; i < 6; i++) {
+        fail_unless(points[i].timestamp == expect_times[i]);
+        fail_unless(points[i].register_ == expect_values[i]);
+    }
+
+    // Normalizing an ordered register is a no-op
+    hll_register_normalize(&h, r);
+    fail_unless(r->size == 6);
+
+    // Normalizing restores order and drops dominated points
+    hll_dense_point unordered[] = {{300, 6}, {50, 10}, {400, 2}, {200, 7}, {250, 3}, {150, 8}, {200, 9}};
+    hll_register *r1 = hll_create_register(&h, 1);
+    fail_unless(hll_register_reserve(&h, r1, 7) == 0);
+    memcpy(hll_register_points(&h, r1), unordered, sizeof(unordered));
+    r1->size = 7;
+    hll_register_normalize(&h, r1);
+    int normal_times[] = {50, 200, 300, 400};
+    int normal_values[] = {10, 9, 6, 2};
+    fail_unless(r1->size == 4);
+    points = hll_register_points(&h, r1);
+    for (int i=0; i < 4; i++) {
+        fail_unless(points[i].timestamp == normal_times[i]);
+        fail_unless(points[i].register_ == normal_values[i]);
+    }
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_shll_register_lookup)
+{
+    hll_t h;
+    fail_unless(hll_init(10, 100000, 1, &h) == 0);
+    hll_register *r = hll_create_register(&h, 0);
+
+    // Register values from 40 down to 1, one per 100 seconds
+    for (int i=0; i < 40; i++) {
+        hll_dense_point p = {hll_time_offset(h.epoch, 10000 + 100*i), (unsigned char)(40-i)};
+        hll_register_add_point(&h, r, p);
+    }
+    fail_unless(r->size == 40);
+
+    // The window picks the oldest point inside it
+    fail_unless(hll_get_register(&h, 0, 13900, 0) == 1);
+    fail_unless(hll_get_register(&h, 0, 13950, 49) == 0);
+    fail_unless(hll_get_register(&h, 0, 13900, 150) == 2);
+    fail_unless(hll_get_register(&h, 0, 13900, 3900) == 40);
+    fail_unless(hll_get_register(&h, 0, 13900, 10000) == 40);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_shll_time_bucket)
+{
+    hll_t h;
+    fail_unless(hll_init(10, 3600, 60, &h) == 0);
+    fail_unless(hll_time_bucket(&h, 120) == 120);
+    fail_unless(hll_time_bucket(&h, 179) == 120);
+    fail_unless(hll_time_bucket(&h, -1) == -60);
+
+    // Every hash in the same minute lands in one bucket
+    for (int i=0; i < 60; i++) {
+        hll_add_hash_at_time(&h, 0, 600 + i);
+    }
+    hll_register *r = hll_create_register(&h, 0);
+    fail_unless(r->size == 1);
+    fail_unless(hll_register_points(&h, r)[0].timestamp == hll_time_offset(h.epoch, 600));
+
+    // Queries include the whole bucket the window starts in
+    fail_unless(hll_get_register(&h, 0, 700, 100) > 0);
+    fail_unless(hll_get_register(&h, 0, 759, 100) > 0);
+    fail_unless(hll_get_register(&h, 0, 760, 100) == 0);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
 START_TEST(test_shll_add_hash)
 {
     hll_t h;
@@ -78,24 +279,24 @@ START_TEST(test_shll_shrink_register)
     hll_t h;
     fail_unless(hll_init(10, 100, 1, &h) == 0);
 
-    hll_register *r = &h.dense_registers[0];
+    hll_register *r = hll_create_register(&h, 0);
     // add 100 points
     for(int i=0; i<100; i++) {
-        hll_dense_point p = {0, 100-i};
-        hll_register_add_point(r, p);
+        hll_dense_point p = {i, (unsigned char)(100-i)};
+        hll_register_add_point(&h, r, p);
         fail_unless(r->size == i+1);
     }
     // remove all points
     hll_dense_point p = {200, 1};
-    hll_register_add_point(r, p);
+    hll_register_add_point(&h, r, p);
     fail_unless(r->size == 1);
     // check that capacity was reduced appropriately
     fail_unless(r->size*1.5*1.5+1 >= r->capacity);
 
     // add all back and check bounds on capacity
     for(int i=0; i<100; i++) {
-        hll_dense_point p = {200, 100-i};
-        hll_register_add_point(r, p);
+        hll_dense_point p = {200+i, (unsigned char)(100-i)};
+        hll_register_add_point(&h, r, p);
         fail_unless(r->size == i+1);
         // check that capacity is bounded
         fail_unless(r->size*1.5*1.5+1 >= r->capacity);
@@ -106,6 +307,134 @@ START_TEST(test_shll_shrink_register)
 END_TEST
 
 
+START_TEST(test_shll_expire)
+{
+    hll_t h;
+    fail_unless(hll_init(10, 100, 1, &h) == 0);
+
+    // Spread points over registers in different blocks
+    hll_register *r0 = hll_create_register(&h, 0);
+    hll_register *r1 = hll_create_register(&h, HLL_BLOCK_REGISTERS);
+    for(int i=0; i<50; i++) {
+        hll_dense_point p = {hll_time_offset(h.epoch, 1000+i), (unsigned char)(60-i)};
+        hll_register_add_point(&h, r0, p);
+        hll_register_add_point(&h, r1, p);
+    }
+    fail_unless(r0->size == 50 && r1->size == 50);
+
+    // Only the point at 1000 is a full period old
+    fail_unless(hll_expire(&h, 1100) == 2);
+    fail_unless(r0->size == 49);
+
+    // Drop everything at or before 1040, capacity shrinks
+    fail_unless(hll_expire(&h, 1140) == 2*40);
+    fail_unless(r0->size == 9 && r1->size == 9);
+    fail_unless(r0->size*1.5*1.5+1 >= r0->capacity);
+
+    // Expiring everything frees the points
+    fail_unless(hll_expire(&h, 5000) == 2*9);
+    fail_unless(r0->size == 0 && r0->capacity == 0);
+    fail_unless(hll_size(&h, 5000, 100) == 0);
+
+    // Compaction drops the empty headers
+    fail_unless(hll_compact(&h) == 0);
+    fail_unless(hll_find_register(&h, 0) == NULL);
+    fail_unless(h.register_blocks[0].present == 0);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_shll_arena_compact)
+{
+    hll_t h;
+    fail_unless(hll_init(10, 1000, 1, &h) == 0);
+
+    // Grow a few registers past a couple of block sizes
+    for (int i=0; i < 20; i++) {
+        hll_dense_point p = {i, (unsigned char)(60-i)};
+        for (int j=0; j < 4; j++) {
+            hll_register_add_point(&h, hll_create_register(&h, j), p);
+        }
+    }
+    uint32_t used = h.arena.used;
+
+    // Blocks given back by a register are reused by others
+    hll_dense_point p = {100, 61};
+    hll_register_add_point(&h, hll_find_register(&h, 0), p);
+    fail_unless(hll_find_register(&h, 0)->size == 1);
+    hll_register_add_point(&h, hll_create_register(&h, 4), p);
+    fail_unless(h.arena.used == used);
+
+    // Compaction packs the registers back to back
+    fail_unless(hll_compact(&h) == 0);
+    fail_unless(h.arena.used == 1 + 3*32 + 1);
+    for (int j=1; j < 4; j++) {
+        hll_register *r = hll_find_register(&h, j);
+        fail_unless(r->size == 20);
+        for (int i=0; i < 20; i++) {
+            fail_unless(hll_register_points(&h, r)[i].timestamp == i);
+            fail_unless(hll_register_points(&h, r)[i].register_ == 60-i);
+        }
+    }
+    fail_unless(hll_register_points(&h, hll_find_register(&h, 4))[0].register_ == 61);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_shll_load_registers)
+{
+    hll_t h;
+    fail_unless(hll_init(7, 1000, 1, &h) == 0);
+
+    // Registers 1, 3 and 70 have points
+    unsigned char bitmap[16] = {0x0a, 0, 0, 0, 0, 0, 0, 0, 0x40};
+    fail_unless(hll_load_begin(&h, bitmap, 4) == 0);
+    fail_unless(h.num_loaded_registers == 3);
+    fail_unless(h.arena.capacity == 4);
+    fail_unless(hll_find_register(&h, 0) == NULL);
+    fail_unless(hll_find_register(&h, 1) == h.loaded_registers);
+    fail_unless(hll_find_register(&h, 70) == h.loaded_registers + 2);
+
+    // Loaded registers take blocks of their exact size
+    hll_dense_point p = {10, 5};
+    fail_unless(hll_register_load(&h, hll_find_register(&h, 1), 3) == 0);
+    fail_unless(hll_find_register(&h, 1)->capacity == 3);
+    for (int i=0; i < 3; i++) {
+        hll_register_points(&h, hll_find_register(&h, 1))[i] = p;
+    }
+    hll_find_register(&h, 1)->size = 3;
+    fail_unless(hll_register_load(&h, hll_find_register(&h, 70), 1) == 0);
+    hll_find_register(&h, 70)->size = 1;
+    fail_unless(h.arena.used == 4);
+    hll_load_end(&h);
+    fail_unless(h.arena.capacity == 4);
+
+    // Growing moves a loaded register into a power of two block
+    fail_unless(hll_register_reserve(&h, hll_find_register(&h, 1), 4) == 0);
+    fail_unless(hll_find_register(&h, 1)->capacity == 4);
+    fail_unless(hll_register_points(&h, hll_find_register(&h, 1))[2].register_ == 5);
+    fail_unless(h.arena.free_lists[1] == 0);
+
+    // Adding a register copies the headers of its block out
+    fail_unless(hll_create_register(&h, 2) != NULL);
+    hll_register_block *b = &h.register_blocks[0];
+    fail_unless(b->registers < h.loaded_registers || b->registers >= h.loaded_registers + 3);
+    fail_unless(hll_find_register(&h, 1)->size == 3);
+    fail_unless(hll_find_register(&h, 2)->size == 0);
+    fail_unless(hll_register_points(&h, hll_find_register(&h, 1))[1].register_ == 5);
+
+    // Other blocks keep sharing
+    fail_unless(hll_find_register(&h, 70) == h.loaded_registers + 2);
+    fail_unless(hll_compact(&h) == 0);
+    fail_unless(hll_find_register(&h, 3) == NULL);
+    fail_unless(hll_find_register(&h, 70)->size == 1);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
 START_TEST(test_shll_error_bound)
 {
     // Precision 14 -> variance of 1%
@@ -128,6 +457,32 @@ START_TEST(test_shll_error_bound)
 END_TEST
 
 
+START_TEST(test_shll_size_multi)
+{
+    hll_t h;
+    fail_unless(hll_init(14, 1000, 1, &h) == 0);
+
+    char buf[100];
+    for (int i=0; i < 20000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add_at_time(&h, (char*)&buf, 1000 + i/100);
+    }
+
+    // Every window should match a single window query
+    time_t windows[] = {10, 60, 100, 200, 1000};
+    double estimates[5];
+    fail_unless(hll_size_multi(&h, 1200, windows, 5, estimates) == 0);
+    for (int i=0; i < 5; i++) {
+        fail_unless(estimates[i] == hll_size(&h, 1200, windows[i]));
+    }
+    fail_unless(estimates[0] < estimates[1]);
+    fail_unless(estimates[3] > 19000);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+
 START_TEST(test_shll_time_queries)
 {
     // Precision 14 -> variance of 1%
@@ -140,9 +495,9 @@ START_TEST(test_shll_time_queries)
         hll_add_at_time(&h, (char*)&buf, 2*i/10000);
     }
 
-    // Should be within 1'ish%
+    // Windows end at the newest point, should be within 1'ish%
     for(int i=0; i<9; i++) {
-        double s = hll_size(&h, i, 18);
+        double s = hll_size(&h, 19, i + 1);
         fail_unless(s > 5000*(i+2)-300 && s < 5000*(i+2)+300);
     }
 
@@ -7,12 +7,15 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <rocksdb/c.h>
 
 #include "hll.h"
 #include "serialize.h"
 
 #include "config.h"
+#include "set.h"
 #include "sparse.h"
+#include "hash.h"
 
 START_TEST(test_sparse_init_destroy)
 {
@@ -76,6 +79,562 @@ START_TEST(test_sparse_insert) {
 }
 END_TEST
 
+START_TEST(test_sparse_size_multi) {
+    const char *key = "test_sparse_size_multi";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+
+    uint64_t hashes[] = {123, 456, 789};
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes, 1, 10) == 1);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes + 1, 1, 20) == 2);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes + 2, 1, 30) == 3);
+
+    uint64_t windows[] = {5, 15, 25};
+    uint64_t counts[3];
+    fail_unless(sparse_size_multi(sparsedb, key, strlen(key), 30, windows, 3, counts) == 0);
+    fail_unless(counts[0] == 1);
+    fail_unless(counts[1] == 2);
+    fail_unless(counts[2] == 3);
+
+    // Points after the timestamp are not counted
+    fail_unless(sparse_size_multi(sparsedb, key, strlen(key), 20, windows, 3, counts) == 0);
+    fail_unless(counts[0] == 1);
+    fail_unless(counts[1] == 2);
+    fail_unless(counts[2] == 2);
+
+    res = destroy_sparse(sparsedb);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_cache) {
+    const char *key = "test_sparse_cache";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+
+    // The first access misses, the rest are served from memory
+    sparse_cache_stats stats;
+    uint64_t hashes[] = {123, 456, 789};
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes, 2, 10) == 2);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 10, 5) == 2);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.misses == 1);
+    fail_unless(stats.hits == 1);
+    fail_unless(stats.entries == 1);
+    fail_unless(stats.dirty == 1);
+    fail_unless(stats.memory > 0);
+
+    fail_unless(sparse_flush(sparsedb) == 0);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.dirty == 0);
+
+    // Unflushed writes are written back on close
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes + 2, 1, 20) == 3);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_size_total(sparsedb, key, strlen(key)) == 3);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 20, 5) == 1);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    // Without a budget every write goes straight through
+    config.sparse_cache_memory = 0;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes, 1, 30) == 3);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.entries == 0);
+    fail_unless(stats.dirty == 0);
+    fail_unless(stats.evictions == 1);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 30, 5) == 1);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+    fail_unless(sparse_is_dense(sparsedb, key, strlen(key)) == -1);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_merge) {
+    const char *key = "test_sparse_merge";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+
+    uint64_t hashes[] = {123, 456, 789};
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes, 2, 10) == 2);
+    fail_unless(sparse_flush(sparsedb) == 0);
+
+    // Only the new points are merged, and timestamps never go back
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes + 1, 2, 20) == 3);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes + 1, 1, 5) == 3);
+    fail_unless(sparse_flush(sparsedb) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_size_total(sparsedb, key, strlen(key)) == 3);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 20, 5) == 2);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 10, 5) == 1);
+
+    // Re-adding more hashes than the set holds merges the whole set
+    for (int i = 0; i < 4; i++) {
+        fail_unless(sparse_add(sparsedb, key, strlen(key), hashes, 3, 30 + i) == 3);
+    }
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_size_total(sparsedb, key, strlen(key)) == 3);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 33, 0) == 3);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_sorted) {
+    const char *key = "test_sparse_sorted";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+
+    // Duplicates within a batch only count once
+    uint64_t first[] = {900, 100, 500, 100};
+    uint64_t second[] = {700, 500, 50, 1000};
+    fail_unless(sparse_add(sparsedb, key, strlen(key), first, 4, 10) == 3);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), second, 4, 20) == 6);
+    fail_unless(sparse_flush(sparsedb) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    hll_sparse_point *points;
+    size_t size;
+    fail_unless(sparse_get_points(sparsedb, key, strlen(key), &points, &size) == 0);
+    fail_unless(size == 6);
+    for (size_t i = 1; i < size; i++) {
+        fail_unless(points[i - 1].hash < points[i].hash);
+    }
+    fail_unless(points[0].hash == 50 && points[0].timestamp == 20);
+    fail_unless(points[1].hash == 100 && points[1].timestamp == 10);
+    fail_unless(points[2].hash == 500 && points[2].timestamp == 20);
+    free(points);
+
+    // Windows that hold all or none of the points
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 20, 10) == 6);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 9, 5) == 0);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 40, 5) == 0);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 15, 5) == 2);
+
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_pinned_reads) {
+    const char *key = "test_sparse_pinned_reads";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+
+    uint64_t hashes[] = {123, 456, 789};
+    fail_unless(sparse_add(sparsedb, key, strlen(key), hashes, 3, 10) == 3);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    // Checking density does not load the set
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    sparse_cache_stats stats;
+    fail_unless(sparse_is_dense(sparsedb, key, strlen(key)) == 0);
+    fail_unless(sparse_is_dense(sparsedb, "test_sparse_pinned_none", 23) == -1);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.entries == 0);
+
+    fail_unless(sparse_size_total(sparsedb, key, strlen(key)) == 3);
+    fail_unless(sparse_is_dense(sparsedb, key, strlen(key)) == 0);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.entries == 1);
+    fail_unless(stats.hits == 1);
+
+    // Dense data is read in place
+    sparse_value value;
+    fail_unless(sparse_read_dense_value(sparsedb, key, strlen(key), &value) == 0);
+    fail_unless(value.len == 0);
+    sparse_release_value(&value);
+
+    const unsigned char data[] = {1, 2, 3, 4, 5};
+    fail_unless(sparse_write_dense_data(sparsedb, key, strlen(key), data, sizeof(data)) == 0);
+    fail_unless(sparse_read_dense_value(sparsedb, key, strlen(key), &value) == 0);
+    fail_unless(value.len == sizeof(data));
+    fail_unless(memcmp(value.data, data, sizeof(data)) == 0);
+    sparse_release_value(&value);
+    fail_unless(value.data == NULL);
+
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_encoding) {
+    const char *key = "test_sparse_encoding";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+
+    // Hashes and timestamps far apart survive the encoding
+    uint64_t low[] = {1, 0x8000000000000000ULL};
+    uint64_t high[] = {0xFFFFFFFFFFFFFFFFULL, 2};
+    fail_unless(sparse_add(sparsedb, key, strlen(key), low, 2, 1400000000) == 2);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), high, 2, 1400000007) == 4);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    hll_sparse_point *points;
+    size_t size;
+    fail_unless(sparse_get_points(sparsedb, key, strlen(key), &points, &size) == 0);
+    fail_unless(size == 4);
+    fail_unless(points[0].hash == 1 && points[0].timestamp == 1400000000);
+    fail_unless(points[1].hash == 2 && points[1].timestamp == 1400000007);
+    fail_unless(points[2].hash == 0x8000000000000000ULL && points[2].timestamp == 1400000000);
+    fail_unless(points[3].hash == 0xFFFFFFFFFFFFFFFFULL && points[3].timestamp == 1400000007);
+    free(points);
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    // Quantized timestamps round down to the sliding precision
+    config.sparse_quantize = 1;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), low, 2, 1400000019) == 2);
+    fail_unless(sparse_add(sparsedb, key, strlen(key), high, 2, 1400000100) == 4);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_get_points(sparsedb, key, strlen(key), &points, &size) == 0);
+    fail_unless(size == 4);
+    fail_unless(points[0].timestamp == 1399999980);
+    fail_unless(points[1].timestamp == 1400000100);
+    free(points);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 1400000100, 120) == 4);
+    fail_unless(sparse_size(sparsedb, key, strlen(key), 1400000019, 10) == 0);
+
+    fail_unless(sparse_drop(sparsedb, key, strlen(key)) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_expire) {
+    const char *live = "test_sparse_expire_live";
+    const char *dead = "test_sparse_expire_dead";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, live, strlen(live)) == 0);
+    fail_unless(sparse_drop(sparsedb, dead, strlen(dead)) == 0);
+
+    time_t now = time(NULL);
+    time_t old = now - config.sliding_period - 3600;
+    uint64_t hashes[] = {0x1000000000000000ULL, 0x8000000000000000ULL, 0xF000000000000000ULL};
+    fail_unless(sparse_add(sparsedb, live, strlen(live), hashes, 2, old) == 2);
+    fail_unless(sparse_add(sparsedb, live, strlen(live), hashes + 2, 1, now) == 3);
+    fail_unless(sparse_add(sparsedb, dead, strlen(dead), hashes, 3, old) == 3);
+    fail_unless(sparse_flush(sparsedb) == 0);
+    sparse_compact(sparsedb);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    // Expired points are gone, and so is a set with nothing left
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_size_total(sparsedb, live, strlen(live)) == 1);
+    fail_unless(sparse_is_dense(sparsedb, dead, strlen(dead)) == -1);
+
+    // Dense sets lose their expired points, but are kept
+    hll_t h;
+    fail_unless(hll_init(12, config.sliding_period, config.sliding_precision, &h) == 0);
+    hll_add_hash_at_time(&h, hashes[0], old);
+    hll_add_hash_at_time(&h, hashes[1], now);
+    fail_unless(serialize_hll_to_sparsedb(sparsedb, &h, (char*)live, strlen(live)) == 0);
+    fail_unless(hll_destroy(&h) == 0);
+    sparse_compact(sparsedb);
+
+    hll_t loaded;
+    fail_unless(unserialize_hll_from_sparsedb(sparsedb, &loaded, (char*)live, strlen(live)) == 0);
+    double size = hll_size_total(&loaded);
+    fail_unless(size > 0.5 && size < 1.5);
+    fail_unless(hll_destroy(&loaded) == 0);
+
+    // The empty value left by a deleted dense set is dropped
+    fail_unless(sparse_write_dense_data(sparsedb, dead, strlen(dead), (unsigned char*)"", 0) == 0);
+    sparse_compact(sparsedb);
+    sparse_value value;
+    fail_unless(sparse_read_dense_value(sparsedb, dead, strlen(dead), &value) == 0);
+    fail_unless(value.handle == NULL);
+
+    fail_unless(sparse_drop(sparsedb, live, strlen(live)) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_column_families) {
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.data_dir = (char*)"/tmp/slidingd_column_families";
+    delete_dir(config.data_dir);
+
+    // Write a database the way it was before column families
+    rocksdb_options_t *options = rocksdb_options_create();
+    rocksdb_options_set_create_if_missing(options, 1);
+    char *err = NULL;
+    rocksdb_t *db = rocksdb_open(options, config.data_dir, &err);
+    fail_unless(err == NULL);
+    rocksdb_writeoptions_t *writeoptions = rocksdb_writeoptions_create();
+    hll_sparse_point points[] = {{20, 2}, {10, 1}};
+    rocksdb_put(db, writeoptions, "legacy_sparse", 13, (const char*)points, sizeof(points), &err);
+    rocksdb_put(db, writeoptions, "legacy_dense", 12, "-", 1, &err);
+    rocksdb_put(db, writeoptions, "dense~legacy_dense", 18, "abc", 3, &err);
+    rocksdb_put(db, writeoptions, "meta~hash", 9, "xxh64", 5, &err);
+    fail_unless(err == NULL);
+    rocksdb_writeoptions_destroy(writeoptions);
+    rocksdb_close(db);
+    rocksdb_options_destroy(options);
+
+    // Opening moves everything into its family
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(hash_current_algorithm() == HASH_XXH64);
+    fail_unless(sparse_is_dense(sparsedb, "legacy_sparse", 13) == 0);
+    fail_unless(sparse_size_total(sparsedb, "legacy_sparse", 13) == 2);
+    fail_unless(sparse_is_dense(sparsedb, "legacy_dense", 12) == 1);
+    fail_unless(sparse_is_dense(sparsedb, "meta~hash", 9) == -1);
+
+    sparse_value value;
+    fail_unless(sparse_read_dense_value(sparsedb, "legacy_dense", 12, &value) == 0);
+    fail_unless(value.len == 3);
+    fail_unless(memcmp(value.data, "abc", 3) == 0);
+    sparse_release_value(&value);
+
+    // Each family reports its own stats
+    char *stats = sparse_get_stats(sparsedb);
+    fail_unless(stats != NULL);
+    fail_unless(strstr(stats, "== sparse ==") != NULL);
+    fail_unless(strstr(stats, "== dense ==") != NULL);
+    fail_unless(strstr(stats, "== meta ==") != NULL);
+    free(stats);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    // Nothing is left to move on the next open
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(hash_current_algorithm() == HASH_XXH64);
+    fail_unless(sparse_size_total(sparsedb, "legacy_sparse", 13) == 2);
+    fail_unless(sparse_is_dense(sparsedb, "legacy_dense", 12) == 1);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    hash_use_algorithm(HASH_MURMUR3);
+}
+END_TEST
+
+START_TEST(test_sparse_size_keys) {
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.data_dir = (char*)"/tmp/slidingd_size_keys";
+    delete_dir(config.data_dir);
+
+    // Seed a dense set, which is never loaded into the cache
+    rocksdb_options_t *options = rocksdb_options_create();
+    rocksdb_options_set_create_if_missing(options, 1);
+    char *err = NULL;
+    rocksdb_t *db = rocksdb_open(options, config.data_dir, &err);
+    fail_unless(err == NULL);
+    rocksdb_writeoptions_t *writeoptions = rocksdb_writeoptions_create();
+    rocksdb_put(db, writeoptions, "dense", 5, "-", 1, &err);
+    fail_unless(err == NULL);
+    rocksdb_writeoptions_destroy(writeoptions);
+    rocksdb_close(db);
+    rocksdb_options_destroy(options);
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    uint64_t hashes[] = {123, 456, 789};
+    fail_unless(sparse_add(sparsedb, "stored", 6, hashes, 3, 10) == 3);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    // After a reopen only the cached set is in memory
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_add(sparsedb, "cached", 6, hashes, 1, 30) == 1);
+    fail_unless(sparse_add(sparsedb, "cached", 6, hashes + 1, 1, 40) == 2);
+
+    char *names[] = {(char*)"cached", (char*)"stored", (char*)"missing", (char*)"dense"};
+    int lens[] = {6, 6, 7, 5};
+    int64_t counts[4];
+    fail_unless(sparse_size_keys(sparsedb, names, lens, 4, 40, 15, counts) == 0);
+    fail_unless(counts[0] == 2);
+    fail_unless(counts[1] == 0);
+    fail_unless(counts[2] == 0);
+    fail_unless(counts[3] == HLL_IS_DENSE);
+
+    fail_unless(sparse_size_keys(sparsedb, names, lens, 4, 35, 30, counts) == 0);
+    fail_unless(counts[0] == 1);
+    fail_unless(counts[1] == 3);
+    fail_unless(counts[2] == 0);
+    fail_unless(counts[3] == HLL_IS_DENSE);
+
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+static void count_failed_sets(void *data, const char *key, int key_len) {
+    (void)key; (void)key_len;
+    (*(int*)data)++;
+}
+
+START_TEST(test_sparse_batch) {
+    const char *first = "test_sparse_batch_first";
+    const char *second = "test_sparse_batch_second";
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.sparse_cache_memory = 0;
+
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_drop(sparsedb, first, strlen(first)) == 0);
+    fail_unless(sparse_drop(sparsedb, second, strlen(second)) == 0);
+
+    // Without a cache, sets are written back as soon as they change
+    sparse_cache_stats stats;
+    uint64_t hashes[] = {123, 456, 789};
+    fail_unless(sparse_add(sparsedb, first, strlen(first), hashes, 1, 10) == 1);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.entries == 0);
+    fail_unless(stats.evictions == 1);
+
+    // A batch without writes leaves nothing to write back
+    sparse_begin_batch();
+    fail_unless(sparse_batch_pending() == 0);
+    fail_unless(sparse_commit_batch(sparsedb, NULL, NULL) == 0);
+
+    // In a batch they are kept until the commit
+    sparse_begin_batch();
+    fail_unless(sparse_add(sparsedb, first, strlen(first), hashes + 1, 1, 20) == 2);
+    fail_unless(sparse_add(sparsedb, second, strlen(second), hashes, 3, 20) == 3);
+    fail_unless(sparse_batch_pending() == 1);
+    fail_unless(sparse_size(sparsedb, first, strlen(first), 20, 20) == 2);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.entries == 2);
+    fail_unless(stats.dirty == 2);
+    fail_unless(stats.evictions == 1);
+
+    // Nested batches commit with the outermost one
+    sparse_begin_batch();
+    fail_unless(sparse_commit_batch(sparsedb, NULL, NULL) == 0);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.entries == 2);
+    fail_unless(sparse_batch_pending() == 1);
+
+    // Both sets are written back together, and none fail
+    int failed = 0;
+    fail_unless(sparse_commit_batch(sparsedb, count_failed_sets, &failed) == 0);
+    fail_unless(failed == 0);
+    fail_unless(sparse_batch_pending() == 0);
+    sparse_get_cache_stats(sparsedb, &stats);
+    fail_unless(stats.entries == 0);
+    fail_unless(stats.dirty == 0);
+    fail_unless(stats.evictions == 3);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(sparse_size_total(sparsedb, first, strlen(first)) == 2);
+    fail_unless(sparse_size_total(sparsedb, second, strlen(second)) == 3);
+    fail_unless(sparse_drop(sparsedb, first, strlen(first)) == 0);
+    fail_unless(sparse_drop(sparsedb, second, strlen(second)) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+}
+END_TEST
+
+START_TEST(test_sparse_hash_meta) {
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.data_dir = (char*)"/tmp/slidingd_hash_meta";
+    delete_dir(config.data_dir);
+    config.hash = (char*)"xxh64";
+    config.hash_algorithm = HASH_XXH64;
+
+    // A new database records the configured hash
+    slidingd_sparsedb *sparsedb;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(hash_current_algorithm() == HASH_XXH64);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    // Reopening keeps it, whatever the config says
+    config.hash = (char*)"murmur3";
+    config.hash_algorithm = HASH_MURMUR3;
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(hash_current_algorithm() == HASH_XXH64);
+    fail_unless(config.hash_algorithm == HASH_XXH64);
+
+    // A set named like the old record does not touch it
+    uint64_t hashes[] = {519865238786025774};
+    fail_unless(sparse_add(sparsedb, "meta~hash", 9, hashes, 1, 10) == 1);
+    fail_unless(sparse_drop(sparsedb, "meta~hash", 9) == 0);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    res = init_sparse(&config, &sparsedb);
+    fail_unless(res == 0);
+    fail_unless(hash_current_algorithm() == HASH_XXH64);
+    fail_unless(destroy_sparse(sparsedb) == 0);
+
+    hash_use_algorithm(HASH_MURMUR3);
+}
+END_TEST
+
 START_TEST(test_sparse_convert) {
     const char *key = "test_sparse_convert";
     hlld_config config;
@@ -106,19 +665,17 @@ START_TEST(test_sparse_convert) {
     fail_unless(sparse_size(sparsedb, key, strlen(key), 30, 10) == 1);
     fail_unless(sparse_size(sparsedb, key, strlen(key), 30, 30) == 3);
 
-    hll_t h;
-    fail_unless(hll_init(12, 100, 1, &h) == 0);
+    hlld_set *set;
+    fail_unless(init_set(&config, (char*)key, 0, &set) == 0);
     fail_unless(sparse_convert_dense(
         sparsedb, key, strlen(key),
-        &h
+        set
     ) == 0);
 
     fail_unless(sparse_size(sparsedb, key, strlen(key), 30, 30) == HLL_IS_DENSE);
+    fail_unless(hset_size_total(set) == 3);
 
-    double est_f = hll_size_total(&h);
-    fail_unless(est_f > 2.99 && est_f < 3.01);
-
-    fail_unless(hll_destroy(&h) == 0);
+    fail_unless(destroy_set(set) == 0);
 
     res = destroy_sparse(sparsedb);
     fail_unless(res == 0);